@@ -0,0 +1,168 @@
+/*=============================================================================
+
+  This file is part of the Umbrella project.
+  Copyright (C) The Juston.co Owners - All rights reserved.
+
+  For more details, visit http://juston.co/umbrella
+
+==============================================================================*/
+
+/* BENCHMARKING the hashes of htlib: SHA-1, used for websocket handshakes
+   and ETags, and MD5, used for digest authentication. Each is timed on a
+   bulk input, as for the ETag of a large file, and on handshake-sized
+   ones. The inputs are always the same, so timings can be compared between
+   builds and machines, e.g. "make bench" here and on an older checkout.
+   The digests are checked first, with every SHA-1 implementation. */
+
+#include "htlib.c"
+
+#define BULK_SIZE (64 * 1024 * 1024)
+#define SMALL_COUNT 1000000
+
+static double now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void tohex(char *hex, const unsigned char *digest, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static void sha1(const unsigned char *data, size_t len, unsigned char out[20])
+{
+  SHA1_CTX ctx;
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, data, (uint32_t) len);
+  SHA1Final(out, &ctx);
+}
+
+static void md5(const unsigned char *data, size_t len, unsigned char out[16])
+{
+  MD5_CTX ctx;
+
+  MD5Init(&ctx);
+  MD5Update(&ctx, data, (unsigned) len);
+  MD5Final(out, &ctx);
+}
+
+/* Check a known digest, and the bulk input against the generic SHA-1 */
+static int check(const unsigned char *bulk, const char *name)
+{
+  unsigned char digest[20], generic[20];
+  char hex[41];
+  int failed = 0;
+
+  sha1((const unsigned char *) "abc", 3, digest);
+  tohex(hex, digest, 20);
+  if (strcmp(hex, "a9993e364706816aba3e25717850c26c9cd0d89d"))
+  {
+    printf("FAILED: SHA-1 (%s) of abc gave %s\n", name, hex);
+    failed++;
+  }
+
+  sha1(bulk, BULK_SIZE, digest);
+  sha1_impl = sha1_blocks_generic;
+  sha1(bulk, BULK_SIZE, generic);
+  if (memcmp(digest, generic, sizeof(digest)))
+  {
+    printf("FAILED: SHA-1 (%s) of the bulk input differs\n", name);
+    failed++;
+  }
+
+  md5((const unsigned char *) "abc", 3, digest);
+  tohex(hex, digest, 16);
+  if (strcmp(hex, "900150983cd24fb0d6963f7d28e17f72"))
+  {
+    printf("FAILED: MD5 of abc gave %s\n", hex);
+    failed++;
+  }
+
+  return failed;
+}
+
+static void bench_sha1(const unsigned char *bulk, const char *name)
+{
+  static const char key[] =
+    "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  unsigned char digest[20];
+  double start;
+  int i;
+
+  start = now_ms();
+  sha1(bulk, BULK_SIZE, digest);
+  printf("SHA-1 %-8s %d MB:       %.0f MB/s\n", name, BULK_SIZE >> 20,
+         (BULK_SIZE >> 20) * 1000.0 / (now_ms() - start));
+
+  start = now_ms();
+  for (i = 0; i < SMALL_COUNT; i++)
+  {
+    sha1((const unsigned char *) key, sizeof(key) - 1, digest);
+  }
+  printf("SHA-1 %-8s handshake:   %.0f ns\n", name,
+         (now_ms() - start) * 1000000.0 / SMALL_COUNT);
+}
+
+static void bench_md5(const unsigned char *bulk)
+{
+  char ha1[33];
+  unsigned char digest[16];
+  double start;
+  int i;
+
+  start = now_ms();
+  md5(bulk, BULK_SIZE, digest);
+  printf("MD5            %d MB:       %.0f MB/s\n", BULK_SIZE >> 20,
+         (BULK_SIZE >> 20) * 1000.0 / (now_ms() - start));
+
+  start = now_ms();
+  for (i = 0; i < SMALL_COUNT; i++)
+  {
+    ht_md5(ha1, "user", ":", "mydomain.com", ":", "password", NULL);
+  }
+  printf("MD5            digest auth: %.0f ns\n",
+         (now_ms() - start) * 1000000.0 / SMALL_COUNT);
+}
+
+int main()
+{
+  unsigned char *bulk;
+  uint32_t x = 2463534242u;
+  int i, failed = 0;
+
+  if (!(bulk = (unsigned char *) malloc(BULK_SIZE)))
+  {
+    fprintf(stderr, "Memory not allocated");
+    return 1;
+  }
+  for (i = 0; i < BULK_SIZE; i++)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bulk[i] = (unsigned char) x;
+  }
+
+  select_sha1_impl();
+#ifdef NS_ENABLE_SHA_NI
+  if (sha1_impl == sha1_blocks_sha_ni)
+  {
+    failed += check(bulk, "SHA-NI");
+    sha1_impl = sha1_blocks_sha_ni;
+    bench_sha1(bulk, "SHA-NI");
+  }
+  else printf("SHA-NI is not supported by this CPU\n");
+#endif
+  failed += check(bulk, "generic");
+  bench_sha1(bulk, "generic");
+  bench_md5(bulk);
+
+  free(bulk);
+  return failed != 0;
+}
@@ -23,6 +23,15 @@
 #define __STDC_LIMIT_MACROS     // C++ wants that for INT64_MAX
 #define _LARGEFILE_SOURCE       // Enable fseeko() and ftello() functions
 #define _FILE_OFFSET_BITS 64    // Enable 64-bit file offsets
+#ifdef __linux__
+#define _GNU_SOURCE             // For accept4(), splice() and pipe2()
+#ifndef NS_DISABLE_SPLICE
+#define NS_ENABLE_SPLICE
+#endif
+#ifndef NS_DISABLE_ACCEPT4
+#define NS_ENABLE_ACCEPT4
+#endif
+#endif
 
 #ifdef _MSC_VER
 #pragma warning (disable : 4127)  // FD_SET() emits warning, disable it
@@ -110,6 +119,13 @@ typedef void *SSL;
 typedef void *SSL_CTX;
 #endif
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(NS_DISABLE_SHA_NI)
+#define NS_ENABLE_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
@@ -150,6 +166,14 @@ enum ns_event {
 struct ns_connection;
 typedef void (*ns_callback_t)(struct ns_connection *, enum ns_event, void *evp);
 
+struct ns_stats {
+  size_t buffered;            // Bytes held in all connection buffers
+  size_t peak_buffered;       // Maximum of the above
+  int num_connections;
+  int num_throttled;          // Connections that are not being read
+  unsigned long num_pauses;   // Times a connection got throttled
+};
+
 struct ns_server {
   void *server_data;
   sock_t listening_sock;
@@ -158,6 +182,14 @@ struct ns_server {
   SSL_CTX *ssl_ctx;
   SSL_CTX *client_ssl_ctx;
   sock_t ctl[2];
+  size_t high_water;          // Send buffer watermarks, see ns_throttle()
+  size_t low_water;
+  size_t mem_budget;          // Limit for stats.buffered, 0 means no limit
+  struct ns_stats stats;      // Updated on each ns_server_poll()
+  int accept_batch;           // Max connections accepted per poll, Linux only
+  size_t conn_data_size;      // User space after accepted connections
+  struct ns_connection *free_conns;  // Pool of accepted connections
+  void *conn_slabs;           // Memory of the pool
 };
 
 struct ns_connection {
@@ -170,6 +202,12 @@ struct ns_connection {
   SSL *ssl;
   void *connection_data;
   time_t last_io_time;
+  struct ns_connection *forward_to;    // Set by ns_link(), see below
+  struct ns_connection *forward_from;  // Connection that forwards to us
+#ifdef NS_ENABLE_SPLICE
+  int splice_pipe[2];                  // Data in transit to forward_to
+  size_t splice_len;                   // Number of bytes in splice_pipe
+#endif
   unsigned int flags;
 #define NSF_FINISHED_SENDING_DATA   (1 << 0)
 #define NSF_BUFFER_BUT_DONT_SEND    (1 << 1)
@@ -179,6 +217,9 @@ struct ns_connection {
 #define NSF_ACCEPTED                (1 << 5)
 #define NSF_WANT_READ               (1 << 6)
 #define NSF_WANT_WRITE              (1 << 7)
+#define NSF_SPLICED                 (1 << 8)
+#define NSF_THROTTLED               (1 << 9)
+#define NSF_POOLED                  (1 << 10)
 
 #define NSF_USER_1                  (1 << 26)
 #define NSF_USER_2                  (1 << 27)
@@ -206,6 +247,19 @@ int ns_send(struct ns_connection *, const void *buf, int len);
 int ns_printf(struct ns_connection *, const char *fmt, ...);
 int ns_vprintf(struct ns_connection *, const char *fmt, va_list ap);
 
+// Forward everything received on 'from' to 'to', throttling 'from' as
+// ns_throttle() does. On Linux, plain sockets are spliced through a pipe,
+// so that data never gets copied to user space; in that case 'from' gets
+// no NS_RECV events. Otherwise, the NS_RECV handler of 'from' must still
+// pass the data on.
+void ns_link(struct ns_connection *from, struct ns_connection *to);
+
+// Stop reading 'src' once 'dst' has high_water bytes queued for sending, or
+// all buffers together exceed mem_budget. Resume when 'dst' drains down to
+// low_water. NULL 'dst' resumes unconditionally. Meant to be called on
+// NS_POLL. Return 1 if 'src' is throttled.
+int ns_throttle(struct ns_connection *src, const struct ns_connection *dst);
+
 // Utility functions
 void *ns_start_thread(void *(*f)(void *), void *p);
 int ns_socketpair(sock_t [2]);
@@ -248,6 +302,26 @@ int ns_hexdump(const void *buf, int len, char *dst, int dst_len);
 #define NS_FREE free
 #endif
 
+#ifndef NS_ACCEPT_BATCH
+#define NS_ACCEPT_BATCH 64
+#endif
+
+#ifndef NS_CONN_SLAB_SIZE
+#define NS_CONN_SLAB_SIZE 32
+#endif
+
+#ifndef NS_HIGH_WATERMARK
+#define NS_HIGH_WATERMARK (64 * 1024)
+#endif
+
+#ifndef NS_LOW_WATERMARK
+#define NS_LOW_WATERMARK (16 * 1024)
+#endif
+
+#ifndef NS_SPLICE_SIZE
+#define NS_SPLICE_SIZE (64 * 1024)  // Default pipe capacity on Linux
+#endif
+
 struct ctl_msg {
   ns_callback_t callback;
   char message[1024 * 8];
@@ -399,8 +473,93 @@ static void ns_call(struct ns_connection *conn, enum ns_event ev, void *p) {
   if (conn->server->callback) conn->server->callback(conn, ev, p);
 }
 
+#ifdef NS_ENABLE_SPLICE
+// Stop splicing: move whatever is left in the pipe to the send buffer
+static void ns_unsplice(struct ns_connection *conn) {
+  char buf[8192];
+  int n;
+
+  if (!(conn->flags & NSF_SPLICED)) return;
+  while (conn->splice_len > 0 &&
+         (n = read(conn->splice_pipe[0], buf, sizeof(buf))) > 0) {
+    if (conn->forward_to != NULL) {
+      iobuf_append(&conn->forward_to->send_iobuf, buf, n);
+    }
+    conn->splice_len -= n;
+  }
+  close(conn->splice_pipe[0]);
+  close(conn->splice_pipe[1]);
+  conn->splice_len = 0;
+  conn->flags &= ~NSF_SPLICED;
+}
+#endif
+
+static void ns_unlink(struct ns_connection *conn) {
+#ifdef NS_ENABLE_SPLICE
+  ns_unsplice(conn);
+  if (conn->forward_from != NULL) {
+    // Pending data has nowhere to go
+    conn->forward_from->forward_to = NULL;
+    ns_unsplice(conn->forward_from);
+  }
+#endif
+  if (conn->forward_to != NULL) conn->forward_to->forward_from = NULL;
+  if (conn->forward_from != NULL) {
+    conn->forward_from->forward_to = NULL;
+    ns_throttle(conn->forward_from, NULL);
+  }
+  ns_throttle(conn, NULL);
+  conn->forward_to = conn->forward_from = NULL;
+}
+
+// Accepted connections are carved out of slabs of NS_CONN_SLAB_SIZE, each
+// followed by conn_data_size zeroed bytes for the user (NSF_POOLED is set),
+// and go back to a free list when closed. Slabs are freed with the server.
+static size_t ns_pooled_conn_size(const struct ns_server *s) {
+  return (sizeof(struct ns_connection) + s->conn_data_size + 15) &
+    ~(size_t) 15;
+}
+
+static struct ns_connection *ns_alloc_pooled_conn(struct ns_server *s) {
+  size_t size = ns_pooled_conn_size(s);
+  struct ns_connection *c;
+  char *slab;
+  int i;
+
+  if (s->free_conns == NULL) {
+    // Slab starts with a pointer to the previous one
+    if ((slab = (char *) NS_MALLOC(16 + size * NS_CONN_SLAB_SIZE)) == NULL) {
+      return NULL;
+    }
+    * (void **) slab = s->conn_slabs;
+    s->conn_slabs = slab;
+    for (i = NS_CONN_SLAB_SIZE - 1; i >= 0; i--) {
+      c = (struct ns_connection *) (slab + 16 + size * i);
+      c->next = s->free_conns;
+      s->free_conns = c;
+    }
+  }
+
+  c = s->free_conns;
+  s->free_conns = c->next;
+  memset(c, 0, size);
+  c->flags = NSF_POOLED;
+
+  return c;
+}
+
+static void ns_free_conn(struct ns_connection *conn) {
+  if (conn->flags & NSF_POOLED) {
+    conn->next = conn->server->free_conns;
+    conn->server->free_conns = conn;
+  } else {
+    NS_FREE(conn);
+  }
+}
+
 static void ns_close_conn(struct ns_connection *conn) {
   DBG(("%p %d", conn, conn->flags));
+  ns_unlink(conn);
   ns_call(conn, NS_CLOSE, NULL);
   ns_remove_conn(conn);
   closesocket(conn->sock);
@@ -411,7 +570,7 @@ static void ns_close_conn(struct ns_connection *conn) {
     SSL_free(conn->ssl);
   }
 #endif
-  NS_FREE(conn);
+  ns_free_conn(conn);
 }
 
 void ns_set_close_on_exec(sock_t sock) {
@@ -585,9 +744,13 @@ static struct ns_connection *accept_conn(struct ns_server *server) {
   sock_t sock = INVALID_SOCKET;
 
   // NOTE(lsm): on Windows, sock is always > FD_SETSIZE
+#ifdef NS_ENABLE_ACCEPT4
+  if ((sock = accept4(server->listening_sock, &sa.sa, &len,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC)) == INVALID_SOCKET) {
+#else
   if ((sock = accept(server->listening_sock, &sa.sa, &len)) == INVALID_SOCKET) {
-  } else if ((c = (struct ns_connection *) NS_MALLOC(sizeof(*c))) == NULL ||
-             memset(c, 0, sizeof(*c)) == NULL) {
+#endif
+  } else if ((c = ns_alloc_pooled_conn(server)) == NULL) {
     closesocket(sock);
 #ifdef NS_ENABLE_SSL
   } else if (server->ssl_ctx != NULL &&
@@ -595,12 +758,15 @@ static struct ns_connection *accept_conn(struct ns_server *server) {
               SSL_set_fd(c->ssl, sock) != 1)) {
     DBG(("SSL error"));
     closesocket(sock);
-    free(c);
+    if (c->ssl != NULL) SSL_free(c->ssl);
+    ns_free_conn(c);
     c = NULL;
 #endif
   } else {
+#ifndef NS_ENABLE_ACCEPT4
     ns_set_close_on_exec(sock);
     ns_set_non_blocking_mode(sock);
+#endif
     c->server = server;
     c->sock = sock;
     c->flags |= NSF_ACCEPTED;
@@ -748,6 +914,16 @@ static void ns_read_from_socket(struct ns_connection *conn) {
   }
 }
 
+// Return 1 if the peer has spliced data waiting to be sent to us
+static int ns_has_spliced_data(const struct ns_connection *conn) {
+#ifdef NS_ENABLE_SPLICE
+  return conn->forward_from != NULL && conn->forward_from->splice_len > 0;
+#else
+  (void) conn;
+  return 0;
+#endif
+}
+
 static void ns_write_to_socket(struct ns_connection *conn) {
   struct iobuf *io = &conn->send_iobuf;
   int n = 0;
@@ -775,9 +951,14 @@ static void ns_write_to_socket(struct ns_connection *conn) {
     conn->flags |= NSF_CLOSE_IMMEDIATELY;
   } else if (n > 0) {
     iobuf_remove(io, n);
+    // Do not keep a large buffer around once it is drained
+    if (io->len == 0 && io->size > conn->server->high_water) {
+      iobuf_free(io);
+    }
   }
 
-  if (io->len == 0 && conn->flags & NSF_FINISHED_SENDING_DATA) {
+  if (io->len == 0 && conn->flags & NSF_FINISHED_SENDING_DATA &&
+      !ns_has_spliced_data(conn)) {
     conn->flags |= NSF_CLOSE_IMMEDIATELY;
   }
 }
@@ -786,6 +967,94 @@ int ns_send(struct ns_connection *conn, const void *buf, int len) {
   return iobuf_append(&conn->send_iobuf, buf, len);
 }
 
+void ns_link(struct ns_connection *from, struct ns_connection *to) {
+  if (from->forward_to != NULL || to->forward_from != NULL) return;
+
+  // Data that is already buffered goes first
+  iobuf_append(&to->send_iobuf, from->recv_iobuf.buf, from->recv_iobuf.len);
+  iobuf_remove(&from->recv_iobuf, from->recv_iobuf.len);
+  from->forward_to = to;
+  to->forward_from = from;
+
+#ifdef NS_ENABLE_SPLICE
+  if (from->ssl == NULL && to->ssl == NULL &&
+      pipe2(from->splice_pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+    from->splice_len = 0;
+    from->flags |= NSF_SPLICED;
+  }
+#endif
+}
+
+int ns_throttle(struct ns_connection *src, const struct ns_connection *dst) {
+  struct ns_server *s = src->server;
+  int over_budget = s->mem_budget > 0 && s->stats.buffered > s->mem_budget;
+
+  if (dst == NULL || (dst->send_iobuf.len <= s->low_water && !over_budget)) {
+    if (src->flags & NSF_THROTTLED) s->stats.num_throttled--;
+    src->flags &= ~NSF_THROTTLED;
+  } else if (dst->send_iobuf.len >= s->high_water || over_budget) {
+    if (!(src->flags & NSF_THROTTLED)) {
+      s->stats.num_throttled++;
+      s->stats.num_pauses++;
+    }
+    src->flags |= NSF_THROTTLED;
+  }
+
+  return src->flags & NSF_THROTTLED ? 1 : 0;
+}
+
+// Return 1 if reading from the connection must wait for its peer
+static int ns_is_throttled(struct ns_connection *conn) {
+  if (conn->forward_to != NULL) {
+    ns_throttle(conn, conn->forward_to);
+  }
+  return (conn->flags & NSF_THROTTLED)
+#ifdef NS_ENABLE_SPLICE
+    || conn->splice_len > 0
+#endif
+    ;
+}
+
+#ifdef NS_ENABLE_SPLICE
+// Move data from the pipe to the peer socket. Anything queued in the peer's
+// send buffer must go out first.
+static void ns_splice_out(struct ns_connection *conn) {
+  struct ns_connection *to = conn->forward_to;
+  ssize_t n;
+
+  if (to == NULL || conn->splice_len == 0 || to->send_iobuf.len > 0 ||
+      (to->flags & (NSF_CONNECTING | NSF_BUFFER_BUT_DONT_SEND))) return;
+
+  n = splice(conn->splice_pipe[0], NULL, to->sock, NULL, conn->splice_len,
+             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  DBG(("%p -> %p %d spliced", conn, to, (int) n));
+  if (n > 0) {
+    conn->splice_len -= n;
+    to->last_io_time = conn->last_io_time;
+  } else if (n < 0 && ns_is_error(n)) {
+    to->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+static void ns_splice_in(struct ns_connection *conn) {
+  ssize_t n = splice(conn->sock, NULL, conn->splice_pipe[1], NULL,
+                     NS_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  DBG(("%p %d <- %d spliced", conn, conn->flags, (int) n));
+  if (n < 0 && errno == EINVAL) {
+    // Socket type does not support splicing, use buffers instead
+    ns_unsplice(conn);
+  } else if (ns_is_error(n)) {
+    // Let the peer have everything before NS_CLOSE is sent
+    ns_unsplice(conn);
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (n > 0) {
+    conn->splice_len += n;
+    ns_splice_out(conn);
+  }
+}
+#endif
+
 static void ns_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
   if (sock != INVALID_SOCKET) {
     FD_SET(sock, set);
@@ -802,6 +1071,7 @@ int ns_server_poll(struct ns_server *server, int milli) {
   int num_active_connections = 0;
   sock_t max_fd = INVALID_SOCKET;
   time_t current_time = time(NULL);
+  size_t buffered = 0;
 
   if (server->listening_sock == INVALID_SOCKET &&
       server->active_connections == NULL) return 0;
@@ -813,13 +1083,15 @@ int ns_server_poll(struct ns_server *server, int milli) {
 
   for (conn = server->active_connections; conn != NULL; conn = tmp_conn) {
     tmp_conn = conn->next;
+    buffered += conn->recv_iobuf.len + conn->send_iobuf.len;
     ns_call(conn, NS_POLL, &current_time);
-    if (!(conn->flags & NSF_WANT_WRITE)) {
+    if (!(conn->flags & NSF_WANT_WRITE) && !ns_is_throttled(conn)) {
       //DBG(("%p read_set", conn));
       ns_add_to_set(conn->sock, &read_set, &max_fd);
     }
     if (((conn->flags & NSF_CONNECTING) && !(conn->flags & NSF_WANT_READ)) ||
-        (conn->send_iobuf.len > 0 && !(conn->flags & NSF_CONNECTING) &&
+        ((conn->send_iobuf.len > 0 || ns_has_spliced_data(conn)) &&
+         !(conn->flags & NSF_CONNECTING) &&
          !(conn->flags & NSF_BUFFER_BUT_DONT_SEND))) {
       //DBG(("%p write_set", conn));
       ns_add_to_set(conn->sock, &write_set, &max_fd);
@@ -836,12 +1108,21 @@ int ns_server_poll(struct ns_server *server, int milli) {
     // Accept new connections
     if (server->listening_sock != INVALID_SOCKET &&
         FD_ISSET(server->listening_sock, &read_set)) {
-      // We're not looping here, and accepting just one connection at
-      // a time. The reason is that eCos does not respect non-blocking
-      // flag on a listening socket and hangs in a loop.
+      // On Linux, drain the backlog up to accept_batch connections.
+      // Elsewhere, accept just one connection at a time. The reason is
+      // that eCos does not respect non-blocking flag on a listening socket
+      // and hangs in a loop.
+#ifdef NS_ENABLE_ACCEPT4
+      int i;
+      for (i = 0; i < server->accept_batch; i++) {
+        if ((conn = accept_conn(server)) == NULL) break;
+        conn->last_io_time = current_time;
+      }
+#else
       if ((conn = accept_conn(server)) != NULL) {
         conn->last_io_time = current_time;
       }
+#endif
     }
 
     // Read wakeup messages
@@ -860,6 +1141,11 @@ int ns_server_poll(struct ns_server *server, int milli) {
       //DBG(("%p LOOP %p", conn, conn->ssl));
       if (FD_ISSET(conn->sock, &read_set)) {
         conn->last_io_time = current_time;
+#ifdef NS_ENABLE_SPLICE
+        if ((conn->flags & NSF_SPLICED) && !(conn->flags & NSF_CONNECTING)) {
+          ns_splice_in(conn);
+        } else
+#endif
         ns_read_from_socket(conn);
       }
       if (FD_ISSET(conn->sock, &write_set)) {
@@ -867,7 +1153,14 @@ int ns_server_poll(struct ns_server *server, int milli) {
           ns_read_from_socket(conn);
         } else if (!(conn->flags & NSF_BUFFER_BUT_DONT_SEND)) {
           conn->last_io_time = current_time;
-          ns_write_to_socket(conn);
+          if (conn->send_iobuf.len > 0) {
+            ns_write_to_socket(conn);
+          }
+#ifdef NS_ENABLE_SPLICE
+          if (conn->forward_from != NULL) {
+            ns_splice_out(conn->forward_from);
+          }
+#endif
         }
       }
     }
@@ -882,6 +1175,12 @@ int ns_server_poll(struct ns_server *server, int milli) {
   }
   //DBG(("%d active connections", num_active_connections));
 
+  server->stats.buffered = buffered;
+  server->stats.num_connections = num_active_connections;
+  if (buffered > server->stats.peak_buffered) {
+    server->stats.peak_buffered = buffered;
+  }
+
   return num_active_connections;
 }
 
@@ -982,6 +1281,9 @@ void ns_server_init(struct ns_server *s, void *server_data, ns_callback_t cb) {
   s->listening_sock = s->ctl[0] = s->ctl[1] = INVALID_SOCKET;
   s->server_data = server_data;
   s->callback = cb;
+  s->high_water = NS_HIGH_WATERMARK;
+  s->low_water = NS_LOW_WATERMARK;
+  s->accept_batch = NS_ACCEPT_BATCH;
 
 #ifdef _WIN32
   { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
@@ -1005,6 +1307,7 @@ void ns_server_init(struct ns_server *s, void *server_data, ns_callback_t cb) {
 
 void ns_server_free(struct ns_server *s) {
   struct ns_connection *conn, *tmp_conn;
+  void *slab;
 
   DBG(("%p", s));
   if (s == NULL) return;
@@ -1021,6 +1324,12 @@ void ns_server_free(struct ns_server *s) {
     ns_close_conn(conn);
   }
 
+  while ((slab = s->conn_slabs) != NULL) {
+    s->conn_slabs = * (void **) slab;
+    NS_FREE(slab);
+  }
+  s->free_conns = NULL;
+
 #ifdef NS_ENABLE_SSL
   if (s->ssl_ctx != NULL) SSL_CTX_free(s->ssl_ctx);
   if (s->client_ssl_ctx != NULL) SSL_CTX_free(s->client_ssl_ctx);
@@ -1073,6 +1382,7 @@ typedef HANDLE process_id_t;
 #include <dlfcn.h>
 #include <inttypes.h>
 #include <pwd.h>
+#include <sys/mman.h>
 #define O_BINARY 0
 #define INT64_FMT PRId64
 typedef struct stat file_stat_t;
@@ -1107,6 +1417,11 @@ typedef pid_t process_id_t;
 #define UMSERVER_IDLE_TIMEOUT_SECONDS 30
 #endif
 
+// Maximum number of ranges in a multipart/byteranges reply
+#ifndef UMSERVER_MAX_RANGES
+#define UMSERVER_MAX_RANGES 16
+#endif
+
 #ifdef UMSERVER_NO_SOCKETPAIR
 #define UMSERVER_NO_CGI
 #endif
@@ -1126,15 +1441,41 @@ struct vec {
   int len;
 };
 
+// Request body of EP_USER connections, see read_request_body()
+enum { BODY_DATA, BODY_CHUNK_SIZE, BODY_CHUNK_END, BODY_TRAILER, BODY_DONE };
+enum { BODY_CHUNKED = 1, BODY_STREAMED = 2, BODY_COMPLETE = 4,
+       BODY_ACCEPTED = 8 };
+
+// Chunked body scanning state, see scan_chunked()
+enum { CS_SIZE, CS_EXT, CS_DATA, CS_DATA_END, CS_TRAILER, CS_TRAILER_LINE,
+       CS_DONE };
+
+struct request_body {
+  int64_t left;               // Bytes left in the body, or in current chunk
+  size_t len;                 // Decoded bytes at the start of recv_iobuf,
+                              // or raw ones if the body was not accepted
+  int state, flags;
+  int raw_state;              // CS_* state of a raw chunked body
+  FILE *spool;                // Temporary file holding a large body
+  int64_t spool_len;
+  void *map;                  // Spooled body, mapped for MG_REQUEST
+};
+
+// Byte range of a static file reply
+struct file_range {
+  int64_t start, len;
+  int head_ofs, head_len;     // Multipart part header, see set_file_ranges()
+};
+
 // For directory listing and WevDAV support
 struct dir_entry {
-  struct connection *conn;
   char *file_name;
   file_stat_t st;
 };
 
 // NOTE(lsm): this enum shoulds be in sync with the config_options.
 enum {
+  ACCEPT_BATCH,
   ACCESS_CONTROL_LIST,
 #ifndef UMSERVER_NO_FILESYSTEM
   ACCESS_LOG_FILE,
@@ -1150,6 +1491,7 @@ enum {
 #ifndef UMSERVER_NO_DIRECTORY_LISTING
   ENABLE_DIRECTORY_LISTING,
 #endif
+  ETAG_INDEX_FILE,
 #endif
   EXTRA_MIME_TYPES,
 #if !defined(UMSERVER_NO_FILESYSTEM) && !defined(UMSERVER_NO_AUTH)
@@ -1158,12 +1500,18 @@ enum {
 #ifndef UMSERVER_NO_FILESYSTEM
   HIDE_FILES_PATTERN,
   HEXDUMP_FILE,
+  IMMUTABLE_PATTERN,
   INDEX_FILES,
 #endif
+  MEMORY_BUDGET,
   LISTENING_PORT,
+  REVERSE_PROXY,
+  REVERSE_PROXY_BALANCE,
 #ifndef _WIN32
   RUN_AS_USER,
 #endif
+  SEND_BUFFER_HIGH_WATERMARK,
+  SEND_BUFFER_LOW_WATERMARK,
 #ifndef UMSERVER_NO_SSI
   SSI_PATTERN,
 #endif
@@ -1171,12 +1519,19 @@ enum {
   SSL_CERTIFICATE,
   SSL_CA_CERTIFICATE,
   SSL_MITM_CERTS,
+#endif
+#ifndef _WIN32
+  UPLOAD_SPOOL_THRESHOLD,
 #endif
   URL_REWRITES,
+#ifndef UMSERVER_NO_THREADS
+  WORKER_THREADS,
+#endif
   NUM_OPTIONS
 };
 
 static const char *static_config_options[] = {
+  "accept_batch", "64",
   "access_control_list", NULL,
 #ifndef UMSERVER_NO_FILESYSTEM
   "access_log_file", NULL,
@@ -1192,6 +1547,7 @@ static const char *static_config_options[] = {
 #ifndef UMSERVER_NO_DIRECTORY_LISTING
   "enable_directory_listing", "yes",
 #endif
+  "etag_index_file", NULL,
 #endif
   "extra_mime_types", NULL,
 #if !defined(UMSERVER_NO_FILESYSTEM) && !defined(UMSERVER_NO_AUTH)
@@ -1200,12 +1556,18 @@ static const char *static_config_options[] = {
 #ifndef UMSERVER_NO_FILESYSTEM
   "hide_files_patterns", NULL,
   "hexdump_file", NULL,
+  "immutable_pattern", NULL,
   "index_files","index.html,index.htm,index.shtml,index.cgi,index.php,index.lp",
 #endif
+  "memory_budget", "0",
   "server_port", NULL,
+  "reverse_proxy", NULL,
+  "reverse_proxy_balance", "round_robin",
 #ifndef _WIN32
   "run_as_user", NULL,
 #endif
+  "send_buffer_high_watermark", "65536",
+  "send_buffer_low_watermark", "16384",
 #ifndef UMSERVER_NO_SSI
   "ssi_pattern", "**.shtml$|**.shtm$",
 #endif
@@ -1213,8 +1575,14 @@ static const char *static_config_options[] = {
   "ssl_certificate", NULL,
   "ssl_ca_certificate", NULL,
   "ssl_mitm_certs", NULL,
+#endif
+#ifndef _WIN32
+  "upload_spool_threshold", "0",
 #endif
   "url_rewrites", NULL,
+#ifndef UMSERVER_NO_THREADS
+  "worker_threads", "4",
+#endif
   NULL
 };
 
@@ -1223,6 +1591,28 @@ struct ht_server {
   union socket_address lsa;   // Listening socket address
   ht_handler_t event_handler;
   char *config_options[NUM_OPTIONS];
+  unsigned long next_conn_id; // Last connection id handed out
+  struct worker_pool *pool;   // Created on first ht_queue_job()
+  struct proxy_route *proxy_routes;  // Parsed reverse_proxy option
+  int64_t spool_threshold;    // Parsed upload_spool_threshold, 0 if none
+#ifndef UMSERVER_NO_SSI
+  struct ssi_file *ssi_cache[64];    // Compiled SSI files by path hash
+  size_t ssi_cache_size;             // Bytes of file text in ssi_cache
+#endif
+#ifndef UMSERVER_NO_DIRECTORY_LISTING
+  struct dir_listing *dir_cache;     // Scanned directories, MRU first
+#endif
+#ifndef UMSERVER_NO_FILESYSTEM
+  struct etag_entry **etags;         // Content hashes by path hash
+  unsigned int num_etag_buckets;     // Power of 2
+  unsigned int num_etags;
+  FILE *etag_fp;                     // Opened etag_index_file
+#endif
+#ifndef UMSERVER_NO_AUTH
+  struct auth_file *auth_files[64];  // Parsed passwords files by path hash
+  int num_auth_files;
+  struct auth_nonce *auth_nonces[64];  // Recently verified credentials
+#endif
 };
 
 // Local endpoint representation
@@ -1232,13 +1622,15 @@ union endpoint {
 };
 
 enum endpoint_type {
- EP_NONE, EP_FILE, EP_CGI, EP_USER, EP_PUT, EP_CLIENT, EP_PROXY
+ EP_NONE, EP_FILE, EP_CGI, EP_USER, EP_PUT, EP_CLIENT, EP_PROXY, EP_UPSTREAM
 };
 
 #define MG_HEADERS_SENT NSF_USER_1
 #define MG_LONG_RUNNING NSF_USER_2
 #define MG_CGI_CONN NSF_USER_3
 #define MG_PROXY_CONN NSF_USER_4
+#define MG_JOB_PENDING NSF_USER_5
+#define MG_UPSTREAM_CONN NSF_USER_6
 
 struct connection {
   struct ns_connection *ns_conn;  // NOTE(lsm): main.c depends on this order
@@ -1251,6 +1643,14 @@ struct connection {
   int64_t num_bytes_sent; // Total number of bytes sent
   int64_t cl;             // Reply content length, for Range support
   int request_len;  // Request length, including last \r\n after last header
+  unsigned long id; // Stable id, used by worker threads to find us again
+  char *raw_uri;    // Undecoded request target, kept for the reverse proxy
+  int close_after_reply;  // Reply is delimited by closing the connection
+  struct file_range *ranges;  // Ranges of a multipart/byteranges reply
+  int num_ranges, cur_range;
+  struct request_body body;
+  struct ht_var *vars;        // Index made by ht_get_vars()
+  int num_vars, vars_size, vars_ready;
 };
 
 #define MG_CONN_2_CONN(c) ((struct connection *) ((char *) (c) - \
@@ -1258,6 +1658,8 @@ struct connection {
 
 static void open_local_endpoint(struct connection *conn, int skip_user);
 static void close_local_endpoint(struct connection *conn);
+static int is_chunked_request(const struct connection *conn);
+static int scan_chunked(int *state, int64_t *left, const char *buf, int len);
 
 static const struct {
   const char *extension;
@@ -1318,6 +1720,50 @@ static const struct {
 void *ht_start_thread(void *(*f)(void *), void *p) {
   return ns_start_thread(f, p);
 }
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION ht_mutex_t;
+typedef CONDITION_VARIABLE ht_cond_t;
+#define ht_mutex_init(m) InitializeCriticalSection(m)
+#define ht_mutex_destroy(m) DeleteCriticalSection(m)
+#define ht_mutex_lock(m) EnterCriticalSection(m)
+#define ht_mutex_unlock(m) LeaveCriticalSection(m)
+#define ht_cond_init(c) InitializeConditionVariable(c)
+#define ht_cond_destroy(c)
+#define ht_cond_wait(c, m) SleepConditionVariableCS((c), (m), INFINITE)
+#define ht_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t ht_mutex_t;
+typedef pthread_cond_t ht_cond_t;
+#define ht_mutex_init(m) pthread_mutex_init((m), NULL)
+#define ht_mutex_destroy(m) pthread_mutex_destroy(m)
+#define ht_mutex_lock(m) pthread_mutex_lock(m)
+#define ht_mutex_unlock(m) pthread_mutex_unlock(m)
+#define ht_cond_init(c) pthread_cond_init((c), NULL)
+#define ht_cond_destroy(c) pthread_cond_destroy(c)
+#define ht_cond_wait(c, m) pthread_cond_wait((c), (m))
+#define ht_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+// A unit of work queued by ht_queue_job(). The connection is remembered by
+// its id, because it may be closed and freed while the job is running.
+struct ht_job {
+  struct ht_job *next;
+  unsigned long conn_id;
+  ht_job_func_t work;
+  ht_job_done_t done;
+  void *param;
+};
+
+struct worker_pool {
+  ht_mutex_t mutex;
+  ht_cond_t cond;               // Signalled on new job and on shutdown
+  struct ht_job *pending;       // Jobs waiting for a worker, FIFO
+  struct ht_job *pending_tail;
+  struct ht_job *finished;      // Jobs waiting for the IO thread, LIFO
+  int num_threads;              // Number of live worker threads
+  int stop;
+};
 #endif // UMSERVER_NO_THREADS
 
 #if defined(_WIN32) && !defined(UMSERVER_NO_FILESYSTEM)
@@ -1501,14 +1947,18 @@ static const char *status_code_to_str(int status_code) {
     case 411: return "Length Required";
     case 413: return "Request Entity Too Large";
     case 415: return "Unsupported Media Type";
+    case 416: return "Requested Range Not Satisfiable";
     case 423: return "Locked";
     case 500: return "Server Error";
     case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 504: return "Gateway Timeout";
     default:  return "Server Error";
   }
 }
 
 static int call_user(struct connection *conn, enum ht_event ev) {
+  if (conn != NULL) conn->vars_ready = 0;
   return conn != NULL && conn->server != NULL &&
     conn->server->event_handler != NULL ?
     conn->server->event_handler(&conn->ht_conn, ev) : MG_FALSE;
@@ -1998,6 +2448,8 @@ static void on_cgi_data(struct ns_connection *nc) {
       }
       memcpy(io->buf + 9, status, 3);
       conn->ht_conn.status_code = atoi(status);
+      // Headers are fixed up, the rest of the output goes to the client as-is
+      ns_link(nc, conn->ns_conn);
     }
     conn->ns_conn->flags &= ~NSF_BUFFER_BUT_DONT_SEND;
   }
@@ -2227,39 +2679,6 @@ int ht_match_prefix(const char *pattern, int pattern_len, const char *str) {
   return j;
 }
 
-// This function prints HTML pages, and expands "{{something}}" blocks
-// inside HTML by calling appropriate callback functions.
-// Note that {{@path/to/file}} construct outputs embedded file's contents,
-// which provides SSI-like functionality.
-void ht_template(struct ht_connection *conn, const char *s,
-                 struct ht_expansion *expansions) {
-  int i, j, pos = 0, inside_marker = 0;
-
-  for (i = 0; s[i] != '\0'; i++) {
-    if (inside_marker == 0 && !memcmp(&s[i], "{{", 2)) {
-      if (i > pos) {
-        ht_send_data(conn, &s[pos], i - pos);
-      }
-      pos = i;
-      inside_marker = 1;
-    }
-    if (inside_marker == 1 && !memcmp(&s[i], "}}", 2)) {
-      for (j = 0; expansions[j].keyword != NULL; j++) {
-        const char *kw = expansions[j].keyword;
-        if ((int) strlen(kw) == i - (pos + 2) &&
-            memcmp(kw, &s[pos + 2], i - (pos + 2)) == 0) {
-          expansions[j].handler(conn);
-          pos = i + 2;
-          break;
-        }
-      }
-      inside_marker = 0;
-    }
-  }
-  if (i > pos) {
-    ht_send_data(conn, &s[pos], i - pos);
-  }
-}
 
 #ifndef UMSERVER_NO_FILESYSTEM
 static int must_hide_file(struct connection *conn, const char *path) {
@@ -2341,7 +2760,8 @@ static int should_keep_alive(const struct ht_connection *conn) {
   const char *http_version = conn->http_version;
   const char *header = ht_get_header(conn, "Connection");
   return method != NULL &&
-    (!strcmp(method, "GET") || c->endpoint_type == EP_USER) &&
+    (!strcmp(method, "GET") || c->endpoint_type == EP_USER ||
+     c->endpoint_type == EP_UPSTREAM) &&
     ((header != NULL && !ht_strcasecmp(header, "keep-alive")) ||
      (header == NULL && http_version && !strcmp(http_version, "1.1")));
 }
@@ -2400,32 +2820,66 @@ void ht_printf_data(struct ht_connection *c, const char *fmt, ...) {
   }
 }
 
-#if !defined(UMSERVER_NO_WEBSOCKET) || !defined(UMSERVER_NO_AUTH)
-static int is_big_endian(void) {
-  static const int n = 1;
-  return ((char *) &n)[0] == 0;
+// Make room for n more bytes, so that appending segments does not realloc
+static void reserve_send_buffer(struct ns_connection *nc, size_t n) {
+  struct iobuf *io = &nc->send_iobuf;
+  char *p;
+
+  if (io->len + n > io->size &&
+      (p = (char *) NS_REALLOC(io->buf, io->len + n)) != NULL) {
+    io->buf = p;
+    io->size = io->len + n;
+  }
 }
-#endif
 
-#ifndef UMSERVER_NO_WEBSOCKET
-#define SHA1HANDSOFF
+static unsigned int hash_string(const char *s, int len) {
+  unsigned int h = 2166136261U;  // FNV-1a
+  while (len-- > 0) h = (h ^ (unsigned char) *s++) * 16777619U;
+  return h;
+}
 
-union char64long16 { unsigned char c[64]; uint32_t l[16]; };
+#if !defined(UMSERVER_NO_WEBSOCKET) || !defined(UMSERVER_NO_AUTH) || \
+    !defined(UMSERVER_NO_FILESYSTEM)
+// Endian-neutral word access. Compilers turn these into plain loads and
+// stores, or byte swaps, so the hash cores need no separate swapping pass.
+#define LOAD_BE32(p) ((uint32_t) (p)[0] << 24 | (uint32_t) (p)[1] << 16 | \
+                      (uint32_t) (p)[2] << 8 | (uint32_t) (p)[3])
+#define LOAD_LE32(p) ((uint32_t) (p)[3] << 24 | (uint32_t) (p)[2] << 16 | \
+                      (uint32_t) (p)[1] << 8 | (uint32_t) (p)[0])
 
-#define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+static void store_be32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+}
+
+static void store_le32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char) v;
+  p[1] = (unsigned char) (v >> 8);
+  p[2] = (unsigned char) (v >> 16);
+  p[3] = (unsigned char) (v >> 24);
+}
+
+// Stringify binary data. Output buffer must be twice as big as input,
+// because each byte takes 2 bytes in string representation
+static void bin2str(char *to, const unsigned char *p, size_t len) {
+  static const char *hex = "0123456789abcdef";
 
-static uint32_t blk0(union char64long16 *block, int i) {
-  // Forrest: SHA expect BIG_ENDIAN, swap if LITTLE_ENDIAN
-  if (!is_big_endian()) {
-    block->l[i] = (rol(block->l[i], 24) & 0xFF00FF00) |
-      (rol(block->l[i], 8) & 0x00FF00FF);
+  for (; len--; p++) {
+    *to++ = hex[p[0] >> 4];
+    *to++ = hex[p[0] & 0x0f];
   }
-  return block->l[i];
+  *to = '\0';
 }
+#endif
+
+#if !defined(UMSERVER_NO_WEBSOCKET) || !defined(UMSERVER_NO_FILESYSTEM)
+#define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-#define blk(i) (block->l[i&15] = rol(block->l[(i+13)&15]^block->l[(i+8)&15] \
-    ^block->l[(i+2)&15]^block->l[i&15],1))
-#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(block, i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define blk(i) (block[i&15] = rol(block[(i+13)&15]^block[(i+8)&15] \
+    ^block[(i+2)&15]^block[i&15],1))
+#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+block[i]+0x5A827999+rol(v,5);w=rol(w,30);
 #define R1(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk(i)+0x5A827999+rol(v,5);w=rol(w,30);
 #define R2(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0x6ED9EBA1+rol(v,5);w=rol(w,30);
 #define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
@@ -2437,46 +2891,168 @@ typedef struct {
     unsigned char buffer[64];
 } SHA1_CTX;
 
-static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]) {
-  uint32_t a, b, c, d, e;
-  union char64long16 block[1];
-
-  memcpy(block, buffer, 64);
-  a = state[0];
-  b = state[1];
-  c = state[2];
-  d = state[3];
-  e = state[4];
-  R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
-  R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
-  R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
-  R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
-  R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
-  R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
-  R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
-  R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
-  R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
-  R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
-  R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
-  R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
-  R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
-  R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
-  R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
-  R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
-  R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
-  R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
-  R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
-  R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
-  state[0] += a;
-  state[1] += b;
-  state[2] += c;
-  state[3] += d;
-  state[4] += e;
-  // Erase working structures. The order of operations is important,
-  // used to ensure that compiler doesn't optimize those out.
-  memset(block, 0, sizeof(block));
-  a = b = c = d = e = 0;
-  (void) a; (void) b; (void) c; (void) d; (void) e;
+// Hash num_blocks consecutive 64-byte blocks
+static void sha1_blocks_generic(uint32_t state[5], const unsigned char *data,
+                                size_t num_blocks) {
+  uint32_t a, b, c, d, e, block[16];
+
+  for (; num_blocks > 0; num_blocks--, data += 64) {
+    block[0] = LOAD_BE32(data + 0); block[1] = LOAD_BE32(data + 4);
+    block[2] = LOAD_BE32(data + 8); block[3] = LOAD_BE32(data + 12);
+    block[4] = LOAD_BE32(data + 16); block[5] = LOAD_BE32(data + 20);
+    block[6] = LOAD_BE32(data + 24); block[7] = LOAD_BE32(data + 28);
+    block[8] = LOAD_BE32(data + 32); block[9] = LOAD_BE32(data + 36);
+    block[10] = LOAD_BE32(data + 40); block[11] = LOAD_BE32(data + 44);
+    block[12] = LOAD_BE32(data + 48); block[13] = LOAD_BE32(data + 52);
+    block[14] = LOAD_BE32(data + 56); block[15] = LOAD_BE32(data + 60);
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
+    R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
+    R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
+    R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
+    R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
+    R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
+    R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
+    R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
+    R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
+    R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
+    R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
+    R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
+    R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
+    R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
+    R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
+    R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
+    R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
+    R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
+    R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
+    R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+#ifdef NS_ENABLE_SHA_NI
+// SHA-1 using the x86 SHA extensions. Every sha1rnds4 does four rounds;
+// the message schedule for later rounds is computed alongside.
+#define SHA_NI_ROUNDS(e_in, e_out, msg, f)  \
+  e_in = _mm_sha1nexte_epu32(e_in, msg);    \
+  e_out = abcd;                             \
+  abcd = _mm_sha1rnds4_epu32(abcd, e_in, f)
+#define SHA_NI_MSG1(m0, m1) m0 = _mm_sha1msg1_epu32(m0, m1)
+#define SHA_NI_MSG2(m0, m1) m0 = _mm_sha1msg2_epu32(m0, m1)
+#define SHA_NI_XOR(m0, m1) m0 = _mm_xor_si128(m0, m1)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_sha_ni(uint32_t state[5], const unsigned char *data,
+                               size_t num_blocks) {
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                      0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1, m0, m1, m2, m3;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+  e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+
+  for (; num_blocks > 0; num_blocks--, data += 64) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), mask);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)),
+                          mask);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)),
+                          mask);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)),
+                          mask);
+
+    // Rounds 0-19
+    e0 = _mm_add_epi32(e0, m0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    SHA_NI_ROUNDS(e1, e0, m1, 0); SHA_NI_MSG1(m0, m1);
+    SHA_NI_ROUNDS(e0, e1, m2, 0); SHA_NI_MSG1(m1, m2); SHA_NI_XOR(m0, m2);
+    SHA_NI_ROUNDS(e1, e0, m3, 0); SHA_NI_MSG2(m0, m3); SHA_NI_MSG1(m2, m3);
+    SHA_NI_XOR(m1, m3);
+    SHA_NI_ROUNDS(e0, e1, m0, 0); SHA_NI_MSG2(m1, m0); SHA_NI_MSG1(m3, m0);
+    SHA_NI_XOR(m2, m0);
+
+    // Rounds 20-39
+    SHA_NI_ROUNDS(e1, e0, m1, 1); SHA_NI_MSG2(m2, m1); SHA_NI_MSG1(m0, m1);
+    SHA_NI_XOR(m3, m1);
+    SHA_NI_ROUNDS(e0, e1, m2, 1); SHA_NI_MSG2(m3, m2); SHA_NI_MSG1(m1, m2);
+    SHA_NI_XOR(m0, m2);
+    SHA_NI_ROUNDS(e1, e0, m3, 1); SHA_NI_MSG2(m0, m3); SHA_NI_MSG1(m2, m3);
+    SHA_NI_XOR(m1, m3);
+    SHA_NI_ROUNDS(e0, e1, m0, 1); SHA_NI_MSG2(m1, m0); SHA_NI_MSG1(m3, m0);
+    SHA_NI_XOR(m2, m0);
+    SHA_NI_ROUNDS(e1, e0, m1, 1); SHA_NI_MSG2(m2, m1); SHA_NI_MSG1(m0, m1);
+    SHA_NI_XOR(m3, m1);
+
+    // Rounds 40-59
+    SHA_NI_ROUNDS(e0, e1, m2, 2); SHA_NI_MSG2(m3, m2); SHA_NI_MSG1(m1, m2);
+    SHA_NI_XOR(m0, m2);
+    SHA_NI_ROUNDS(e1, e0, m3, 2); SHA_NI_MSG2(m0, m3); SHA_NI_MSG1(m2, m3);
+    SHA_NI_XOR(m1, m3);
+    SHA_NI_ROUNDS(e0, e1, m0, 2); SHA_NI_MSG2(m1, m0); SHA_NI_MSG1(m3, m0);
+    SHA_NI_XOR(m2, m0);
+    SHA_NI_ROUNDS(e1, e0, m1, 2); SHA_NI_MSG2(m2, m1); SHA_NI_MSG1(m0, m1);
+    SHA_NI_XOR(m3, m1);
+    SHA_NI_ROUNDS(e0, e1, m2, 2); SHA_NI_MSG2(m3, m2); SHA_NI_MSG1(m1, m2);
+    SHA_NI_XOR(m0, m2);
+
+    // Rounds 60-79
+    SHA_NI_ROUNDS(e1, e0, m3, 3); SHA_NI_MSG2(m0, m3); SHA_NI_MSG1(m2, m3);
+    SHA_NI_XOR(m1, m3);
+    SHA_NI_ROUNDS(e0, e1, m0, 3); SHA_NI_MSG2(m1, m0); SHA_NI_MSG1(m3, m0);
+    SHA_NI_XOR(m2, m0);
+    SHA_NI_ROUNDS(e1, e0, m1, 3); SHA_NI_MSG2(m2, m1); SHA_NI_XOR(m3, m1);
+    SHA_NI_ROUNDS(e0, e1, m2, 3); SHA_NI_MSG2(m3, m2);
+    SHA_NI_ROUNDS(e1, e0, m3, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+
+static int has_sha_ni(void) {
+  unsigned int a, b, c, d;
+
+  if (!__get_cpuid(1, &a, &b, &c, &d) ||
+      !(c & bit_SSSE3) || !(c & bit_SSE4_1) || __get_cpuid_max(0, NULL) < 7) {
+    return 0;
+  }
+  __cpuid_count(7, 0, a, b, c, d);
+  return (b & (1 << 29)) != 0;  // CPUID.(EAX=7,ECX=0):EBX.SHA
+}
+#endif  // NS_ENABLE_SHA_NI
+
+// Fastest implementation the CPU supports. It is picked once, by the first
+// ht_create_server(), before any worker thread can hash.
+static void (*sha1_impl)(uint32_t *, const unsigned char *, size_t) =
+  sha1_blocks_generic;
+static int sha1_impl_selected = 0;
+
+static void select_sha1_impl(void) {
+  if (!sha1_impl_selected) {
+#ifdef NS_ENABLE_SHA_NI
+    if (has_sha_ni()) sha1_impl = sha1_blocks_sha_ni;
+#endif
+    sha1_impl_selected = 1;
+  }
+}
+
+static void sha1_blocks(uint32_t state[5], const unsigned char *data,
+                        size_t num_blocks) {
+  sha1_impl(state, data, num_blocks);
 }
 
 static void SHA1Init(SHA1_CTX* context) {
@@ -2499,9 +3075,10 @@ static void SHA1Update(SHA1_CTX* context, const unsigned char* data,
   j = (j >> 3) & 63;
   if ((j + len) > 63) {
     memcpy(&context->buffer[j], data, (i = 64-j));
-    SHA1Transform(context->state, context->buffer);
-    for ( ; i + 63 < len; i += 64) {
-      SHA1Transform(context->state, &data[i]);
+    sha1_blocks(context->state, context->buffer, 1);
+    if (len - i >= 64) {
+      sha1_blocks(context->state, &data[i], (len - i) / 64);
+      i += (len - i) & ~63U;
     }
     j = 0;
   }
@@ -2510,28 +3087,29 @@ static void SHA1Update(SHA1_CTX* context, const unsigned char* data,
 }
 
 static void SHA1Final(unsigned char digest[20], SHA1_CTX* context) {
-  unsigned i;
-  unsigned char finalcount[8], c;
+  unsigned i, j = (context->count[0] >> 3) & 63;
 
-  for (i = 0; i < 8; i++) {
-    finalcount[i] = (unsigned char)((context->count[(i >= 4 ? 0 : 1)]
-                                     >> ((3-(i & 3)) * 8) ) & 255);
-  }
-  c = 0200;
-  SHA1Update(context, &c, 1);
-  while ((context->count[0] & 504) != 448) {
-    c = 0000;
-    SHA1Update(context, &c, 1);
+  // Pad with 0x80, zeroes and the bit count, in one or two blocks
+  context->buffer[j++] = 0x80;
+  if (j > 56) {
+    memset(&context->buffer[j], 0, 64 - j);
+    sha1_blocks(context->state, context->buffer, 1);
+    j = 0;
   }
-  SHA1Update(context, finalcount, 8);
-  for (i = 0; i < 20; i++) {
-    digest[i] = (unsigned char)
-      ((context->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
+  memset(&context->buffer[j], 0, 56 - j);
+  store_be32(&context->buffer[56], context->count[1]);
+  store_be32(&context->buffer[60], context->count[0]);
+  sha1_blocks(context->state, context->buffer, 1);
+
+  for (i = 0; i < 5; i++) {
+    store_be32(&digest[i * 4], context->state[i]);
   }
   memset(context, '\0', sizeof(*context));
-  memset(&finalcount, '\0', sizeof(finalcount));
 }
 // END OF SHA1 CODE
+#endif
+
+#ifndef UMSERVER_NO_WEBSOCKET
 
 static void base64_encode(const unsigned char *src, int src_len, char *dst) {
   static const char *b64 =
@@ -2715,7 +3293,8 @@ static void write_terminating_chunk(struct connection *conn) {
 
 static int call_request_handler(struct connection *conn) {
   int result;
-  conn->ht_conn.content = conn->ns_conn->recv_iobuf.buf;
+  conn->ht_conn.content = conn->body.map != NULL ?
+    (char *) conn->body.map : conn->ns_conn->recv_iobuf.buf;
   if ((result = call_user(conn, MG_REQUEST)) == MG_TRUE) {
     if (conn->ns_conn->flags & MG_HEADERS_SENT) {
       write_terminating_chunk(conn);
@@ -2825,145 +3404,767 @@ static void construct_etag(char *buf, size_t buf_len, const file_stat_t *st) {
               (unsigned long) st->st_mtime, (int64_t) st->st_size);
 }
 
-// Return True if we should reply 304 Not Modified.
-static int is_not_modified(const struct connection *conn,
-                           const file_stat_t *stp) {
-  char etag[64];
-  const char *ims = ht_get_header(&conn->ht_conn, "If-Modified-Since");
-  const char *inm = ht_get_header(&conn->ht_conn, "If-None-Match");
-  construct_etag(etag, sizeof(etag), stp);
-  return (inm != NULL && !ht_strcasecmp(etag, inm)) ||
-    (ims != NULL && stp->st_mtime <= parse_date_string(ims));
-}
+// Strong ETags made of SHA-1 of file contents, enabled by etag_index_file
+// option. A hash is computed once per file version, i.e. path, size and
+// mtime, and appended to the index file, which is loaded back on start.
+// Since hashes depend on contents only, servers holding the same files give
+// the same ETags, no matter what file mtimes are. Files above
+// UMSERVER_ETAG_SYNC_SIZE are hashed by the worker pool, so as not to hold up
+// the IO thread, and get the mtime and size ETag until that is done.
+#ifndef UMSERVER_ETAG_MAX_FILE_SIZE
+#define UMSERVER_ETAG_MAX_FILE_SIZE (256 * 1024 * 1024)
+#endif
+#ifndef UMSERVER_ETAG_SYNC_SIZE
+#define UMSERVER_ETAG_SYNC_SIZE (256 * 1024)
+#endif
 
-// For given directory path, substitute it to valid index file.
-// Return 0 if index file has been found, -1 if not found.
-// If the file is found, it's stats is returned in stp.
-static int find_index_file(struct connection *conn, char *path,
-                           size_t path_len, file_stat_t *stp) {
-  const char *list = conn->server->config_options[INDEX_FILES];
-  file_stat_t st;
-  struct vec filename_vec;
-  size_t n = strlen(path), found = 0;
+struct etag_entry {
+  struct etag_entry *next;
+  unsigned int hash;          // Of path
+  int64_t size;
+  time_t mtime;
+  char etag[43];              // Quoted hex SHA-1, empty while being hashed
+  char *path;                 // Stored right after this structure
+};
 
-  // The 'path' given to us points to the directory. Remove all trailing
-  // directory separator characters from the end of the path, and
-  // then append single directory separator character.
-  while (n > 0 && path[n - 1] == '/') {
-    n--;
+static void free_etag_index(struct ht_server *server) {
+  struct etag_entry *e, *next;
+  unsigned int i;
+
+  for (i = 0; i < server->num_etag_buckets; i++) {
+    for (e = server->etags[i]; e != NULL; e = next) {
+      next = e->next;
+      free(e);
+    }
   }
-  path[n] = '/';
+  free(server->etags);
+  server->etags = NULL;
+  server->num_etag_buckets = server->num_etags = 0;
+  if (server->etag_fp != NULL) {
+    fclose(server->etag_fp);
+    server->etag_fp = NULL;
+  }
+}
 
-  // Traverse index files list. For each entry, append it to the given
-  // path and see if the file exists. If it exists, break the loop
-  while ((list = next_option(list, &filename_vec, NULL)) != NULL) {
+static struct etag_entry *find_etag(const struct ht_server *server,
+                                    const char *path, unsigned int hash) {
+  struct etag_entry *e = NULL;
 
-    // Ignore too long entries that may overflow path buffer
-    if (filename_vec.len > (int) (path_len - (n + 2)))
-      continue;
+  if (server->num_etag_buckets > 0) {
+    e = server->etags[hash & (server->num_etag_buckets - 1)];
+    for (; e != NULL; e = e->next) {
+      if (e->hash == hash && !strcmp(e->path, path)) break;
+    }
+  }
+  return e;
+}
+
+// Add or update index entry. Return NULL if out of memory.
+static struct etag_entry *set_etag(struct ht_server *server, const char *path,
+                                   int64_t size, time_t mtime,
+                                   const char *etag) {
+  unsigned int i, hash = hash_string(path, strlen(path));
+  struct etag_entry *e, *next, **buckets;
+  size_t len = strlen(path) + 1;
+
+  if ((e = find_etag(server, path, hash)) == NULL) {
+    // Keep load factor below 1
+    if (server->num_etags >= server->num_etag_buckets) {
+      unsigned int n = server->num_etag_buckets ?
+        server->num_etag_buckets * 2 : 256;
+      if ((buckets = (struct etag_entry **)
+           calloc(n, sizeof(buckets[0]))) == NULL) return NULL;
+      for (i = 0; i < server->num_etag_buckets; i++) {
+        for (e = server->etags[i]; e != NULL; e = next) {
+          next = e->next;
+          e->next = buckets[e->hash & (n - 1)];
+          buckets[e->hash & (n - 1)] = e;
+        }
+      }
+      free(server->etags);
+      server->etags = buckets;
+      server->num_etag_buckets = n;
+    }
+    if ((e = (struct etag_entry *) malloc(sizeof(*e) + len)) == NULL) {
+      return NULL;
+    }
+    e->path = (char *) memcpy(e + 1, path, len);
+    e->hash = hash;
+    e->next = server->etags[hash & (server->num_etag_buckets - 1)];
+    server->etags[hash & (server->num_etag_buckets - 1)] = e;
+    server->num_etags++;
+  }
+  e->size = size;
+  e->mtime = mtime;
+  ht_snprintf(e->etag, sizeof(e->etag), "%s", etag);
 
-    // Prepare full path to the index file
-    strncpy(path + n + 1, filename_vec.ptr, filename_vec.len);
-    path[n + 1 + filename_vec.len] = '\0';
+  return e;
+}
 
-    //DBG(("[%s]", path));
+static void write_etag_entry(FILE *fp, const struct etag_entry *e) {
+  fprintf(fp, "%s %" INT64_FMT " %lu %s\n", e->etag, e->size,
+          (unsigned long) e->mtime, e->path);
+}
 
-    // Does it exist?
-    if (!stat(path, &st)) {
-      // Yes it does, break the loop
-      *stp = st;
-      found = 1;
-      break;
+// Index file has one "etag size mtime path" line per file version. Later
+// lines override earlier ones. If most lines are stale, file is rewritten.
+static void load_etag_index(struct ht_server *server, const char *file_name) {
+  char line[MAX_PATH_SIZE + 100], etag[43], tmp[MAX_PATH_SIZE];
+  int64_t size;
+  unsigned long mtime, num_lines = 0;
+  unsigned int i;
+  struct etag_entry *e;
+  FILE *fp;
+  int n, len;
+
+  if ((fp = fopen(file_name, "r")) != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      len = (int) strlen(line);
+      if (len == 0 || line[len - 1] != '\n') continue;
+      line[len - 1] = '\0';
+      if (sscanf(line, "%42s %" INT64_FMT " %lu %n",
+                 etag, &size, &mtime, &n) == 3 && line[n] != '\0') {
+        set_etag(server, line + n, size, (time_t) mtime, etag);
+        num_lines++;
+      }
     }
+    fclose(fp);
   }
 
-  // If no index file exists, restore directory path
-  if (!found) {
-    path[n] = '\0';
+  if (num_lines > 1000 && num_lines > server->num_etags * 2) {
+    ht_snprintf(tmp, sizeof(tmp), "%s.tmp", file_name);
+    if ((fp = fopen(tmp, "w")) != NULL) {
+      for (i = 0; i < server->num_etag_buckets; i++) {
+        for (e = server->etags[i]; e != NULL; e = e->next) {
+          write_etag_entry(fp, e);
+        }
+      }
+      if (fclose(fp) != 0 || rename(tmp, file_name) != 0) {
+        remove(tmp);
+      }
+    }
   }
 
-  return found;
+  server->etag_fp = fopen(file_name, "a");
 }
 
-static int parse_range_header(const char *header, int64_t *a, int64_t *b) {
-  return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
-}
+// Return SHA-1 of the file, as quoted hex string, or 0 on error
+static int hash_file(const char *path, char etag[43]) {
+  unsigned char buf[65536], digest[20];
+  SHA1_CTX ctx;
+  int fd, n;
 
-static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
-  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+  if ((fd = open(path, O_RDONLY | O_BINARY)) == -1) return 0;
+  SHA1Init(&ctx);
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    SHA1Update(&ctx, buf, (uint32_t) n);
+  }
+  close(fd);
+  if (n < 0) return 0;
+  SHA1Final(digest, &ctx);
+
+  etag[0] = '"';
+  bin2str(etag + 1, digest, sizeof(digest));
+  etag[41] = '"';
+  etag[42] = '\0';
+  return 1;
+}
+
+// Set index entry and append it to the index file
+static const struct etag_entry *add_etag(struct ht_server *server,
+                                         const char *path, int64_t size,
+                                         time_t mtime, const char *etag) {
+  const struct etag_entry *e = set_etag(server, path, size, mtime, etag);
+
+  if (e != NULL && server->etag_fp != NULL && strchr(path, '\n') == NULL) {
+    write_etag_entry(server->etag_fp, e);
+    fflush(server->etag_fp);
+  }
+  return e;
+}
+
+#ifndef UMSERVER_NO_THREADS
+// File version being hashed by a worker
+struct etag_job {
+  struct ht_server *server;
+  int64_t size;
+  time_t mtime;
+  int ok;                     // Hashed, etag is set
+  char etag[43];
+  char path[1];               // Allocated to fit
+};
+
+static int queue_job(struct ht_server *, unsigned long conn_id,
+                     ht_job_func_t work, ht_job_done_t done, void *param);
+
+static void hash_file_job(void *param) {
+  struct etag_job *job = (struct etag_job *) param;
+  job->ok = hash_file(job->path, job->etag);
+}
+
+// Runs on the IO thread. The entry is only set if the file has not changed
+// meanwhile, and the job was not dropped on server shutdown.
+static int hash_file_done(struct ht_connection *c, void *param) {
+  struct etag_job *job = (struct etag_job *) param;
+  const char *path = job->path;
+  struct etag_entry *e;
+
+  (void) c;
+  e = find_etag(job->server, path, hash_string(path, strlen(path)));
+  if (e != NULL && e->size == job->size && e->mtime == job->mtime) {
+    if (job->ok) {
+      add_etag(job->server, path, job->size, job->mtime, job->etag);
+    } else {
+      // Let the next request try again
+      e->mtime = (time_t) -1;
+    }
+  }
+  free(job);
+  return MG_TRUE;
+}
+
+static int queue_hash_file(struct ht_server *server, const char *path,
+                           const file_stat_t *st) {
+  struct etag_job *job;
+  size_t len = strlen(path);
+
+  if ((job = (struct etag_job *) calloc(1, sizeof(*job) + len)) == NULL) {
+    return 0;
+  }
+  job->server = server;
+  job->size = st->st_size;
+  job->mtime = st->st_mtime;
+  memcpy(job->path, path, len + 1);
+  if (!queue_job(server, 0, hash_file_job, hash_file_done, job)) {
+    free(job);
+    return 0;
+  }
+  return 1;
+}
+#endif
+
+static void get_file_etag(struct connection *conn, const char *path,
+                          const file_stat_t *st, char *buf, size_t buf_len) {
+  struct ht_server *server = conn->server;
+  const struct etag_entry *e;
+  char etag[43];
+
+  if (server->config_options[ETAG_INDEX_FILE] != NULL &&
+      st->st_size <= UMSERVER_ETAG_MAX_FILE_SIZE) {
+    e = find_etag(server, path, hash_string(path, strlen(path)));
+    if (e == NULL || e->size != st->st_size || e->mtime != st->st_mtime) {
+      e = NULL;
+      if (st->st_size <= UMSERVER_ETAG_SYNC_SIZE) {
+        if (hash_file(path, etag)) {
+          e = add_etag(server, path, st->st_size, st->st_mtime, etag);
+        }
+#ifndef UMSERVER_NO_THREADS
+      } else if (queue_hash_file(server, path, st)) {
+        // Empty ETag marks the version as being hashed
+        set_etag(server, path, st->st_size, st->st_mtime, "");
+#endif
+      }
+    }
+    if (e != NULL && e->etag[0] != '\0') {
+      ht_snprintf(buf, buf_len, "%s", e->etag);
+      return;
+    }
+  }
+
+  construct_etag(buf, buf_len, st);
+}
+
+// Return True if we should reply 304 Not Modified. If-Modified-Since is
+// ignored when If-None-Match is present, mtimes may differ between servers.
+static int is_not_modified(struct connection *conn, const char *path,
+                           const file_stat_t *stp) {
+  char etag[64];
+  const char *ims = ht_get_header(&conn->ht_conn, "If-Modified-Since");
+  const char *inm = ht_get_header(&conn->ht_conn, "If-None-Match");
+
+  if (inm != NULL) {
+    get_file_etag(conn, path, stp, etag, sizeof(etag));
+    return !ht_strcasecmp(etag, inm);
+  }
+  return ims != NULL && stp->st_mtime <= parse_date_string(ims);
+}
+
+// For given directory path, substitute it to valid index file.
+// Return 0 if index file has been found, -1 if not found.
+// If the file is found, it's stats is returned in stp.
+static int find_index_file(struct connection *conn, char *path,
+                           size_t path_len, file_stat_t *stp) {
+  const char *list = conn->server->config_options[INDEX_FILES];
+  file_stat_t st;
+  struct vec filename_vec;
+  size_t n = strlen(path), found = 0;
+
+  // The 'path' given to us points to the directory. Remove all trailing
+  // directory separator characters from the end of the path, and
+  // then append single directory separator character.
+  while (n > 0 && path[n - 1] == '/') {
+    n--;
+  }
+  path[n] = '/';
+
+  // Traverse index files list. For each entry, append it to the given
+  // path and see if the file exists. If it exists, break the loop
+  while ((list = next_option(list, &filename_vec, NULL)) != NULL) {
+
+    // Ignore too long entries that may overflow path buffer
+    if (filename_vec.len > (int) (path_len - (n + 2)))
+      continue;
+
+    // Prepare full path to the index file
+    strncpy(path + n + 1, filename_vec.ptr, filename_vec.len);
+    path[n + 1 + filename_vec.len] = '\0';
+
+    //DBG(("[%s]", path));
+
+    // Does it exist?
+    if (!stat(path, &st)) {
+      // Yes it does, break the loop
+      *stp = st;
+      found = 1;
+      break;
+    }
+  }
+
+  // If no index file exists, restore directory path
+  if (!found) {
+    path[n] = '\0';
+  }
+
+  return found;
+}
+
+static int parse_range_header(const char *header, int64_t *a, int64_t *b) {
+  return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
+}
+
+// Parse decimal number, return 0 if there is none or it is too long
+static int parse_byte_pos(const char **s, int64_t *v) {
+  int n = 0;
+
+  for (*v = 0; isdigit(* (const unsigned char *) *s); (*s)++, n++) {
+    if (n >= 18) return 0;
+    *v = *v * 10 + (**s - '0');
+  }
+  return n > 0;
+}
+
+// Parse Range: header of a GET request, RFC 7233. Store satisfiable ranges,
+// clipped to file size, and return their number. Return -1 if the header
+// must be ignored: it is malformed, has too many ranges, or overlapping
+// ranges add up to more than the whole file.
+static int parse_byte_ranges(const char *s, int64_t size,
+                             struct file_range *ranges, int max_ranges) {
+  int64_t a, b, total = 0;
+  int n = 0;
+
+  if (ht_strncasecmp(s, "bytes=", 6) != 0) return -1;
+  for (s += 6;; s++) {
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s == '-') {
+      // Suffix range, i.e. last b bytes
+      s++;
+      if (!parse_byte_pos(&s, &b)) return -1;
+      a = b >= size ? 0 : size - b;
+      b = b == 0 ? -1 : size - 1;
+    } else if (parse_byte_pos(&s, &a) && *s++ == '-') {
+      if (!parse_byte_pos(&s, &b)) {
+        b = size - 1;
+      } else if (b < a) {
+        return -1;
+      } else if (b >= size) {
+        b = size - 1;
+      }
+    } else {
+      return -1;
+    }
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s != ',' && *s != '\0') return -1;
+
+    if (a < size && a <= b) {
+      if (n >= max_ranges) return -1;
+      ranges[n].start = a;
+      ranges[n].len = b - a + 1;
+      total += ranges[n++].len;
+    }
+    if (*s == '\0') break;
+  }
+
+  return total > size ? -1 : n;
+}
+
+// If-Range: holds either an ETag, compared strongly, or a Last-Modified date
+static int if_range_matches(const struct connection *conn, const char *etag,
+                            const file_stat_t *st) {
+  const char *hdr = ht_get_header(&conn->ht_conn, "If-Range");
+
+  if (hdr == NULL) {
+    return 1;
+  } else if (hdr[0] == '"') {
+    return !strcmp(hdr, etag);
+  } else if (hdr[0] == 'W' && hdr[1] == '/') {
+    return 0;
+  }
+  return parse_date_string(hdr) == st->st_mtime;
+}
+
+// Send part header (or closing delimiter) of the next range of a
+// multipart/byteranges reply. Return 0 if no ranges are left.
+static int next_file_range(struct connection *conn) {
+  const struct file_range *r = &conn->ranges[++conn->cur_range];
+
+  ns_send(conn->ns_conn, (const char *) (conn->ranges + conn->num_ranges + 1) +
+          r->head_ofs, r->head_len);
+  if (conn->cur_range >= conn->num_ranges) return 0;
+
+  lseek(conn->endpoint.fd, r->start, SEEK_SET);
+  conn->cl = r->len;
+  return 1;
+}
+
+// Prepare multipart/byteranges reply. Part headers are kept right after the
+// ranges array, the last entry holds the closing delimiter.
+static int64_t set_file_ranges(struct connection *conn, const char *boundary,
+                               const struct vec *mime, int64_t size,
+                               const struct file_range *ranges, int n) {
+  int64_t content_len = 0;
+  char *heads;
+  int i, len = 0;
+
+  conn->ranges = (struct file_range *)
+    malloc((n + 1) * (sizeof(ranges[0]) + 200 + mime->len));
+  if (conn->ranges == NULL) return -1;
+  heads = (char *) (conn->ranges + n + 1);
+
+  for (i = 0; i <= n; i++) {
+    conn->ranges[i] = i < n ? ranges[i] : ranges[0];
+    conn->ranges[i].head_ofs = len;
+    if (i < n) {
+      conn->ranges[i].head_len = ht_snprintf(heads + len, 200 + mime->len,
+          "%s--%s\r\nContent-Type: %.*s\r\n"
+          "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT
+          "\r\n\r\n", i == 0 ? "" : "\r\n", boundary,
+          (int) mime->len, mime->ptr, ranges[i].start,
+          ranges[i].start + ranges[i].len - 1, size);
+      content_len += ranges[i].len;
+    } else {
+      conn->ranges[i].head_len = ht_snprintf(heads + len, 200 + mime->len,
+                                             "\r\n--%s--\r\n", boundary);
+    }
+    len += conn->ranges[i].head_len;
+  }
+  conn->num_ranges = n;
+  conn->cur_range = -1;
+
+  return content_len + len;
+}
+
+static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
+  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
 }
 
 static void open_file_endpoint(struct connection *conn, const char *path,
                                file_stat_t *st) {
-  char date[64], lm[64], etag[64], range[64], headers[500];
-  const char *msg = "OK", *hdr;
+  char date[64], lm[64], etag[64], range[100], ctype[100], headers[600];
+  const char *msg = "OK", *hdr, *cache = "";
+  const char *pattern = conn->server->config_options[IMMUTABLE_PATTERN];
   time_t curtime = time(NULL);
-  int64_t r1, r2;
+  struct file_range ranges[UMSERVER_MAX_RANGES];
   struct vec mime_vec;
-  int n;
+  int64_t content_len;
+  int n = -1;
 
   conn->endpoint_type = EP_FILE;
   ns_set_close_on_exec(conn->endpoint.fd);
   conn->ht_conn.status_code = 200;
 
   get_mime_type(conn->server, path, &mime_vec);
-  conn->cl = st->st_size;
+  content_len = conn->cl = st->st_size;
   range[0] = '\0';
+  ht_snprintf(ctype, sizeof(ctype), "%.*s", (int) mime_vec.len, mime_vec.ptr);
 
-  // If Range: header specified, act accordingly
-  r1 = r2 = 0;
+  // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
+  // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
+  gmt_time_string(date, sizeof(date), &curtime);
+  gmt_time_string(lm, sizeof(lm), &st->st_mtime);
+  get_file_etag(conn, path, st, etag, sizeof(etag));
+
+  // Files named by their contents, e.g. by umcomp -manifest, never change,
+  // so browsers need not revalidate them
+  if (pattern != NULL && ht_match_prefix(pattern, strlen(pattern), path) > 0) {
+    cache = "Cache-Control: public, max-age=31536000, immutable\r\n";
+  }
+
+  // If Range: header specified, act accordingly. Ranges apply to GET only.
   hdr = ht_get_header(&conn->ht_conn, "Range");
-  if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0 &&
-      r1 >= 0 && r2 >= 0) {
+  if (hdr != NULL && !strcmp(conn->ht_conn.request_method, "GET") &&
+      if_range_matches(conn, etag, st)) {
+    n = parse_byte_ranges(hdr, st->st_size, ranges, ARRAY_SIZE(ranges));
+  }
+
+  if (n == 0) {
+    conn->ht_conn.status_code = 416;
+    n = ht_snprintf(headers, sizeof(headers),
+                    "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+                    "Date: %s\r\n"
+                    "Content-Range: bytes */%" INT64_FMT "\r\n"
+                    "Content-Length: 0\r\n"
+                    "Connection: %s\r\n\r\n",
+                    date, (int64_t) st->st_size,
+                    suggest_connection_header(&conn->ht_conn));
+    ns_send(conn->ns_conn, headers, n);
+    close_local_endpoint(conn);
+    return;
+  } else if (n == 1) {
     conn->ht_conn.status_code = 206;
-    conn->cl = n == 2 ? (r2 > conn->cl ? conn->cl : r2) - r1 + 1: conn->cl - r1;
+    content_len = conn->cl = ranges[0].len;
     ht_snprintf(range, sizeof(range), "Content-Range: bytes "
                 "%" INT64_FMT "-%" INT64_FMT "/%" INT64_FMT "\r\n",
-                r1, r1 + conn->cl - 1, (int64_t) st->st_size);
+                ranges[0].start, ranges[0].start + ranges[0].len - 1,
+                (int64_t) st->st_size);
+    msg = "Partial Content";
+    lseek(conn->endpoint.fd, ranges[0].start, SEEK_SET);
+  } else if (n > 1) {
+    char boundary[40];
+    ht_snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+                conn->id, (unsigned long) curtime);
+    if ((content_len = set_file_ranges(conn, boundary, &mime_vec,
+                                       st->st_size, ranges, n)) < 0) {
+      send_http_error(conn, 500, "Out of memory");
+      return;
+    }
+    conn->ht_conn.status_code = 206;
+    ht_snprintf(ctype, sizeof(ctype), "multipart/byteranges; boundary=%s",
+                boundary);
     msg = "Partial Content";
-    lseek(conn->endpoint.fd, r1, SEEK_SET);
   }
 
-  // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
-  // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
-  gmt_time_string(date, sizeof(date), &curtime);
-  gmt_time_string(lm, sizeof(lm), &st->st_mtime);
-  construct_etag(etag, sizeof(etag), st);
-
   n = ht_snprintf(headers, sizeof(headers),
                   "HTTP/1.1 %d %s\r\n"
                   "Date: %s\r\n"
                   "Last-Modified: %s\r\n"
                   "Etag: %s\r\n"
-                  "Content-Type: %.*s\r\n"
+                  "Content-Type: %s\r\n"
                   "Content-Length: %" INT64_FMT "\r\n"
                   "Connection: %s\r\n"
                   "Accept-Ranges: bytes\r\n"
-                  "%s%s\r\n",
+                  "%s%s%s\r\n",
                   conn->ht_conn.status_code, msg, date, lm, etag,
-                  (int) mime_vec.len, mime_vec.ptr, conn->cl,
+                  ctype, content_len,
                   suggest_connection_header(&conn->ht_conn),
-                  range, UMSERVER_USE_EXTRA_HTTP_HEADERS);
+                  cache, range, UMSERVER_USE_EXTRA_HTTP_HEADERS);
   ns_send(conn->ns_conn, headers, n);
 
   if (!strcmp(conn->ht_conn.request_method, "HEAD")) {
     conn->ns_conn->flags |= NSF_FINISHED_SENDING_DATA;
     close(conn->endpoint.fd);
     conn->endpoint_type = EP_NONE;
+  } else if (conn->ranges != NULL) {
+    next_file_range(conn);
   }
 }
 #endif  // UMSERVER_NO_FILESYSTEM
 
-static void call_request_handler_if_data_is_buffered(struct connection *conn) {
-  struct iobuf *loc = &conn->ns_conn->recv_iobuf;
-  struct ht_connection *c = &conn->ht_conn;
+// Remove n bytes at offset ofs from the buffer
+static void iobuf_cut(struct iobuf *io, size_t ofs, size_t n) {
+  memmove(io->buf + ofs, io->buf + ofs + n, io->len - (ofs + n));
+  io->len -= n;
+}
+
+// Prepare reading of EP_USER request body. Handler that returns MG_MORE
+// to MG_BODY with NULL content gets the body in pieces as it arrives, one
+// that returns MG_TRUE gets it whole. Otherwise the body is left as it is,
+// for the endpoint the request may fall through to.
+static void init_request_body(struct connection *conn) {
+  struct request_body *b = &conn->body;
+
+  memset(b, 0, sizeof(*b));
+  if (is_chunked_request(conn)) {
+    b->flags |= BODY_CHUNKED;
+    b->state = BODY_CHUNK_SIZE;
+    b->raw_state = CS_SIZE;
+  } else {
+    b->left = conn->cl;
+    b->state = b->left > 0 ? BODY_DATA : BODY_DONE;
+  }
+
+  if (b->state != BODY_DONE) {
+    conn->ht_conn.content = NULL;
+    conn->ht_conn.content_len = 0;
+    switch (call_user(conn, MG_BODY)) {
+      case MG_MORE: b->flags |= BODY_STREAMED | BODY_ACCEPTED; break;
+      case MG_TRUE: b->flags |= BODY_ACCEPTED; break;
+      default: break;
+    }
+  }
+}
+
+static void free_request_body(struct connection *conn) {
+  struct request_body *b = &conn->body;
+
+#ifndef _WIN32
+  if (b->map != NULL) {
+    munmap(b->map, (size_t) b->spool_len);
+  }
+#endif
+  if (b->spool != NULL) {
+    fclose(b->spool);
+  }
+  memset(b, 0, sizeof(*b));
+}
+
+// Pass decoded body bytes, which are at recv_iobuf + body.len, on
+static int consume_body_data(struct connection *conn, size_t n) {
+  struct iobuf *io = &conn->ns_conn->recv_iobuf;
+  struct request_body *b = &conn->body;
+#ifndef _WIN32
+  int64_t threshold = conn->server->spool_threshold;
+#endif
+
+  if (b->flags & BODY_STREAMED) {
+    conn->ht_conn.content = io->buf + b->len;
+    conn->ht_conn.content_len = n;
+    call_user(conn, MG_BODY);
+    iobuf_cut(io, b->len, n);
+    return 1;
+  }
+
+  b->len += n;
+#ifndef _WIN32
+  // Move large bodies out of memory
+  if (b->spool == NULL && threshold > 0 && (int64_t) b->len > threshold &&
+      (b->spool = tmpfile()) == NULL) {
+    return 0;
+  }
+#endif
+  if (b->spool != NULL) {
+    if (fwrite(io->buf, 1, b->len, b->spool) != b->len) return 0;
+    b->spool_len += b->len;
+    iobuf_cut(io, 0, b->len);
+    b->len = 0;
+  }
+  return 1;
+}
+
+// Make whole body available to MG_REQUEST as content, content_len
+static int finish_request_body(struct connection *conn) {
+  struct request_body *b = &conn->body;
+
+  conn->ht_conn.content_len = b->len;
+#ifndef _WIN32
+  if (b->spool != NULL) {
+    if (fflush(b->spool) != 0 ||
+        (b->map = mmap(NULL, (size_t) b->spool_len, PROT_READ, MAP_PRIVATE,
+                       fileno(b->spool), 0)) == MAP_FAILED) {
+      b->map = NULL;
+      return 0;
+    }
+    conn->ht_conn.content_len = (size_t) b->spool_len;
+  }
+#endif
+  return 1;
+}
+
+// Wait until a body the handler did not accept is buffered, as it came, so
+// that it can still go to another endpoint. MG_REQUEST gets a plain one as
+// content, and a chunked one not at all. Return 1 once complete.
+static int read_raw_request_body(struct connection *conn) {
+  struct iobuf *io = &conn->ns_conn->recv_iobuf;
+  struct request_body *b = &conn->body;
+
+  if (b->flags & BODY_CHUNKED) {
+    b->len += scan_chunked(&b->raw_state, &b->left, io->buf + b->len,
+                           (int) (io->len - b->len));
+    if (b->raw_state != CS_DONE) return 0;
+  } else if ((int64_t) io->len < b->left) {
+    return 0;
+  } else {
+    conn->ht_conn.content_len = (size_t) b->left;
+  }
+  b->state = BODY_DONE;
+  b->flags |= BODY_COMPLETE;
+  return 1;
+}
+
+// Read request body from recv_iobuf, decoding chunked encoding in place.
+// Return 1 if the body is complete, 0 if more data is needed, or -1 on
+// error, in which case the reply is already sent.
+static int read_request_body(struct connection *conn) {
+  struct iobuf *io = &conn->ns_conn->recv_iobuf;
+  struct request_body *b = &conn->body;
+  size_t avail, n;
+  char *p, *eol;
+  int64_t size;
+
+  if (b->state != BODY_DONE && !(b->flags & BODY_ACCEPTED)) {
+    return read_raw_request_body(conn);
+  }
+
+  while (b->state != BODY_DONE) {
+    p = io->buf + b->len;
+    avail = io->len - b->len;
+    eol = b->state == BODY_DATA ? NULL : (char *) memchr(p, '\n', avail);
+
+    if (b->state == BODY_DATA) {
+      n = (int64_t) avail < b->left ? avail : (size_t) b->left;
+      if (n == 0) return 0;
+      if (!consume_body_data(conn, n)) {
+        send_http_error(conn, 500, "Cannot spool request body");
+        return -1;
+      }
+      if ((b->left -= n) == 0) {
+        b->state = b->flags & BODY_CHUNKED ? BODY_CHUNK_END : BODY_DONE;
+      }
+    } else if (eol == NULL) {
+      if (avail > (b->state == BODY_TRAILER ? MAX_REQUEST_SIZE : 100)) break;
+      return 0;
+    } else if (b->state == BODY_CHUNK_SIZE) {
+      // Chunk size in hex, optionally followed by ;extensions
+      for (size = 0, n = 0; n < 15 && isxdigit(* (unsigned char *) (p + n));
+           n++) {
+        size = size * 16 + HEXTOI(tolower(* (unsigned char *) (p + n)));
+      }
+      if (n == 0 || isxdigit(* (unsigned char *) (p + n))) break;
+      iobuf_cut(io, b->len, eol - p + 1);
+      b->left = size;
+      b->state = size > 0 ? BODY_DATA : BODY_TRAILER;
+    } else if (b->state == BODY_CHUNK_END) {
+      if (eol - p > 1 || (eol - p == 1 && p[0] != '\r')) break;
+      iobuf_cut(io, b->len, eol - p + 1);
+      b->state = BODY_CHUNK_SIZE;
+    } else {
+      // Trailer fields are dropped, empty line ends the body
+      if (eol - p == 0 || (eol - p == 1 && p[0] == '\r')) {
+        b->state = BODY_DONE;
+      }
+      iobuf_cut(io, b->len, eol - p + 1);
+    }
+  }
+
+  if (b->state != BODY_DONE) {
+    send_http_error(conn, 400, "Bad chunked encoding");
+    return -1;
+  } else if (!(b->flags & BODY_COMPLETE)) {
+    b->flags |= BODY_COMPLETE;
+    if (!finish_request_body(conn)) {
+      send_http_error(conn, 500, "Cannot map request body");
+      return -1;
+    }
+  }
+  return 1;
+}
 
+static void call_request_handler_if_data_is_buffered(struct connection *conn) {
 #ifndef UMSERVER_NO_WEBSOCKET
   if (conn->ht_conn.is_websocket) {
     do { } while (deliver_websocket_frame(conn));
   } else
 #endif
-  if ((size_t) loc->len >= c->content_len &&
+  if (read_request_body(conn) > 0 &&
       call_request_handler(conn) == MG_FALSE) {
     open_local_endpoint(conn, 1);
   }
@@ -3086,7 +4287,6 @@ static int scan_directory(struct connection *conn, const char *dir,
     }
 
     if (arr_ind < arr_size) {
-      (*arr)[arr_ind].conn = conn;
       (*arr)[arr_ind].file_name = strdup(dp->d_name);
       stat(path, &(*arr)[arr_ind].st);
       arr_ind++;
@@ -3120,8 +4320,70 @@ int ht_url_encode(const char *src, size_t s_len, char *dst, size_t dst_len) {
 #endif  // !NO_DIRECTORY_LISTING || !UMSERVER_NO_DAV
 
 #ifndef UMSERVER_NO_DIRECTORY_LISTING
+// Directory listings are cached per directory and rescanned when directory
+// mtime changes, i.e. when files are added, removed or renamed. Changing a
+// file does not touch its directory, hence listings also expire after
+// UMSERVER_DIR_CACHE_TTL seconds.
+#ifndef UMSERVER_DIR_CACHE_TTL
+#define UMSERVER_DIR_CACHE_TTL 5
+#endif
+#ifndef UMSERVER_DIR_CACHE_ENTRIES
+#define UMSERVER_DIR_CACHE_ENTRIES 16
+#endif
+
+enum { SORT_BY_NAME, SORT_BY_DATE, SORT_BY_SIZE, NUM_SORT_ORDERS };
+enum { LISTING_HTML, LISTING_JSON, NUM_LISTING_FORMATS };
+
+struct dir_listing {
+  struct dir_listing *next;   // Most recently used first
+  char *path;
+  time_t mtime;               // Directory mtime at scan time
+  time_t scan_time;
+  struct dir_entry *entries;
+  int num_entries;
+  int num_dirs;               // Directories go first in every order
+  struct dir_entry **order[NUM_SORT_ORDERS];  // Ascending
+  char *items[NUM_LISTING_FORMATS];  // Formatted entries, back to back
+  int *item_ofs[NUM_LISTING_FORMATS];  // entries[i] is at items + ofs[i]
+  struct vec body[NUM_LISTING_FORMATS][NUM_SORT_ORDERS * 2];  // Rendered
+};
+
+static void free_dir_listing(struct dir_listing *dl) {
+  int i, j;
 
-static void print_dir_entry(const struct dir_entry *de) {
+  for (i = 0; i < dl->num_entries; i++) {
+    free(dl->entries[i].file_name);
+  }
+  for (i = 0; i < NUM_SORT_ORDERS; i++) {
+    free(dl->order[i]);
+  }
+  for (i = 0; i < NUM_LISTING_FORMATS; i++) {
+    free(dl->items[i]);
+    free(dl->item_ofs[i]);
+    for (j = 0; j < NUM_SORT_ORDERS * 2; j++) {
+      free((char *) dl->body[i][j].ptr);
+    }
+  }
+  free(dl->entries);
+  free(dl->path);
+  free(dl);
+}
+
+static void free_dir_listings(struct dir_listing *dl) {
+  struct dir_listing *next;
+
+  for (; dl != NULL; dl = next) {
+    next = dl->next;
+    free_dir_listing(dl);
+  }
+}
+
+static void clear_dir_cache(struct ht_server *server) {
+  free_dir_listings(server->dir_cache);
+  server->dir_cache = NULL;
+}
+
+static int format_html_entry(const struct dir_entry *de, char *buf, int len) {
   char size[64], mod[64], href[MAX_PATH_SIZE * 3];
   int64_t fsize = de->st.st_size;
   int is_dir = S_ISDIR(de->st.st_mode);
@@ -3144,79 +4406,277 @@ static void print_dir_entry(const struct dir_entry *de) {
   }
   strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M", localtime(&de->st.st_mtime));
   ht_url_encode(de->file_name, strlen(de->file_name), href, sizeof(href));
-  ht_printf_data(&de->conn->ht_conn,
-                  "<tr><td><a href=\"%s%s\">%s%s</a></td>"
-                  "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-                  href, slash, de->file_name, slash, mod, size);
+  return ht_snprintf(buf, len,
+                     "<tr><td><a href=\"%s%s\">%s%s</a></td>"
+                     "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+                     href, slash, de->file_name, slash, mod, size);
+}
+
+static int format_json_entry(const struct dir_entry *de, char *buf, int len) {
+  char name[MAX_PATH_SIZE * 6];
+  const unsigned char *s = (const unsigned char *) de->file_name;
+  int i = 0;
+
+  for (; *s != '\0' && i < (int) sizeof(name) - 7; s++) {
+    if (*s == '"' || *s == '\\') {
+      name[i++] = '\\';
+      name[i++] = *s;
+    } else if (*s < 0x20) {
+      i += ht_snprintf(name + i, sizeof(name) - i, "\\u%04x", *s);
+    } else {
+      name[i++] = *s;
+    }
+  }
+  name[i] = '\0';
+
+  return ht_snprintf(buf, len,
+                     "{\"name\":\"%s\",\"dir\":%s,\"size\":%" INT64_FMT
+                     ",\"mtime\":%lu}",
+                     name, S_ISDIR(de->st.st_mode) ? "true" : "false",
+                     (int64_t) de->st.st_size,
+                     (unsigned long) de->st.st_mtime);
 }
 
 // Sort directory entries by size, or name, or modification time.
+// Directories always go on top, ties are broken by name.
 // On windows, __cdecl specification is needed in case if project is built
 // with __stdcall convention. qsort always requires __cdels callback.
-static int __cdecl compare_dir_entries(const void *p1, const void *p2) {
-  const struct dir_entry *a = (const struct dir_entry *) p1,
-        *b = (const struct dir_entry *) p2;
-  const char *qs = a->conn->ht_conn.query_string ?
-    a->conn->ht_conn.query_string : "na";
-  int cmp_result = 0;
+static int __cdecl compare_by_name(const void *p1, const void *p2) {
+  const struct dir_entry *a = * (const struct dir_entry * const *) p1,
+        *b = * (const struct dir_entry * const *) p2;
 
   if (S_ISDIR(a->st.st_mode) && !S_ISDIR(b->st.st_mode)) {
-    return -1;  // Always put directories on top
+    return -1;
   } else if (!S_ISDIR(a->st.st_mode) && S_ISDIR(b->st.st_mode)) {
-    return 1;   // Always put directories on top
-  } else if (*qs == 'n') {
-    cmp_result = strcmp(a->file_name, b->file_name);
-  } else if (*qs == 's') {
-    cmp_result = a->st.st_size == b->st.st_size ? 0 :
-      a->st.st_size > b->st.st_size ? 1 : -1;
-  } else if (*qs == 'd') {
-    cmp_result = a->st.st_mtime == b->st.st_mtime ? 0 :
-      a->st.st_mtime > b->st.st_mtime ? 1 : -1;
+    return 1;
   }
-
-  return qs[1] == 'd' ? -cmp_result : cmp_result;
+  return strcmp(a->file_name, b->file_name);
 }
 
-static void send_directory_listing(struct connection *conn, const char *dir) {
-  struct dir_entry *arr = NULL;
-  int i, num_entries, sort_direction = conn->ht_conn.query_string != NULL &&
-    conn->ht_conn.query_string[1] == 'd' ? 'a' : 'd';
-
-  ht_send_header(&conn->ht_conn, "Transfer-Encoding", "chunked");
-  ht_send_header(&conn->ht_conn, "Content-Type", "text/html; charset=utf-8");
-
-  ht_printf_data(&conn->ht_conn,
-              "<html><head><title>Index of %s</title>"
-              "<style>th {text-align: left;}</style></head>"
-              "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
-              "<tr><th><a href=\"?n%c\">Name</a></th>"
-              "<th><a href=\"?d%c\">Modified</a></th>"
-              "<th><a href=\"?s%c\">Size</a></th></tr>"
-              "<tr><td colspan=\"3\"><hr></td></tr>",
-              conn->ht_conn.uri, conn->ht_conn.uri,
-              sort_direction, sort_direction, sort_direction);
-
-  num_entries = scan_directory(conn, dir, &arr);
-  qsort(arr, num_entries, sizeof(arr[0]), compare_dir_entries);
-  for (i = 0; i < num_entries; i++) {
-    print_dir_entry(&arr[i]);
-    free(arr[i].file_name);
-  }
-  free(arr);
+static int __cdecl compare_by_date(const void *p1, const void *p2) {
+  const struct dir_entry *a = * (const struct dir_entry * const *) p1,
+        *b = * (const struct dir_entry * const *) p2;
 
-  write_terminating_chunk(conn);
-  close_local_endpoint(conn);
+  if (S_ISDIR(a->st.st_mode) == S_ISDIR(b->st.st_mode) &&
+      a->st.st_mtime != b->st.st_mtime) {
+    return a->st.st_mtime > b->st.st_mtime ? 1 : -1;
+  }
+  return compare_by_name(p1, p2);
 }
-#endif // UMSERVER_NO_DIRECTORY_LISTING
 
-#ifndef UMSERVER_NO_DAV
-static void print_props(struct connection *conn, const char *uri,
-                        file_stat_t *stp) {
-  char mtime[64];
+static int __cdecl compare_by_size(const void *p1, const void *p2) {
+  const struct dir_entry *a = * (const struct dir_entry * const *) p1,
+        *b = * (const struct dir_entry * const *) p2;
 
-  gmt_time_string(mtime, sizeof(mtime), &stp->st_mtime);
-  ht_printf(&conn->ht_conn,
-      "<d:response>"
+  if (S_ISDIR(a->st.st_mode) == S_ISDIR(b->st.st_mode) &&
+      a->st.st_size != b->st.st_size) {
+    return a->st.st_size > b->st.st_size ? 1 : -1;
+  }
+  return compare_by_name(p1, p2);
+}
+
+// Format every entry once, in both formats, and sort it in every order
+static struct dir_listing *build_dir_listing(struct connection *conn,
+                                             const char *dir,
+                                             const file_stat_t *st) {
+  static int (__cdecl *cmp[NUM_SORT_ORDERS])(const void *, const void *) = {
+    compare_by_name, compare_by_date, compare_by_size
+  };
+  static int (*fmt[NUM_LISTING_FORMATS])(const struct dir_entry *,
+                                         char *, int) = {
+    format_html_entry, format_json_entry
+  };
+  struct dir_listing *dl;
+  char buf[MAX_PATH_SIZE * 8], *p;
+  size_t len, size;
+  int i, k, n;
+
+  if ((dl = (struct dir_listing *) calloc(1, sizeof(*dl))) == NULL ||
+      (dl->path = ht_strdup(dir)) == NULL) {
+    free(dl);
+    return NULL;
+  }
+  dl->mtime = st->st_mtime;
+  dl->scan_time = time(NULL);
+  dl->num_entries = scan_directory(conn, dir, &dl->entries);
+
+  for (k = 0; k < NUM_SORT_ORDERS; k++) {
+    if ((dl->order[k] = (struct dir_entry **)
+         malloc((dl->num_entries + 1) * sizeof(dl->order[k][0]))) == NULL) {
+      free_dir_listing(dl);
+      return NULL;
+    }
+    for (i = 0; i < dl->num_entries; i++) {
+      dl->order[k][i] = &dl->entries[i];
+    }
+    qsort(dl->order[k], dl->num_entries, sizeof(dl->order[k][0]), cmp[k]);
+  }
+
+  for (k = 0; k < NUM_LISTING_FORMATS; k++) {
+    if ((dl->item_ofs[k] = (int *)
+         malloc((dl->num_entries + 1) * sizeof(int))) == NULL) {
+      free_dir_listing(dl);
+      return NULL;
+    }
+    for (i = len = size = 0; i < dl->num_entries; i++) {
+      n = fmt[k](&dl->entries[i], buf, sizeof(buf));
+      if (len + n > size) {
+        size = (len + n) * 2;
+        if ((p = (char *) realloc(dl->items[k], size)) == NULL) {
+          free_dir_listing(dl);
+          return NULL;
+        }
+        dl->items[k] = p;
+      }
+      memcpy(dl->items[k] + len, buf, n);
+      dl->item_ofs[k][i] = (int) len;
+      len += n;
+    }
+    dl->item_ofs[k][i] = (int) len;
+  }
+
+  for (i = 0; i < dl->num_entries; i++) {
+    dl->num_dirs += S_ISDIR(dl->entries[i].st.st_mode) ? 1 : 0;
+  }
+
+  return dl;
+}
+
+// Return cached listing of a directory, rescanning it if it is stale
+static struct dir_listing *get_dir_listing(struct connection *conn,
+                                           const char *dir) {
+  struct ht_server *server = conn->server;
+  struct dir_listing **p, *dl;
+  file_stat_t st;
+  int n;
+
+  if (stat(dir, &st) != 0) return NULL;
+
+  for (p = &server->dir_cache; (dl = *p) != NULL; p = &dl->next) {
+    if (strcmp(dl->path, dir) == 0) {
+      *p = dl->next;
+      if (dl->mtime != st.st_mtime ||
+          dl->scan_time + UMSERVER_DIR_CACHE_TTL < time(NULL)) {
+        free_dir_listing(dl);
+        dl = NULL;
+      }
+      break;
+    }
+  }
+
+  if (dl == NULL && (dl = build_dir_listing(conn, dir, &st)) == NULL) {
+    return NULL;
+  }
+  dl->next = server->dir_cache;
+  server->dir_cache = dl;
+
+  // Evict least recently used listings
+  for (n = 1; dl->next != NULL; dl = dl->next, n++) {
+    if (n >= UMSERVER_DIR_CACHE_ENTRIES) {
+      free_dir_listings(dl->next);
+      dl->next = NULL;
+      break;
+    }
+  }
+
+  return server->dir_cache;
+}
+
+// Concatenate formatted entries in the given order. Descending orders
+// walk directories and files backwards, keeping directories on top.
+static const struct vec *get_listing_body(struct dir_listing *dl,
+                                          int format, int order, int desc) {
+  struct vec *body = &dl->body[format][order * 2 + desc];
+  const char *sep = format == LISTING_JSON ? ",\n" : "";
+  size_t sep_len = strlen(sep);
+  const struct dir_entry *de;
+  char *p;
+  int i, j, k, n = dl->num_entries;
+
+  if (body->ptr != NULL || n == 0) return body;
+
+  body->len = dl->item_ofs[format][n] + (int) sep_len * (n - 1);
+  if ((p = (char *) malloc(body->len)) == NULL) {
+    body->len = 0;
+    return body;
+  }
+  body->ptr = p;
+
+  for (i = 0; i < n; i++) {
+    j = !desc ? i : i < dl->num_dirs ? dl->num_dirs - 1 - i :
+      n - 1 - (i - dl->num_dirs);
+    de = dl->order[order][j];
+    k = (int) (de - dl->entries);
+    if (i > 0) {
+      memcpy(p, sep, sep_len);
+      p += sep_len;
+    }
+    memcpy(p, dl->items[format] + dl->item_ofs[format][k],
+           dl->item_ofs[format][k + 1] - dl->item_ofs[format][k]);
+    p += dl->item_ofs[format][k + 1] - dl->item_ofs[format][k];
+  }
+
+  return body;
+}
+
+static void send_directory_listing(struct connection *conn, const char *dir) {
+  const char *qs = conn->ht_conn.query_string != NULL ?
+    conn->ht_conn.query_string : "na";
+  const char *accept = ht_get_header(&conn->ht_conn, "Accept");
+  int order = qs[0] == 'd' ? SORT_BY_DATE : qs[0] == 's' ? SORT_BY_SIZE :
+    SORT_BY_NAME, desc = qs[0] != '\0' && qs[1] == 'd';
+  int format = accept != NULL && strstr(accept, "application/json") != NULL ?
+    LISTING_JSON : LISTING_HTML;
+  int sort_direction = desc ? 'a' : 'd';
+  struct dir_listing *dl;
+  const struct vec *body;
+
+  if ((dl = get_dir_listing(conn, dir)) == NULL) {
+    send_http_error(conn, 500, "Cannot list directory");
+    return;
+  }
+
+  ht_send_header(&conn->ht_conn, "Transfer-Encoding", "chunked");
+  if (format == LISTING_JSON) {
+    ht_send_header(&conn->ht_conn, "Content-Type",
+                   "application/json; charset=utf-8");
+    ht_send_data(&conn->ht_conn, "[\n", 2);
+  } else {
+    ht_send_header(&conn->ht_conn, "Content-Type", "text/html; charset=utf-8");
+    ht_printf_data(&conn->ht_conn,
+                "<html><head><title>Index of %s</title>"
+                "<style>th {text-align: left;}</style></head>"
+                "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
+                "<tr><th><a href=\"?n%c\">Name</a></th>"
+                "<th><a href=\"?d%c\">Modified</a></th>"
+                "<th><a href=\"?s%c\">Size</a></th></tr>"
+                "<tr><td colspan=\"3\"><hr></td></tr>",
+                conn->ht_conn.uri, conn->ht_conn.uri,
+                sort_direction, sort_direction, sort_direction);
+  }
+
+  body = get_listing_body(dl, format, order, desc);
+  if (body->len > 0) {
+    reserve_send_buffer(conn->ns_conn, body->len + 20);
+    ht_send_data(&conn->ht_conn, body->ptr, body->len);
+  }
+  if (format == LISTING_JSON) {
+    ht_send_data(&conn->ht_conn, "\n]\n", 3);
+  }
+
+  write_terminating_chunk(conn);
+  close_local_endpoint(conn);
+}
+#endif // UMSERVER_NO_DIRECTORY_LISTING
+
+#ifndef UMSERVER_NO_DAV
+static void print_props(struct connection *conn, const char *uri,
+                        file_stat_t *stp) {
+  char mtime[64];
+
+  gmt_time_string(mtime, sizeof(mtime), &stp->st_mtime);
+  ht_printf(&conn->ht_conn,
+      "<d:response>"
        "<d:href>%s</d:href>"
        "<d:propstat>"
         "<d:prop>"
@@ -3426,31 +4886,6 @@ void ht_send_digest_auth_request(struct ht_connection *c) {
   close_local_endpoint(conn);
 }
 
-// Use the global passwords file, if specified by auth_gpass option,
-// or search for .htpasswd in the requested directory.
-static FILE *open_auth_file(struct connection *conn, const char *path) {
-  char name[MAX_PATH_SIZE];
-  const char *p, *gpass = conn->server->config_options[GLOBAL_AUTH_FILE];
-  file_stat_t st;
-  FILE *fp = NULL;
-
-  if (gpass != NULL) {
-    // Use global passwords file
-    fp = fopen(gpass, "r");
-  } else if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
-    ht_snprintf(name, sizeof(name), "%s%c%s", path, '/', PASSWORDS_FILE_NAME);
-    fp = fopen(name, "r");
-  } else {
-    // Try to find .htpasswd in requested directory.
-    if ((p = strrchr(path, '/')) == NULL) p = path;
-    ht_snprintf(name, sizeof(name), "%.*s%c%s",
-                (int) (p - path), path, '/', PASSWORDS_FILE_NAME);
-    fp = fopen(name, "r");
-  }
-
-  return fp;
-}
-
 #if !defined(HAVE_MD5) && !defined(UMSERVER_NO_AUTH)
 typedef struct MD5Context {
   uint32_t buf[4];
@@ -3458,20 +4893,6 @@ typedef struct MD5Context {
   unsigned char in[64];
 } MD5_CTX;
 
-static void byteReverse(unsigned char *buf, unsigned longs) {
-  uint32_t t;
-
-  // Forrest: MD5 expect LITTLE_ENDIAN, swap if BIG_ENDIAN
-  if (is_big_endian()) {
-    do {
-      t = (uint32_t) ((unsigned) buf[3] << 8 | buf[2]) << 16 |
-        ((unsigned) buf[1] << 8 | buf[0]);
-      * (uint32_t *) buf = t;
-      buf += 4;
-    } while (--longs);
-  }
-}
-
 #define F1(x, y, z) (z ^ (x & (y ^ z)))
 #define F2(x, y, z) F1(z, x, y)
 #define F3(x, y, z) (x ^ y ^ z)
@@ -3480,6 +4901,11 @@ static void byteReverse(unsigned char *buf, unsigned longs) {
 #define MD5STEP(f, w, x, y, z, data, s) \
   ( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
 
+// Same as MD5STEP(F2, ...). F2 terms do not overlap, so they can be added
+// separately, and the one that does not depend on x is computed early.
+#define MD5STEP2(w, x, y, z, data, s) \
+  ( w += (y & ~z) + data,  w += x & z,  w = w<<s | w>>(32-s),  w += x )
+
 // Start MD5 accumulation.  Set bit count to 0 and buffer to mysterious
 // initialization constants.
 static void MD5Init(MD5_CTX *ctx) {
@@ -3492,86 +4918,100 @@ static void MD5Init(MD5_CTX *ctx) {
   ctx->bits[1] = 0;
 }
 
-static void MD5Transform(uint32_t buf[4], uint32_t const in[16]) {
+// Hash num_blocks consecutive 64-byte blocks
+static void md5_blocks(uint32_t buf[4], const unsigned char *data,
+                       size_t num_blocks) {
   register uint32_t a, b, c, d;
-
-  a = buf[0];
-  b = buf[1];
-  c = buf[2];
-  d = buf[3];
-
-  MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
-  MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
-  MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
-  MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
-  MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
-  MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
-  MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
-  MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
-  MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
-  MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
-  MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-  MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-  MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
-  MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-  MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-  MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-  MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-  MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-  MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-  MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-  MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-  MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-  MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-  MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-  MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-  MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-  MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-  MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-  MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-  MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-  MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-  MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-  MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
-  MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
-  MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-  MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-  MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
-  MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
-  MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
-  MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-  MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
-  MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
-  MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
-  MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
-  MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
-  MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-  MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-  MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
-
-  MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
-  MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
-  MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-  MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
-  MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
-  MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
-  MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-  MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
-  MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
-  MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-  MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
-  MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-  MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
-  MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-  MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
-  MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
-
-  buf[0] += a;
-  buf[1] += b;
-  buf[2] += c;
-  buf[3] += d;
+  uint32_t in[16];
+
+  for (; num_blocks > 0; num_blocks--, data += 64) {
+    // Unrolled, so that compilers emit plain loads instead of vector code
+    in[0] = LOAD_LE32(data + 0); in[1] = LOAD_LE32(data + 4);
+    in[2] = LOAD_LE32(data + 8); in[3] = LOAD_LE32(data + 12);
+    in[4] = LOAD_LE32(data + 16); in[5] = LOAD_LE32(data + 20);
+    in[6] = LOAD_LE32(data + 24); in[7] = LOAD_LE32(data + 28);
+    in[8] = LOAD_LE32(data + 32); in[9] = LOAD_LE32(data + 36);
+    in[10] = LOAD_LE32(data + 40); in[11] = LOAD_LE32(data + 44);
+    in[12] = LOAD_LE32(data + 48); in[13] = LOAD_LE32(data + 52);
+    in[14] = LOAD_LE32(data + 56); in[15] = LOAD_LE32(data + 60);
+    a = buf[0];
+    b = buf[1];
+    c = buf[2];
+    d = buf[3];
+
+    MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+    MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+    MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
+    MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+    MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+    MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+    MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
+    MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
+    MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
+    MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+    MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+    MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+    MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
+    MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+    MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+    MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+    MD5STEP2(a, b, c, d, in[1] + 0xf61e2562, 5);
+    MD5STEP2(d, a, b, c, in[6] + 0xc040b340, 9);
+    MD5STEP2(c, d, a, b, in[11] + 0x265e5a51, 14);
+    MD5STEP2(b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+    MD5STEP2(a, b, c, d, in[5] + 0xd62f105d, 5);
+    MD5STEP2(d, a, b, c, in[10] + 0x02441453, 9);
+    MD5STEP2(c, d, a, b, in[15] + 0xd8a1e681, 14);
+    MD5STEP2(b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+    MD5STEP2(a, b, c, d, in[9] + 0x21e1cde6, 5);
+    MD5STEP2(d, a, b, c, in[14] + 0xc33707d6, 9);
+    MD5STEP2(c, d, a, b, in[3] + 0xf4d50d87, 14);
+    MD5STEP2(b, c, d, a, in[8] + 0x455a14ed, 20);
+    MD5STEP2(a, b, c, d, in[13] + 0xa9e3e905, 5);
+    MD5STEP2(d, a, b, c, in[2] + 0xfcefa3f8, 9);
+    MD5STEP2(c, d, a, b, in[7] + 0x676f02d9, 14);
+    MD5STEP2(b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+    MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+    MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
+    MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+    MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+    MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+    MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+    MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+    MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+    MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+    MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+    MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+    MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
+    MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+    MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+    MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+    MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+    MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
+    MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
+    MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+    MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+    MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+    MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+    MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+    MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+    MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+    MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+    MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
+    MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+    MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+    MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+    MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+    MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+  }
 }
 
 static void MD5Update(MD5_CTX *ctx, unsigned char const *buf, unsigned len) {
@@ -3593,18 +5033,15 @@ static void MD5Update(MD5_CTX *ctx, unsigned char const *buf, unsigned len) {
       return;
     }
     memcpy(p, buf, t);
-    byteReverse(ctx->in, 16);
-    MD5Transform(ctx->buf, (uint32_t *) ctx->in);
+    md5_blocks(ctx->buf, ctx->in, 1);
     buf += t;
     len -= t;
   }
 
-  while (len >= 64) {
-    memcpy(ctx->in, buf, 64);
-    byteReverse(ctx->in, 16);
-    MD5Transform(ctx->buf, (uint32_t *) ctx->in);
-    buf += 64;
-    len -= 64;
+  if (len >= 64) {
+    md5_blocks(ctx->buf, buf, len / 64);
+    buf += len & ~63U;
+    len &= 63;
   }
 
   memcpy(ctx->in, buf, len);
@@ -3613,7 +5050,7 @@ static void MD5Update(MD5_CTX *ctx, unsigned char const *buf, unsigned len) {
 static void MD5Final(unsigned char digest[16], MD5_CTX *ctx) {
   unsigned count;
   unsigned char *p;
-  uint32_t *a;
+  int i;
 
   count = (ctx->bits[0] >> 3) & 0x3F;
 
@@ -3622,39 +5059,25 @@ static void MD5Final(unsigned char digest[16], MD5_CTX *ctx) {
   count = 64 - 1 - count;
   if (count < 8) {
     memset(p, 0, count);
-    byteReverse(ctx->in, 16);
-    MD5Transform(ctx->buf, (uint32_t *) ctx->in);
+    md5_blocks(ctx->buf, ctx->in, 1);
     memset(ctx->in, 0, 56);
   } else {
     memset(p, 0, count - 8);
   }
-  byteReverse(ctx->in, 14);
 
-  a = (uint32_t *)ctx->in;
-  a[14] = ctx->bits[0];
-  a[15] = ctx->bits[1];
+  store_le32(ctx->in + 56, ctx->bits[0]);
+  store_le32(ctx->in + 60, ctx->bits[1]);
+  md5_blocks(ctx->buf, ctx->in, 1);
 
-  MD5Transform(ctx->buf, (uint32_t *) ctx->in);
-  byteReverse((unsigned char *) ctx->buf, 4);
-  memcpy(digest, ctx->buf, 16);
+  for (i = 0; i < 4; i++) {
+    store_le32(digest + i * 4, ctx->buf[i]);
+  }
   memset((char *) ctx, 0, sizeof(*ctx));
 }
 #endif // !HAVE_MD5
 
 
 
-// Stringify binary data. Output buffer must be twice as big as input,
-// because each byte takes 2 bytes in string representation
-static void bin2str(char *to, const unsigned char *p, size_t len) {
-  static const char *hex = "0123456789abcdef";
-
-  for (; len--; p++) {
-    *to++ = hex[p[0] >> 4];
-    *to++ = hex[p[0] & 0x0f];
-  }
-  *to = '\0';
-}
-
 // Return stringified MD5 hash for list of strings. Buffer must be 33 bytes.
 char *ht_md5(char buf[33], ...) {
   unsigned char hash[16];
@@ -3696,61 +5119,327 @@ static int check_password(const char *method, const char *ha1, const char *uri,
 }
 
 
+struct digest_auth {
+  char user[100], nonce[100], uri[MAX_REQUEST_SIZE], cnonce[100],
+       resp[100], qop[100], nc[100];
+};
+
+static int parse_digest_auth(const struct ht_connection *c,
+                             struct digest_auth *da) {
+  const char *hdr;
+
+  if ((hdr = ht_get_header(c, "Authorization")) == NULL ||
+      ht_strncasecmp(hdr, "Digest ", 7) != 0) return 0;
+  if (!ht_parse_header(hdr, "username", da->user, sizeof(da->user))) return 0;
+  if (!ht_parse_header(hdr, "cnonce", da->cnonce, sizeof(da->cnonce))) return 0;
+  if (!ht_parse_header(hdr, "response", da->resp, sizeof(da->resp))) return 0;
+  if (!ht_parse_header(hdr, "uri", da->uri, sizeof(da->uri))) return 0;
+  if (!ht_parse_header(hdr, "qop", da->qop, sizeof(da->qop))) return 0;
+  if (!ht_parse_header(hdr, "nc", da->nc, sizeof(da->nc))) return 0;
+  if (!ht_parse_header(hdr, "nonce", da->nonce, sizeof(da->nonce))) return 0;
+
+  return 1;
+}
+
 // Authorize against the opened passwords file. Return 1 if authorized.
 int ht_authorize_digest(struct ht_connection *c, FILE *fp) {
   struct connection *conn = MG_CONN_2_CONN(c);
-  const char *hdr;
-  char line[256], f_user[256], ha1[256], f_domain[256], user[100], nonce[100],
-       uri[MAX_REQUEST_SIZE], cnonce[100], resp[100], qop[100], nc[100];
+  struct digest_auth da;
+  char line[256], f_user[256], ha1[256], f_domain[256];
 
   if (c == NULL || fp == NULL) return 0;
-  if ((hdr = ht_get_header(c, "Authorization")) == NULL ||
-      ht_strncasecmp(hdr, "Digest ", 7) != 0) return 0;
-  if (!ht_parse_header(hdr, "username", user, sizeof(user))) return 0;
-  if (!ht_parse_header(hdr, "cnonce", cnonce, sizeof(cnonce))) return 0;
-  if (!ht_parse_header(hdr, "response", resp, sizeof(resp))) return 0;
-  if (!ht_parse_header(hdr, "uri", uri, sizeof(uri))) return 0;
-  if (!ht_parse_header(hdr, "qop", qop, sizeof(qop))) return 0;
-  if (!ht_parse_header(hdr, "nc", nc, sizeof(nc))) return 0;
-  if (!ht_parse_header(hdr, "nonce", nonce, sizeof(nonce))) return 0;
+  if (!parse_digest_auth(c, &da)) return 0;
 
   while (fgets(line, sizeof(line), fp) != NULL) {
     if (sscanf(line, "%[^:]:%[^:]:%s", f_user, f_domain, ha1) == 3 &&
-        !strcmp(user, f_user) &&
+        !strcmp(da.user, f_user) &&
         // NOTE(lsm): due to a bug in MSIE, we do not compare URIs
         !strcmp(conn->server->config_options[AUTH_DOMAIN], f_domain))
-      return check_password(c->request_method, ha1, uri,
-                            nonce, nc, cnonce, qop, resp);
+      return check_password(c->request_method, ha1, da.uri,
+                            da.nonce, da.nc, da.cnonce, da.qop, da.resp);
   }
   return MG_FALSE;
 }
 
+// Passwords files are parsed once into a table keyed by user and domain.
+// A file is stat()-ed at most once per UMSERVER_AUTH_RECHECK seconds, and
+// reloaded when its mtime or size changes. Missing files are cached too, so
+// that directories without .htpasswd do not cost a fopen() per request.
+#ifndef UMSERVER_AUTH_RECHECK
+#define UMSERVER_AUTH_RECHECK 1
+#endif
+#ifndef UMSERVER_AUTH_MAX_FILES
+#define UMSERVER_AUTH_MAX_FILES 1024
+#endif
+
+struct auth_user {
+  struct auth_user *next;
+  unsigned int hash;          // Of user and domain
+  const char *user, *domain, *ha1;  // Stored right after this structure
+};
+
+struct auth_file {
+  struct auth_file *next;
+  char *path;
+  int exists;                 // File could be opened at last check
+  time_t mtime;
+  int64_t size;
+  time_t checked;             // When the file was last stat()-ed
+  struct auth_user **users;
+  unsigned int num_buckets;   // Power of 2
+};
+
+// Authorization header of a request that passed check_password(). Repeated
+// identical credentials are accepted without recomputing the digest, as
+// long as the user's ha1 has not changed.
+struct auth_nonce {
+  unsigned int hash;
+  char *key;                  // Request method and Authorization header
+  char ha1[33];
+};
+
+static unsigned int hash_user(const char *user, const char *domain) {
+  return hash_string(user, strlen(user)) ^
+    (hash_string(domain, strlen(domain)) * 31);
+}
+
+static void free_auth_users(struct auth_file *af) {
+  struct auth_user *u, *next;
+  unsigned int i;
+
+  for (i = 0; i < af->num_buckets; i++) {
+    for (u = af->users[i]; u != NULL; u = next) {
+      next = u->next;
+      free(u);
+    }
+  }
+  free(af->users);
+  af->users = NULL;
+  af->num_buckets = 0;
+}
+
+static const char *find_ha1(const struct auth_file *af, const char *user,
+                            const char *domain) {
+  unsigned int hash = hash_user(user, domain);
+  const struct auth_user *u;
+
+  if (af->num_buckets == 0) return NULL;
+  for (u = af->users[hash & (af->num_buckets - 1)]; u != NULL; u = u->next) {
+    if (u->hash == hash && !strcmp(u->user, user) &&
+        !strcmp(u->domain, domain)) {
+      return u->ha1;
+    }
+  }
+  return NULL;
+}
 
-// Return 1 if request is authorised, 0 otherwise.
-static int is_authorized(struct connection *conn, const char *path) {
+static void load_auth_file(struct auth_file *af) {
+  char line[256], f_user[256], ha1[256], f_domain[256];
+  struct auth_user *list = NULL, *u, *next;
+  unsigned int n = 0, i;
+  size_t lu, ld, lh;
   FILE *fp;
-  int authorized = MG_TRUE;
 
-  if ((fp = open_auth_file(conn, path)) != NULL) {
-    authorized = ht_authorize_digest(&conn->ht_conn, fp);
-    fclose(fp);
+  free_auth_users(af);
+  if ((af->exists = (fp = fopen(af->path, "r")) != NULL) == 0) return;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%[^:]:%[^:]:%s", f_user, f_domain, ha1) != 3) continue;
+    lu = strlen(f_user) + 1;
+    ld = strlen(f_domain) + 1;
+    lh = strlen(ha1) + 1;
+    if ((u = (struct auth_user *) malloc(sizeof(*u) + lu + ld + lh)) == NULL) {
+      continue;
+    }
+    u->user = (const char *) memcpy(u + 1, f_user, lu);
+    u->domain = (const char *) memcpy((char *) (u + 1) + lu, f_domain, ld);
+    u->ha1 = (const char *) memcpy((char *) (u + 1) + lu + ld, ha1, lh);
+    u->hash = hash_user(f_user, f_domain);
+    u->next = list;
+    list = u;
+    n++;
   }
+  fclose(fp);
 
-  return authorized;
+  for (af->num_buckets = 16; af->num_buckets < n; af->num_buckets *= 2) ;
+  if ((af->users = (struct auth_user **)
+       calloc(af->num_buckets, sizeof(af->users[0]))) == NULL) {
+    af->num_buckets = 0;
+  }
+
+  // List is in reverse file order. Inserting at bucket heads makes the
+  // first line for a user win, like a sequential scan does.
+  for (u = list; u != NULL; u = next) {
+    next = u->next;
+    if (af->users == NULL) {
+      free(u);
+    } else {
+      i = u->hash & (af->num_buckets - 1);
+      u->next = af->users[i];
+      af->users[i] = u;
+    }
+  }
+}
+
+static void clear_auth_cache(struct ht_server *server) {
+  struct auth_file *af, *next;
+  int i;
+
+  for (i = 0; i < (int) ARRAY_SIZE(server->auth_files); i++) {
+    for (af = server->auth_files[i]; af != NULL; af = next) {
+      next = af->next;
+      free_auth_users(af);
+      free(af->path);
+      free(af);
+    }
+    server->auth_files[i] = NULL;
+  }
+  server->num_auth_files = 0;
+
+  for (i = 0; i < (int) ARRAY_SIZE(server->auth_nonces); i++) {
+    if (server->auth_nonces[i] != NULL) {
+      free(server->auth_nonces[i]->key);
+      free(server->auth_nonces[i]);
+      server->auth_nonces[i] = NULL;
+    }
+  }
+}
+
+// Return parsed passwords file, reloading it if it has changed
+static struct auth_file *get_auth_file(struct ht_server *server,
+                                       const char *path) {
+  unsigned int hash = hash_string(path, strlen(path));
+  struct auth_file **bucket, *af;
+  time_t now = time(NULL);
+  file_stat_t st;
+
+  bucket = &server->auth_files[hash % ARRAY_SIZE(server->auth_files)];
+  for (af = *bucket; af != NULL; af = af->next) {
+    if (!strcmp(af->path, path)) break;
+  }
+
+  if (af == NULL) {
+    if (server->num_auth_files >= UMSERVER_AUTH_MAX_FILES) {
+      clear_auth_cache(server);
+    }
+    if ((af = (struct auth_file *) calloc(1, sizeof(*af))) == NULL ||
+        (af->path = ht_strdup(path)) == NULL) {
+      free(af);
+      return NULL;
+    }
+    af->next = *bucket;
+    *bucket = af;
+    server->num_auth_files++;
+    af->checked = now - UMSERVER_AUTH_RECHECK;
+    af->mtime = -1;
+  }
+
+  if (now - af->checked >= UMSERVER_AUTH_RECHECK || now < af->checked) {
+    af->checked = now;
+    if (stat(path, &st) != 0) {
+      free_auth_users(af);
+      af->exists = 0;
+      af->mtime = -1;
+    } else if (st.st_mtime != af->mtime || st.st_size != af->size ||
+               !af->exists) {
+      af->mtime = st.st_mtime;
+      af->size = st.st_size;
+      load_auth_file(af);
+    }
+  }
+
+  return af;
+}
+
+static int authorize_digest(struct connection *conn,
+                            const struct auth_file *af) {
+  struct ht_server *server = conn->server;
+  struct auth_nonce **slot, *an;
+  const char *hdr = ht_get_header(&conn->ht_conn, "Authorization");
+  const char *method = conn->ht_conn.request_method;
+  struct digest_auth da;
+  const char *ha1;
+  char *key;
+  unsigned int hash;
+  size_t len;
+
+  if (!parse_digest_auth(&conn->ht_conn, &da) ||
+      (ha1 = find_ha1(af, da.user, server->config_options[AUTH_DOMAIN])) ==
+      NULL) {
+    return MG_FALSE;
+  }
+
+  len = strlen(method) + strlen(hdr) + 2;
+  if ((key = (char *) malloc(len)) == NULL) return MG_FALSE;
+  ht_snprintf(key, len, "%s %s", method, hdr);
+  hash = hash_string(key, len - 1);
+  slot = &server->auth_nonces[hash % ARRAY_SIZE(server->auth_nonces)];
+
+  if ((an = *slot) != NULL && an->hash == hash && !strcmp(an->key, key) &&
+      !strcmp(an->ha1, ha1)) {
+    free(key);
+    return MG_TRUE;
+  }
+
+  // NOTE(lsm): due to a bug in MSIE, we do not compare URIs
+  if (!check_password(method, ha1, da.uri, da.nonce, da.nc,
+                      da.cnonce, da.qop, da.resp)) {
+    free(key);
+    return MG_FALSE;
+  }
+
+  if (an == NULL && (an = (struct auth_nonce *) malloc(sizeof(*an))) != NULL) {
+    *slot = an;
+  } else if (an != NULL) {
+    free(an->key);
+  }
+  if (an != NULL) {
+    an->hash = hash;
+    an->key = key;
+    ht_snprintf(an->ha1, sizeof(an->ha1), "%s", ha1);
+  } else {
+    free(key);
+  }
+
+  return MG_TRUE;
+}
+
+// Return 1 if request is authorised, 0 otherwise. Use the global passwords
+// file, if specified by auth_gpass option, or .htpasswd in the requested
+// directory.
+static int is_authorized(struct connection *conn, const char *path,
+                         int is_directory) {
+  char name[MAX_PATH_SIZE];
+  const char *p, *gpass = conn->server->config_options[GLOBAL_AUTH_FILE];
+  const struct auth_file *af;
+
+  if (gpass != NULL) {
+    ht_snprintf(name, sizeof(name), "%s", gpass);
+  } else if (is_directory) {
+    ht_snprintf(name, sizeof(name), "%s%c%s", path, '/', PASSWORDS_FILE_NAME);
+  } else {
+    if ((p = strrchr(path, '/')) == NULL) p = path;
+    ht_snprintf(name, sizeof(name), "%.*s%c%s",
+                (int) (p - path), path, '/', PASSWORDS_FILE_NAME);
+  }
+
+  if ((af = get_auth_file(conn->server, name)) == NULL) return MG_FALSE;
+  return af->exists ? authorize_digest(conn, af) : MG_TRUE;
 }
 
 static int is_authorized_for_dav(struct connection *conn) {
   const char *auth_file = conn->server->config_options[DAV_AUTH_FILE];
   const char *method = conn->ht_conn.request_method;
-  FILE *fp;
+  const struct auth_file *af;
   int authorized = MG_FALSE;
 
   // If dav_auth_file is not set, allow non-authorized PROPFIND
   if (method != NULL && !strcmp(method, "PROPFIND") && auth_file == NULL) {
     authorized = MG_TRUE;
-  } else if (auth_file != NULL && (fp = fopen(auth_file, "r")) != NULL) {
-    authorized = ht_authorize_digest(&conn->ht_conn, fp);
-    fclose(fp);
+  } else if (auth_file != NULL &&
+             (af = get_auth_file(conn->server, auth_file)) != NULL &&
+             af->exists) {
+    authorized = authorize_digest(conn, af);
   }
 
   return authorized;
@@ -3802,69 +5491,284 @@ int ht_parse_header(const char *s, const char *var_name, char *buf,
 }
 
 #ifndef UMSERVER_NO_SSI
-static void send_ssi_file(struct ht_connection *, const char *, FILE *, int);
+// Compiled SSI files are cached by path, and revalidated by mtime and size
+// on every use. Included files are cached the same way, so rendering a page
+// only takes a stat() per file and copying of ready segments.
+#ifndef UMSERVER_SSI_CACHE_SIZE
+#define UMSERVER_SSI_CACHE_SIZE (8 * 1024 * 1024)
+#endif
+#ifndef UMSERVER_SSI_MAX_FILE_SIZE
+#define UMSERVER_SSI_MAX_FILE_SIZE (1024 * 1024)
+#endif
 
-static void send_file_data(struct ht_connection *conn, FILE *fp) {
-  char buf[IOBUF_SIZE];
-  int n;
-  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-    ht_write(conn, buf, n);
+enum { SSI_TEXT, SSI_MESSAGE, SSI_INCLUDE, SSI_EXEC };
+
+struct ssi_node {
+  int type;                   // SSI_* node type
+  const char *ptr;            // Text, message, include path or command
+  size_t len;
+};
+
+struct ssi_file {
+  struct ssi_file *next;      // Hash bucket chain
+  char *path;
+  time_t mtime;
+  int64_t size;
+  char *text;                 // File contents, SSI_TEXT nodes point here
+  struct ssi_node *nodes;     // NULL until compiled as SSI
+  int num_nodes;
+  size_t text_len;            // Sum of SSI_TEXT node lengths
+  int is_cached;              // Owned by ht_server::ssi_cache
+  int refs;                   // Renders in progress, see put_ssi_file()
+};
+
+static void free_ssi_file(struct ssi_file *f) {
+  int i;
+
+  for (i = 0; i < f->num_nodes; i++) {
+    if (f->nodes[i].type != SSI_TEXT) free((void *) f->nodes[i].ptr);
   }
+  free(f->nodes);
+  free(f->text);
+  free(f->path);
+  free(f);
 }
 
-static void do_ssi_include(struct ht_connection *conn, const char *ssi,
-                           char *tag, int include_level) {
-  char file_name[IOBUF_SIZE], path[MAX_PATH_SIZE], *p;
-  char **opts = (MG_CONN_2_CONN(conn))->server->config_options;
-  FILE *fp;
+// Drop file from the cache. A file that is being rendered, e.g. the parent
+// of an include that evicts it, is freed by the last put_ssi_file() instead.
+static void uncache_ssi_file(struct ht_server *server, struct ssi_file *f) {
+  server->ssi_cache_size -= f->size;
+  f->is_cached = 0;
+  if (f->refs == 0) free_ssi_file(f);
+}
+
+static void put_ssi_file(struct ssi_file *f) {
+  if (--f->refs == 0 && !f->is_cached) free_ssi_file(f);
+}
+
+static void clear_ssi_cache(struct ht_server *server) {
+  struct ssi_file *f, *next;
+  int i;
+
+  for (i = 0; i < (int) ARRAY_SIZE(server->ssi_cache); i++) {
+    for (f = server->ssi_cache[i]; f != NULL; f = next) {
+      next = f->next;
+      uncache_ssi_file(server, f);
+    }
+    server->ssi_cache[i] = NULL;
+  }
+  server->ssi_cache_size = 0;
+}
+
+static void add_ssi_node(struct ssi_file *f, int type, const char *ptr,
+                         size_t len) {
+  struct ssi_node *nodes;
+
+  if (ptr == NULL || (type == SSI_TEXT && len == 0)) return;
+  // Grow the array at powers of two
+  if ((f->num_nodes & (f->num_nodes - 1)) == 0) {
+    nodes = (struct ssi_node *) realloc(f->nodes, (f->num_nodes == 0 ? 8 :
+                                        f->num_nodes * 2) * sizeof(*nodes));
+    if (nodes == NULL) return;
+    f->nodes = nodes;
+  }
+  f->nodes[f->num_nodes].type = type;
+  f->nodes[f->num_nodes].ptr = ptr;
+  f->nodes[f->num_nodes].len = len;
+  f->num_nodes++;
+  if (type == SSI_TEXT) f->text_len += len;
+}
+
+static void add_ssi_message(struct ssi_file *f, const char *fmt, ...) {
+  char buf[IOBUF_SIZE + MAX_PATH_SIZE];
+  va_list ap;
+  int len;
 
-  // sscanf() is safe here, since send_ssi_file() also uses buffer
-  // of size MG_BUF_LEN to get the tag. So strlen(tag) is always < MG_BUF_LEN.
+  va_start(ap, fmt);
+  len = ht_vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  add_ssi_node(f, SSI_MESSAGE, ht_strdup(buf), len);
+}
+
+// Resolve #include tag arguments to a file path
+static int get_ssi_include_path(struct ht_server *server, const char *ssi,
+                                const char *tag, char *path, size_t size) {
+  char file_name[IOBUF_SIZE], *p;
+
+  // sscanf() is safe here, since compile_ssi_file() limits the tag
+  // to IOBUF_SIZE bytes.
   if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
     // File name is relative to the webserver root
-    ht_snprintf(path, sizeof(path), "%s%c%s",
-                opts[DOCUMENT_ROOT], '/', file_name);
+    ht_snprintf(path, size, "%s%c%s",
+                server->config_options[DOCUMENT_ROOT], '/', file_name);
   } else if (sscanf(tag, " abspath=\"%[^\"]\"", file_name) == 1) {
     // File name is relative to the webserver working directory
     // or it is absolute system path
-    ht_snprintf(path, sizeof(path), "%s", file_name);
+    ht_snprintf(path, size, "%s", file_name);
   } else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1 ||
              sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
     // File name is relative to the currect document
-    ht_snprintf(path, sizeof(path), "%s", ssi);
+    ht_snprintf(path, size, "%s", ssi);
     if ((p = strrchr(path, '/')) != NULL) {
       p[1] = '\0';
     }
-    ht_snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s",
-                file_name);
+    ht_snprintf(path + strlen(path), size - strlen(path), "%s", file_name);
   } else {
-    ht_printf(conn, "Bad SSI #include: [%s]", tag);
-    return;
+    return 0;
   }
 
-  if ((fp = fopen(path, "rb")) == NULL) {
-    ht_printf(conn, "Cannot open SSI #include: [%s]: fopen(%s): %s",
-              tag, path, strerror(errno));
-  } else {
-    ns_set_close_on_exec(fileno(fp));
-    if (ht_match_prefix(opts[SSI_PATTERN], strlen(opts[SSI_PATTERN]),
-        path) > 0) {
-      send_ssi_file(conn, path, fp, include_level + 1);
-    } else {
-      send_file_data(conn, fp);
-    }
-    fclose(fp);
-  }
+  return 1;
 }
 
-#ifndef UMSERVER_NO_POPEN
-static void do_ssi_exec(struct ht_connection *conn, char *tag) {
-  char cmd[IOBUF_SIZE];
-  FILE *fp;
+// Split file text into static segments and #include / #exec directives
+static void compile_ssi_file(struct ht_server *server, struct ssi_file *f) {
+  const char *p = f->text, *end = f->text + f->size, *seg = p, *lt, *gt;
+  char tag[IOBUF_SIZE], path[MAX_PATH_SIZE], cmd[IOBUF_SIZE];
+  size_t len;
+
+  while ((lt = (const char *) memchr(p, '<', end - p)) != NULL) {
+    p = lt + 1;
+    if (end - lt < 5 || memcmp(lt, "<!--#", 5) != 0 ||
+        (gt = (const char *) memchr(lt, '>', end - lt)) == NULL) {
+      continue;
+    }
+
+    add_ssi_node(f, SSI_TEXT, seg, lt - seg);
+    p = seg = gt + 1;
+    if ((len = gt - lt + 1) > sizeof(tag) - 2) {
+      add_ssi_message(f, "%s: SSI tag is too large", f->path);
+      continue;
+    }
+    memcpy(tag, lt, len);
+    tag[len] = '\0';
+
+    if (!memcmp(tag + 5, "include", 7)) {
+      if (get_ssi_include_path(server, f->path, tag + 12, path,
+                               sizeof(path))) {
+        add_ssi_node(f, SSI_INCLUDE, ht_strdup(path), strlen(path));
+      } else {
+        add_ssi_message(f, "Bad SSI #include: [%s]", tag + 12);
+      }
+#if !defined(UMSERVER_NO_POPEN)
+    } else if (!memcmp(tag + 5, "exec", 4)) {
+      if (sscanf(tag + 9, " \"%[^\"]\"", cmd) == 1) {
+        add_ssi_node(f, SSI_EXEC, ht_strdup(cmd), strlen(cmd));
+      } else {
+        add_ssi_message(f, "Bad SSI #exec: [%s]", tag + 9);
+      }
+#endif // !NO_POPEN
+    } else {
+      add_ssi_message(f, "%s: unknown SSI " "command: \"%s\"", f->path, tag);
+    }
+  }
+  add_ssi_node(f, SSI_TEXT, seg, end - seg);
+  (void) cmd;
+}
+
+// Return up-to-date file contents, compiled if is_ssi is set, and held until
+// put_ssi_file(). Files that are too large for the cache are read for one
+// use. Return NULL if file cannot be read.
+static struct ssi_file *get_ssi_file(struct ht_server *server,
+                                     const char *path, int is_ssi) {
+  struct ssi_file **bucket, **pf, *f;
+  unsigned int hash = 0;
+  const char *s;
+  file_stat_t st;
+  FILE *fp;
 
-  if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
-    ht_printf(conn, "Bad SSI #exec: [%s]", tag);
-  } else if ((fp = popen(cmd, "r")) == NULL) {
+  if (stat(path, &st) != 0) return NULL;
+
+  for (s = path; *s != '\0'; s++) hash = hash * 31 + (unsigned char) *s;
+  bucket = &server->ssi_cache[hash % ARRAY_SIZE(server->ssi_cache)];
+  for (pf = bucket; (f = *pf) != NULL; pf = &f->next) {
+    if (strcmp(f->path, path) == 0) break;
+  }
+
+  if (f != NULL && (f->mtime != st.st_mtime || f->size != st.st_size)) {
+    // Stale entry
+    *pf = f->next;
+    uncache_ssi_file(server, f);
+    f = NULL;
+  }
+
+  if (f == NULL) {
+    if ((is_ssi == 0 && st.st_size > UMSERVER_SSI_MAX_FILE_SIZE) ||
+        (f = (struct ssi_file *) calloc(1, sizeof(*f))) == NULL) {
+      return NULL;
+    }
+    f->path = ht_strdup(path);
+    f->mtime = st.st_mtime;
+    f->size = st.st_size;
+    if ((fp = fopen(path, "rb")) == NULL ||
+        (f->text = (char *) malloc((size_t) f->size + 1)) == NULL ||
+        fread(f->text, 1, (size_t) f->size, fp) != (size_t) f->size) {
+      if (fp != NULL) fclose(fp);
+      free_ssi_file(f);
+      return NULL;
+    }
+    fclose(fp);
+
+    if (f->size <= UMSERVER_SSI_MAX_FILE_SIZE) {
+      if (server->ssi_cache_size + f->size > UMSERVER_SSI_CACHE_SIZE) {
+        clear_ssi_cache(server);
+        bucket = &server->ssi_cache[hash % ARRAY_SIZE(server->ssi_cache)];
+      }
+      f->next = *bucket;
+      *bucket = f;
+      f->is_cached = 1;
+      server->ssi_cache_size += f->size;
+    }
+  }
+
+  if (is_ssi && f->nodes == NULL) {
+    compile_ssi_file(server, f);
+  }
+  f->refs++;
+
+  return f;
+}
+
+static void send_file_data(struct ht_connection *conn, FILE *fp) {
+  char buf[IOBUF_SIZE];
+  int n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    ht_write(conn, buf, n);
+  }
+}
+
+static void send_ssi_file(struct ht_connection *, struct ssi_file *, int);
+
+static void do_ssi_include(struct ht_connection *conn, const char *path,
+                           int include_level) {
+  struct ht_server *server = MG_CONN_2_CONN(conn)->server;
+  const char *pattern = server->config_options[SSI_PATTERN];
+  int is_ssi = ht_match_prefix(pattern, strlen(pattern), path) > 0;
+  struct ssi_file *f = get_ssi_file(server, path, is_ssi);
+  FILE *fp;
+
+  if (f == NULL && !is_ssi && (fp = fopen(path, "rb")) != NULL) {
+    // Too large to cache
+    ns_set_close_on_exec(fileno(fp));
+    send_file_data(conn, fp);
+    fclose(fp);
+  } else if (f == NULL) {
+    ht_printf(conn, "Cannot open SSI #include: [%s]: %s",
+              path, strerror(errno));
+  } else {
+    if (is_ssi) {
+      send_ssi_file(conn, f, include_level + 1);
+    } else {
+      ht_write(conn, f->text, (int) f->size);
+    }
+    put_ssi_file(f);
+  }
+}
+
+#ifndef UMSERVER_NO_POPEN
+static void do_ssi_exec(struct ht_connection *conn, const char *cmd) {
+  FILE *fp;
+
+  if ((fp = popen(cmd, "r")) == NULL) {
     ht_printf(conn, "Cannot SSI #exec: [%s]: %s", cmd, strerror(errno));
   } else {
     send_file_data(conn, fp);
@@ -3873,77 +5777,43 @@ static void do_ssi_exec(struct ht_connection *conn, char *tag) {
 }
 #endif // !UMSERVER_NO_POPEN
 
-static void send_ssi_file(struct ht_connection *conn, const char *path,
-                          FILE *fp, int include_level) {
-  char buf[IOBUF_SIZE];
-  int ch, offset, len, in_ssi_tag;
+static void send_ssi_file(struct ht_connection *conn, struct ssi_file *f,
+                          int include_level) {
+  const struct ssi_node *node;
+  int i;
 
   if (include_level > 10) {
-    ht_printf(conn, "SSI #include level is too deep (%s)", path);
+    ht_printf(conn, "SSI #include level is too deep (%s)", f->path);
     return;
   }
 
-  in_ssi_tag = len = offset = 0;
-  while ((ch = fgetc(fp)) != EOF) {
-    if (in_ssi_tag && ch == '>') {
-      in_ssi_tag = 0;
-      buf[len++] = (char) ch;
-      buf[len] = '\0';
-      assert(len <= (int) sizeof(buf));
-      if (len < 6 || memcmp(buf, "<!--#", 5) != 0) {
-        // Not an SSI tag, pass it
-        (void) ht_write(conn, buf, (size_t) len);
-      } else {
-        if (!memcmp(buf + 5, "include", 7)) {
-          do_ssi_include(conn, path, buf + 12, include_level);
-#if !defined(UMSERVER_NO_POPEN)
-        } else if (!memcmp(buf + 5, "exec", 4)) {
-          do_ssi_exec(conn, buf + 9);
-#endif // !NO_POPEN
-        } else {
-          ht_printf(conn, "%s: unknown SSI " "command: \"%s\"", path, buf);
-        }
-      }
-      len = 0;
-    } else if (in_ssi_tag) {
-      if (len == 5 && memcmp(buf, "<!--#", 5) != 0) {
-        // Not an SSI tag
-        in_ssi_tag = 0;
-      } else if (len == (int) sizeof(buf) - 2) {
-        ht_printf(conn, "%s: SSI tag is too large", path);
-        len = 0;
-      }
-      buf[len++] = ch & 0xff;
-    } else if (ch == '<') {
-      in_ssi_tag = 1;
-      if (len > 0) {
-        ht_write(conn, buf, (size_t) len);
-      }
-      len = 0;
-      buf[len++] = ch & 0xff;
-    } else {
-      buf[len++] = ch & 0xff;
-      if (len == (int) sizeof(buf)) {
-        ht_write(conn, buf, (size_t) len);
-        len = 0;
-      }
+  reserve_send_buffer(MG_CONN_2_CONN(conn)->ns_conn, f->text_len);
+  for (i = 0; i < f->num_nodes; i++) {
+    node = &f->nodes[i];
+    switch (node->type) {
+      case SSI_TEXT:
+      case SSI_MESSAGE:
+        ht_write(conn, node->ptr, (int) node->len);
+        break;
+      case SSI_INCLUDE:
+        do_ssi_include(conn, node->ptr, include_level);
+        break;
+#ifndef UMSERVER_NO_POPEN
+      case SSI_EXEC:
+        do_ssi_exec(conn, node->ptr);
+        break;
+#endif
     }
   }
-
-  // Send the rest of buffered data
-  if (len > 0) {
-    ht_write(conn, buf, (size_t) len);
-  }
 }
 
 static void handle_ssi_request(struct connection *conn, const char *path) {
-  FILE *fp;
+  struct ssi_file *f;
   struct vec mime_vec;
 
-  if ((fp = fopen(path, "rb")) == NULL) {
+  if ((f = get_ssi_file(conn->server, path, 1)) == NULL) {
     send_http_error(conn, 500, "fopen(%s): %s", path, strerror(errno));
   } else {
-    ns_set_close_on_exec(fileno(fp));
     get_mime_type(conn->server, path, &mime_vec);
     conn->ht_conn.status_code = 200;
     ht_printf(&conn->ht_conn,
@@ -3951,13 +5821,190 @@ static void handle_ssi_request(struct connection *conn, const char *path) {
               "Content-Type: %.*s\r\n"
               "Connection: close\r\n\r\n",
               conn->ht_conn.status_code, (int) mime_vec.len, mime_vec.ptr);
-    send_ssi_file(&conn->ht_conn, path, fp, 0);
-    fclose(fp);
+    send_ssi_file(&conn->ht_conn, f, 0);
+    put_ssi_file(f);
     close_local_endpoint(conn);
   }
 }
 #endif
 
+// Compiled template is a list of parts: literal text, an expansion index
+// or a file to embed
+enum { TPL_LITERAL = -1, TPL_FILE = -2 };
+
+struct template_part {
+  int slot;                   // Index into expansions, or TPL_* part type
+  const char *ptr;            // Literal text or file name, points to text
+  int len;
+};
+
+struct ht_template {
+  char *text;                 // Copy of template text
+  struct ht_expansion *expansions;
+  struct template_part *parts;
+  int num_parts;
+  size_t literal_len;         // Sum of literal lengths
+};
+
+static void add_template_part(struct ht_template *tpl, int slot,
+                              const char *ptr, int len) {
+  struct template_part *last = tpl->num_parts == 0 ? NULL :
+    &tpl->parts[tpl->num_parts - 1];
+
+  if (slot == TPL_LITERAL) {
+    if (len == 0) return;
+    tpl->literal_len += len;
+    if (last != NULL && last->slot == TPL_LITERAL &&
+        last->ptr + last->len == ptr) {
+      // Unknown markers stay in the output, glue them to their neighbours
+      last->len += len;
+      return;
+    }
+  }
+  tpl->parts[tpl->num_parts].slot = slot;
+  tpl->parts[tpl->num_parts].ptr = ptr;
+  tpl->parts[tpl->num_parts].len = len;
+  tpl->num_parts++;
+}
+
+struct ht_template *ht_template_compile(const char *text,
+                                        struct ht_expansion *expansions) {
+  struct ht_template *tpl;
+  const char *p, *end, *seg, *lt, *gt, *kw;
+  int i, n, max_parts, num_kw, table_size, *table = NULL, len;
+  unsigned int h;
+
+  if ((tpl = (struct ht_template *) calloc(1, sizeof(*tpl))) == NULL ||
+      (tpl->text = ht_strdup(text)) == NULL) {
+    ht_template_free(tpl);
+    return NULL;
+  }
+  tpl->expansions = expansions;
+
+  // Every marker splits a literal, which bounds the number of parts
+  for (max_parts = 1, p = tpl->text; (p = strstr(p, "{{")) != NULL; p += 2) {
+    max_parts += 2;
+  }
+
+  // Map keywords to their indices, open addressing with linear probing
+  for (num_kw = 0; expansions[num_kw].keyword != NULL; num_kw++);
+  for (table_size = 16; table_size < num_kw * 2; table_size *= 2);
+  if ((tpl->parts = (struct template_part *)
+       malloc(max_parts * sizeof(tpl->parts[0]))) == NULL ||
+      (table = (int *) malloc(table_size * sizeof(table[0]))) == NULL) {
+    free(table);
+    ht_template_free(tpl);
+    return NULL;
+  }
+  memset(table, 0xff, table_size * sizeof(table[0]));
+  for (i = num_kw - 1; i >= 0; i--) {
+    kw = expansions[i].keyword;
+    h = hash_string(kw, strlen(kw)) & (table_size - 1);
+    // On duplicates the first entry wins, as it did with a linear search
+    while (table[h] >= 0 && strcmp(expansions[table[h]].keyword, kw) != 0) {
+      h = (h + 1) & (table_size - 1);
+    }
+    table[h] = i;
+  }
+
+  seg = p = tpl->text;
+  end = p + strlen(p);
+  while ((lt = strstr(p, "{{")) != NULL &&
+         (gt = strstr(lt + 2, "}}")) != NULL) {
+    kw = lt + 2;
+    len = gt - kw;
+    h = hash_string(kw, len) & (table_size - 1);
+    for (n = table[h]; n >= 0; n = table[h = (h + 1) & (table_size - 1)]) {
+      if ((int) strlen(expansions[n].keyword) == len &&
+          memcmp(expansions[n].keyword, kw, len) == 0) break;
+    }
+    if (n < 0 && len > 1 && kw[0] == '@') {
+      n = TPL_FILE;
+    }
+    if (n == TPL_LITERAL) {
+      p = gt;
+    } else {
+      add_template_part(tpl, TPL_LITERAL, seg, lt - seg);
+      add_template_part(tpl, n, n == TPL_FILE ? kw + 1 : kw,
+                        n == TPL_FILE ? len - 1 : len);
+      p = seg = gt + 2;
+    }
+  }
+  add_template_part(tpl, TPL_LITERAL, seg, end - seg);
+  free(table);
+
+  return tpl;
+}
+
+void ht_template_free(struct ht_template *tpl) {
+  if (tpl != NULL) {
+    free(tpl->parts);
+    free(tpl->text);
+    free(tpl);
+  }
+}
+
+// Send file embedded with {{@path}}, path is relative to document_root
+static void send_template_file(struct ht_connection *conn, const char *name,
+                               int len) {
+#ifndef UMSERVER_NO_SSI
+  struct ht_server *server = MG_CONN_2_CONN(conn)->server;
+  char path[MAX_PATH_SIZE];
+  struct ssi_file *f;
+  FILE *fp;
+
+  ht_snprintf(path, sizeof(path), "%s%c%.*s",
+              server->config_options[DOCUMENT_ROOT], '/', len, name);
+  if ((f = get_ssi_file(server, path, 0)) != NULL) {
+    ht_send_data(conn, f->text, (int) f->size);
+    put_ssi_file(f);
+  } else if ((fp = fopen(path, "rb")) != NULL) {
+    // Too large to cache
+    ns_set_close_on_exec(fileno(fp));
+    send_file_data(conn, fp);
+    fclose(fp);
+  }
+#else
+  (void) conn;
+  (void) name;
+  (void) len;
+#endif
+}
+
+void ht_template_render(struct ht_connection *conn,
+                        const struct ht_template *tpl) {
+  const struct template_part *part;
+  int i;
+
+  // Chunk headers take up to 12 bytes
+  reserve_send_buffer(MG_CONN_2_CONN(conn)->ns_conn,
+                      tpl->literal_len + tpl->num_parts * 12);
+  for (i = 0; i < tpl->num_parts; i++) {
+    part = &tpl->parts[i];
+    if (part->slot == TPL_LITERAL) {
+      ht_send_data(conn, part->ptr, part->len);
+    } else if (part->slot == TPL_FILE) {
+      send_template_file(conn, part->ptr, part->len);
+    } else {
+      tpl->expansions[part->slot].handler(conn);
+    }
+  }
+}
+
+// This function prints HTML pages, and expands "{{something}}" blocks
+// inside HTML by calling appropriate callback functions.
+// Note that {{@path/to/file}} construct outputs embedded file's contents,
+// which provides SSI-like functionality.
+void ht_template(struct ht_connection *conn, const char *s,
+                 struct ht_expansion *expansions) {
+  struct ht_template *tpl = ht_template_compile(s, expansions);
+
+  if (tpl != NULL) {
+    ht_template_render(conn, tpl);
+    ht_template_free(tpl);
+  }
+}
+
 static int parse_url(const char *url, char *proto, size_t plen,
                      char *host, size_t hlen, unsigned short *port) {
   int n;
@@ -3966,9 +6013,12 @@ static int parse_url(const char *url, char *proto, size_t plen,
   *port = 80;
   proto[0] = host[0] = '\0';
 
-  snprintf(fmt1, sizeof(fmt1), "%%%zu[a-z]://%%%zu[^: ]:%%hu%%n", plen, hlen);
-  snprintf(fmt2, sizeof(fmt2), "%%%zu[a-z]://%%%zu[^/ ]%%n", plen, hlen);
-  snprintf(fmt3, sizeof(fmt3), "%%%zu[^: ]:%%hu%%n", hlen);
+  // Widths leave room for the terminating NUL
+  snprintf(fmt1, sizeof(fmt1), "%%%zu[a-z]://%%%zu[^: ]:%%hu%%n",
+           plen - 1, hlen - 1);
+  snprintf(fmt2, sizeof(fmt2), "%%%zu[a-z]://%%%zu[^/ ]%%n",
+           plen - 1, hlen - 1);
+  snprintf(fmt3, sizeof(fmt3), "%%%zu[^: ]:%%hu%%n", hlen - 1);
 
   if (sscanf(url, fmt1, proto, host, port, &n) == 3 ||
       sscanf(url, fmt2, proto, host, &n) == 2) {
@@ -4075,14 +6125,621 @@ static void proxify_connection(struct connection *conn) {
           SSL_CTX_free(ctx);
         }
       }
-#endif
-    } else {
-      // For other methods, forward the request to the target host.
-      c->uri += n;
-      proxy_request(pc, c);
+#endif
+    } else {
+      // For other methods, forward the request to the target host.
+      c->uri += n;
+      proxy_request(pc, c);
+    }
+    ns_link(pc, conn->ns_conn);
+  } else {
+    conn->ns_conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+// Reverse proxy. The reverse_proxy option maps URI prefixes to one or more
+// backends, e.g. "/api=http://127.0.0.1:9000|http://127.0.0.1:9001".
+// Upstream replies are parsed so that message boundaries are known, which
+// lets idle upstream connections be pooled and reused across requests.
+// Upgrade requests, e.g. websockets, are passed on, and once the backend
+// replies 101 both connections are linked into a tunnel until one closes.
+#ifndef UMSERVER_PROXY_MAX_IDLE
+#define UMSERVER_PROXY_MAX_IDLE 16
+#endif
+
+struct backend {
+  char host[100];
+  unsigned short port;
+  int num_active;             // Upstream connections serving a request
+  int num_idle;               // Length of the idle list
+  struct upstream *idle;      // Pooled keep-alive connections
+};
+
+struct proxy_route {
+  struct proxy_route *next;
+  char *prefix;               // Pattern, matched like url_rewrites
+  struct backend *backends;
+  int num_backends;
+  unsigned int next_backend;  // Round-robin cursor
+};
+
+enum { UP_HEAD, UP_BODY, UP_CHUNKED, UP_TUNNEL };
+
+// State of one upstream connection, stored in its connection_data
+struct upstream {
+  struct ns_connection *nc;
+  struct backend *backend;    // NULL if routes were reconfigured
+  struct connection *conn;    // Client being served, NULL if idle
+  struct upstream *next_idle;
+  int64_t body_left;          // Reply body bytes to forward, -1 until close
+  int64_t chunk_left;         // Bytes left in the current chunk
+  int state;                  // UP_* reply parsing state
+  int chunk_state;            // CS_* state for chunked replies
+  int64_t req_chunk_left;     // Same for the request body, which is
+  int req_chunk_state;        // CS_DONE unless chunked
+  int is_idle;                // Sitting in the backend's idle list
+  int is_reused;              // Served a request before this one
+  int got_reply;              // Received some bytes of the current reply
+  int keep_alive;             // Upstream may be reused after this reply
+};
+
+static void free_proxy_routes(struct proxy_route *route) {
+  struct proxy_route *next;
+
+  for (; route != NULL; route = next) {
+    next = route->next;
+    free(route->prefix);
+    free(route->backends);
+    free(route);
+  }
+}
+
+// Parse "prefix=url|url,prefix=url" spec. Return NULL on error.
+static struct proxy_route *parse_proxy_routes(const char *spec, int *ok) {
+  struct proxy_route *head = NULL, **tail = &head, *route;
+  char proto[10], url[500];
+  const char *p, *end;
+  struct vec a, b;
+  int i;
+
+  *ok = 1;
+  while ((spec = next_option(spec, &a, &b)) != NULL) {
+    if (a.len == 0 || b.len == 0 ||
+        (route = (struct proxy_route *) calloc(1, sizeof(*route))) == NULL) {
+      *ok = 0;
+      break;
+    }
+    *tail = route;
+    tail = &route->next;
+
+    for (route->num_backends = 1, p = b.ptr; p < b.ptr + b.len; p++) {
+      if (*p == '|') route->num_backends++;
+    }
+    route->prefix = (char *) malloc(a.len + 1);
+    route->backends = (struct backend *)
+      calloc(route->num_backends, sizeof(route->backends[0]));
+    if (route->prefix == NULL || route->backends == NULL) {
+      *ok = 0;
+      break;
+    }
+    ht_snprintf(route->prefix, a.len + 1, "%.*s", a.len, a.ptr);
+
+    for (i = 0, p = b.ptr; i < route->num_backends; i++, p = end + 1) {
+      struct backend *be = &route->backends[i];
+      if ((end = (const char *) memchr(p, '|', b.ptr + b.len - p)) == NULL) {
+        end = b.ptr + b.len;
+      }
+      ht_snprintf(url, sizeof(url), "%.*s", (int) (end - p), p);
+      if (parse_url(url, proto, sizeof(proto), be->host, sizeof(be->host),
+                    &be->port) <= 0 || strcmp(proto, "http") != 0) {
+        *ok = 0;
+        break;
+      }
+    }
+    if (!*ok) break;
+  }
+
+  if (!*ok) {
+    free_proxy_routes(head);
+    head = NULL;
+  }
+
+  return head;
+}
+
+static struct backend *choose_backend(struct ht_server *server,
+                                      struct proxy_route *route) {
+  const char *balance = server->config_options[REVERSE_PROXY_BALANCE];
+  struct backend *be = &route->backends[route->next_backend++ %
+                                        route->num_backends];
+  int i;
+
+  if (balance != NULL && !ht_strcasecmp(balance, "least_conn")) {
+    // Start from the round-robin pick, so that ties are spread out
+    for (i = 0; i < route->num_backends; i++) {
+      if (route->backends[i].num_active < be->num_active) {
+        be = &route->backends[i];
+      }
+    }
+  }
+
+  return be;
+}
+
+// Detach upstream from its client. If it can be reused, park it in the
+// backend's idle list, otherwise close it.
+static void release_upstream(struct upstream *u, int reusable) {
+  struct backend *be = u->backend;
+
+  if (u->conn != NULL) {
+    u->conn->endpoint.nc = NULL;
+    u->conn = NULL;
+    if (be != NULL) be->num_active--;
+  }
+
+  if (reusable && be != NULL && u->nc->recv_iobuf.len == 0 &&
+      !(u->nc->flags & NSF_CLOSE_IMMEDIATELY) &&
+      be->num_idle < UMSERVER_PROXY_MAX_IDLE) {
+    u->is_idle = 1;
+    u->next_idle = be->idle;
+    be->idle = u;
+    be->num_idle++;
+  } else {
+    u->nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+static void unlink_idle_upstream(struct upstream *u) {
+  struct upstream **p;
+
+  if (u->is_idle && u->backend != NULL) {
+    for (p = &u->backend->idle; *p != NULL; p = &(*p)->next_idle) {
+      if (*p == u) {
+        *p = u->next_idle;
+        u->backend->num_idle--;
+        break;
+      }
+    }
+  }
+  u->is_idle = 0;
+}
+
+static int is_hop_by_hop_header(const char *name, int len) {
+  return (len == 10 && !ht_strncasecmp(name, "Connection", 10)) ||
+    (len == 10 && !ht_strncasecmp(name, "Keep-Alive", 10)) ||
+    (len == 16 && !ht_strncasecmp(name, "Proxy-Connection", 16)) ||
+    (len == 2 && !ht_strncasecmp(name, "TE", 2)) ||
+    (len == 7 && !ht_strncasecmp(name, "Upgrade", 7));
+}
+
+// Return the protocol asked for, if the request is an upgrade one: it has
+// an Upgrade header, and "upgrade" among the Connection options
+static const char *get_upgrade(const struct connection *conn) {
+  const char *up = ht_get_header(&conn->ht_conn, "Upgrade"),
+        *list = ht_get_header(&conn->ht_conn, "Connection");
+  struct vec opt;
+
+  while (up != NULL && list != NULL &&
+         (list = next_option(list, &opt, NULL)) != NULL) {
+    while (opt.len > 0 && isspace(* (unsigned char *) opt.ptr)) {
+      opt.ptr++;
+      opt.len--;
+    }
+    while (opt.len > 0 && isspace(((unsigned char *) opt.ptr)[opt.len - 1])) {
+      opt.len--;
+    }
+    if (opt.len == 7 && !ht_strncasecmp(opt.ptr, "upgrade", 7)) return up;
+  }
+
+  return NULL;
+}
+
+static int is_chunked_request(const struct connection *conn) {
+  const char *te = ht_get_header(&conn->ht_conn, "Transfer-Encoding");
+  return te != NULL && ht_strcasecmp(te, "identity") != 0;
+}
+
+// Scan chunked body, of a request or a reply, return number of bytes that
+// belong to it
+static int scan_chunked(int *state, int64_t *left, const char *buf, int len) {
+  int i, n;
+
+  for (i = 0; i < len && *state != CS_DONE; i++) {
+    unsigned char ch = (unsigned char) buf[i];
+    switch (*state) {
+      case CS_SIZE:
+        if (isxdigit(ch)) {
+          *left = *left * 16 +
+            (isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10);
+          break;
+        } else if (ch != '\n') {
+          *state = CS_EXT;
+          break;
+        }
+        // Fall through
+      case CS_EXT:
+        if (ch == '\n') {
+          *state = *left == 0 ? CS_TRAILER : CS_DATA;
+        }
+        break;
+      case CS_DATA:
+        n = (int64_t) (len - i) < *left ? len - i : (int) *left;
+        *left -= n;
+        i += n - 1;
+        if (*left == 0) *state = CS_DATA_END;
+        break;
+      case CS_DATA_END:
+        if (ch == '\n') *state = CS_SIZE;
+        break;
+      case CS_TRAILER:
+        if (ch == '\n') {
+          *state = CS_DONE;
+        } else if (ch != '\r') {
+          *state = CS_TRAILER_LINE;
+        }
+        break;
+      case CS_TRAILER_LINE:
+        if (ch == '\n') *state = CS_TRAILER;
+        break;
+    }
+  }
+
+  return i;
+}
+
+
+static void send_upstream_request(struct ns_connection *nc,
+                                  struct connection *conn) {
+  struct ht_connection *c = &conn->ht_conn;
+  const char *upgrade = get_upgrade(conn);
+  int i;
+
+  // Speak HTTP/1.1 to the upstream regardless of the client version, so
+  // that the upstream connection stays persistent.
+  if (conn->raw_uri != NULL) {
+    ns_printf(nc, "%s %s HTTP/1.1\r\n", c->request_method, conn->raw_uri);
+  } else {
+    ns_printf(nc, "%s %s%s%s HTTP/1.1\r\n", c->request_method, c->uri,
+              c->query_string == NULL ? "" : "?",
+              c->query_string == NULL ? "" : c->query_string);
+  }
+  for (i = 0; i < c->num_headers; i++) {
+    const char *name = c->http_headers[i].name;
+    if (!is_hop_by_hop_header(name, strlen(name))) {
+      ns_printf(nc, "%s: %s\r\n", name, c->http_headers[i].value);
+    }
+  }
+  if (upgrade != NULL) {
+    ns_printf(nc, "Connection: Upgrade\r\nUpgrade: %s\r\n", upgrade);
+  }
+  ns_send(nc, "\r\n", 2);
+}
+
+// Forward request body bytes buffered on the client connection. A chunked
+// body is passed as it is, up to its last chunk, so that what follows is
+// parsed as the next request.
+static void forward_upstream_body(struct connection *conn) {
+  struct iobuf *io = &conn->ns_conn->recv_iobuf;
+  struct upstream *u;
+  size_t n;
+
+  if (conn->endpoint.nc == NULL) return;
+  u = (struct upstream *) conn->endpoint.nc->connection_data;
+  if (u->state == UP_TUNNEL) {
+    n = io->len;
+  } else if (u->req_chunk_state != CS_DONE) {
+    n = scan_chunked(&u->req_chunk_state, &u->req_chunk_left,
+                     io->buf, (int) io->len);
+  } else {
+    n = conn->cl < (int64_t) io->len ? (size_t) conn->cl : io->len;
+    conn->cl -= n;
+  }
+
+  if (n > 0) {
+    ns_send(conn->endpoint.nc, io->buf, n);
+    iobuf_remove(io, n);
+  }
+}
+
+static int connect_upstream(struct connection *conn, struct backend *be,
+                            int allow_reuse) {
+  struct ns_connection *nc;
+  struct upstream *u = NULL;
+
+  while (allow_reuse && (u = be->idle) != NULL) {
+    be->idle = u->next_idle;
+    be->num_idle--;
+    u->is_idle = 0;
+    if (!(u->nc->flags & NSF_CLOSE_IMMEDIATELY)) break;
+  }
+
+  if (u != NULL) {
+    u->is_reused = 1;
+  } else if ((u = (struct upstream *) calloc(1, sizeof(*u))) == NULL) {
+    return 0;
+  } else if ((nc = ns_connect(&conn->server->ns_server, be->host, be->port,
+                              0, u)) == NULL) {
+    free(u);
+    return 0;
+  } else {
+    u->nc = nc;
+    u->backend = be;
+    nc->flags |= MG_UPSTREAM_CONN;
+  }
+
+  u->conn = conn;
+  u->state = UP_HEAD;
+  u->got_reply = 0;
+  u->req_chunk_state = is_chunked_request(conn) ? CS_SIZE : CS_DONE;
+  u->req_chunk_left = 0;
+  be->num_active++;
+  conn->endpoint_type = EP_UPSTREAM;
+  conn->endpoint.nc = u->nc;
+  conn->close_after_reply = 0;
+
+  send_upstream_request(u->nc, conn);
+  forward_upstream_body(conn);
+
+  return 1;
+}
+
+static struct proxy_route *find_proxy_route(const struct connection *conn) {
+  struct proxy_route *route;
+  const char *uri = conn->ht_conn.uri;
+
+  for (route = conn->server->proxy_routes; route != NULL; route = route->next) {
+    if (ht_match_prefix(route->prefix, strlen(route->prefix), uri) > 0) {
+      return route;
+    }
+  }
+
+  return NULL;
+}
+
+// Return 1 if the request is routed to a reverse proxy backend
+static int open_upstream_endpoint(struct connection *conn) {
+  struct proxy_route *route = find_proxy_route(conn);
+
+  if (route == NULL) {
+    return 0;
+  } else if (is_chunked_request(conn) &&
+             ht_get_header(&conn->ht_conn, "Content-Length") != NULL) {
+    // Upstream could take the body length from either header
+    send_http_error(conn, 400, "Both Content-Length and chunked");
+  } else if (!connect_upstream(conn, choose_backend(conn->server, route), 1)) {
+    send_http_error(conn, 502, "Cannot connect to upstream");
+  }
+
+  return 1;
+}
+
+static void finish_upstream_reply(struct upstream *u) {
+  struct connection *conn = u->conn;
+  // Upstream that replied before getting the whole body is not reused
+  release_upstream(u, u->keep_alive && conn->cl == 0 &&
+                   u->req_chunk_state == CS_DONE);
+  close_local_endpoint(conn);
+}
+
+// Parse upstream reply headers and pass them to the client. Only the
+// hop-by-hop Connection headers are rewritten. Return 0 if more data needed.
+static int forward_upstream_head(struct upstream *u) {
+  struct connection *conn = u->conn;
+  struct iobuf *io = &u->nc->recv_iobuf;
+  struct ht_connection hc;
+  const char *te, *cl, *ch, *line, *next, *colon, *end;
+  int len = get_request_len(io->buf, io->len), status, client_keep_alive,
+      tunnel;
+  char *copy;
+
+  if (len == 0 && io->len <= MAX_REQUEST_SIZE) return 0;
+  if (len <= 0 || (copy = (char *) malloc(len)) == NULL) {
+    release_upstream(u, 0);
+    send_http_error(conn, 502, "Malformed upstream reply");
+    return 0;
+  }
+
+  memset(&hc, 0, sizeof(hc));
+  memcpy(copy, io->buf, len);
+  parse_http_message(copy, len, &hc);
+  status = atoi(hc.uri);
+  te = ht_get_header(&hc, "Transfer-Encoding");
+  cl = ht_get_header(&hc, "Content-Length");
+  ch = ht_get_header(&hc, "Connection");
+
+  u->keep_alive = strcmp(hc.request_method, "HTTP/1.1") == 0 ?
+    ch == NULL || ht_strcasecmp(ch, "close") != 0 :
+    ch != NULL && ht_strcasecmp(ch, "keep-alive") == 0;
+  if (status == 101) {
+    u->state = UP_TUNNEL;
+    u->body_left = -1;
+  } else if (status >= 100 && status < 200) {
+    u->state = UP_BODY;
+    u->body_left = 0;
+  } else if (!strcmp(conn->ht_conn.request_method, "HEAD") ||
+             status == 204 || status == 304) {
+    u->state = UP_BODY;
+    u->body_left = 0;
+  } else if (te != NULL && ht_strcasecmp(te, "identity") != 0) {
+    u->state = UP_CHUNKED;
+    u->chunk_state = CS_SIZE;
+    u->chunk_left = 0;
+  } else if (cl != NULL) {
+    u->state = UP_BODY;
+    u->body_left = to64(cl);
+  } else {
+    u->state = UP_BODY;
+    u->body_left = -1;
+  }
+  if (u->body_left < 0) u->keep_alive = 0;
+  free(copy);
+
+  // Switching protocols is only valid for what the client asked for
+  tunnel = u->state == UP_TUNNEL;
+  if (tunnel && get_upgrade(conn) == NULL) {
+    release_upstream(u, 0);
+    send_http_error(conn, 502, "Unexpected upstream upgrade");
+    return 0;
+  }
+
+  // Interim replies go to the client as-is, the final one follows
+  if (status >= 100 && status < 200 && status != 101) {
+    ns_send(conn->ns_conn, io->buf, len);
+    iobuf_remove(io, len);
+    u->state = UP_HEAD;
+    return 1;
+  }
+
+  client_keep_alive = u->body_left >= 0 && conn->cl == 0 &&
+    u->req_chunk_state == CS_DONE && should_keep_alive(&conn->ht_conn);
+  conn->close_after_reply = !client_keep_alive;
+  conn->ht_conn.status_code = status;
+
+  for (line = io->buf, end = io->buf + len; line < end; line = next) {
+    next = (const char *) memchr(line, '\n', end - line);
+    next = next == NULL ? end : next + 1;
+    colon = (const char *) memchr(line, ':', next - line);
+    if (line == io->buf ||
+        (colon != NULL && !is_hop_by_hop_header(line, colon - line)) ||
+        (colon != NULL && tunnel && colon - line == 7 &&
+         !ht_strncasecmp(line, "Upgrade", 7))) {
+      ns_send(conn->ns_conn, line, next - line);
+    } else if (colon == NULL) {
+      // Blank line terminating headers
+      ns_printf(conn->ns_conn, "Connection: %s\r\n%.*s",
+                tunnel ? "Upgrade" : client_keep_alive ? "keep-alive" : "close",
+                (int) (next - line), line);
+    }
+  }
+  iobuf_remove(io, len);
+
+  // From now on, whatever comes from either side goes to the other one
+  if (tunnel) {
+    ns_link(conn->ns_conn, u->nc);
+    ns_link(u->nc, conn->ns_conn);
+  }
+
+  if (u->state == UP_BODY && u->body_left == 0) {
+    finish_upstream_reply(u);
+  }
+
+  return 1;
+}
+
+static void on_upstream_data(struct upstream *u) {
+  struct iobuf *io = &u->nc->recv_iobuf;
+  int n;
+
+  if (u->conn == NULL) {
+    // Unsolicited data on an idle connection, it cannot be trusted
+    unlink_idle_upstream(u);
+    iobuf_remove(io, io->len);
+    u->nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return;
+  }
+  u->got_reply = 1;
+
+  while (io->len > 0 && u->conn != NULL) {
+    if (u->state == UP_HEAD) {
+      if (!forward_upstream_head(u)) break;
+    } else {
+      if (u->state == UP_CHUNKED) {
+        n = scan_chunked(&u->chunk_state, &u->chunk_left, io->buf, io->len);
+      } else {
+        n = u->body_left < 0 || u->body_left > (int64_t) io->len ?
+          (int) io->len : (int) u->body_left;
+        if (u->body_left > 0) u->body_left -= n;
+      }
+      ns_send(u->conn->ns_conn, io->buf, n);
+      iobuf_remove(io, n);
+      if ((u->state == UP_CHUNKED && u->chunk_state == CS_DONE) ||
+          (u->state == UP_BODY && u->body_left == 0)) {
+        finish_upstream_reply(u);
+      }
+    }
+  }
+}
+
+static void on_upstream_close(struct upstream *u) {
+  struct connection *conn = u->conn;
+  struct backend *be = u->backend;
+  int retry = !u->got_reply && u->is_reused && conn != NULL &&
+    conn->ht_conn.content_len == 0 && !is_chunked_request(conn) && be != NULL;
+
+  unlink_idle_upstream(u);
+  if (conn != NULL) {
+    u->keep_alive = 0;
+    u->nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    release_upstream(u, 0);
+    if (retry && connect_upstream(conn, be, 0)) {
+      // Pooled connection was closed by the backend, retried on a new one
+    } else if (!u->got_reply) {
+      send_http_error(conn, 502, "Upstream closed connection");
+    } else {
+      // Reply delimited by close, or truncated reply
+      conn->close_after_reply = 1;
+      close_local_endpoint(conn);
+    }
+  }
+  free(u);
+}
+
+static void upstream_ev_handler(struct ns_connection *nc, enum ns_event ev,
+                                void *p) {
+  struct upstream *u = (struct upstream *) nc->connection_data;
+  struct connection *conn;
+
+  if (u == NULL) return;
+  switch (ev) {
+    case NS_CONNECT:
+      if (* (int *) p != 0 && (conn = u->conn) != NULL) {
+        release_upstream(u, 0);
+        send_http_error(conn, 502, "Cannot connect to upstream");
+      }
+      break;
+    case NS_RECV:
+      on_upstream_data(u);
+      break;
+    case NS_POLL:
+      ns_throttle(nc, u->conn == NULL ? NULL : u->conn->ns_conn);
+      if (nc->last_io_time + UMSERVER_IDLE_TIMEOUT_SECONDS <
+          * (time_t *) p && (conn = u->conn) != NULL) {
+        release_upstream(u, 0);
+        if (u->got_reply) {
+          conn->close_after_reply = 1;
+          close_local_endpoint(conn);
+        } else {
+          send_http_error(conn, 504, NULL);
+        }
+      } else if (nc->last_io_time + UMSERVER_IDLE_TIMEOUT_SECONDS <
+                 * (time_t *) p) {
+        unlink_idle_upstream(u);
+        nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      }
+      break;
+    case NS_CLOSE:
+      nc->connection_data = NULL;
+      on_upstream_close(u);
+      break;
+    default:
+      break;
+  }
+}
+
+// Forget about the old backends: live upstreams keep serving their current
+// reply, but are not pooled any more.
+static void detach_upstreams(struct ht_server *server) {
+  struct ns_connection *nc;
+  struct upstream *u;
+
+  for (nc = server->ns_server.active_connections; nc != NULL; nc = nc->next) {
+    if ((nc->flags & MG_UPSTREAM_CONN) &&
+        (u = (struct upstream *) nc->connection_data) != NULL) {
+      if (u->is_idle) nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      u->is_idle = 0;
+      u->keep_alive = 0;
+      u->backend = NULL;
     }
-  } else {
-    conn->ns_conn->flags |= NSF_CLOSE_IMMEDIATELY;
   }
 }
 
@@ -4116,6 +6773,7 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
   // Call URI handler if one is registered for this URI
   if (skip_user == 0 && conn->server->event_handler != NULL) {
     conn->endpoint_type = EP_USER;
+    init_request_body(conn);
 #if UMSERVER_POST_SIZE_LIMIT > 1
     {
       const char *cl = ht_get_header(&conn->ht_conn, "Content-Length");
@@ -4130,6 +6788,10 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
     return;
   }
 
+  if (conn->server->proxy_routes != NULL && open_upstream_endpoint(conn)) {
+    return;
+  }
+
   if (strcmp(conn->ht_conn.request_method, "CONNECT") == 0 ||
       memcmp(conn->ht_conn.uri, "http", 4) == 0) {
     proxify_connection(conn);
@@ -4151,7 +6813,8 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
   } else if (conn->server->config_options[DOCUMENT_ROOT] == NULL) {
     send_http_error(conn, 404, NULL);
 #ifndef UMSERVER_NO_AUTH
-  } else if ((!is_dav_request(conn) && !is_authorized(conn, path)) ||
+  } else if ((!is_dav_request(conn) &&
+              !is_authorized(conn, path, exists && is_directory)) ||
              (is_dav_request(conn) && !is_authorized_for_dav(conn))) {
     ht_send_digest_auth_request(&conn->ht_conn);
     close_local_endpoint(conn);
@@ -4196,7 +6859,7 @@ static void open_local_endpoint(struct connection *conn, int skip_user) {
                              path) > 0) {
     handle_ssi_request(conn, path);
 #endif
-  } else if (is_not_modified(conn, &st)) {
+  } else if (is_not_modified(conn, path, &st)) {
     send_http_error(conn, 304, NULL);
   } else if ((conn->endpoint.fd = open(path, O_RDONLY | O_BINARY)) != -1) {
     // O_BINARY is required for Windows, otherwise in default text mode
@@ -4226,6 +6889,20 @@ static int is_valid_uri(const char *uri) {
     sscanf(uri, "%*[^ :]:%hu", &n) > 0; // CONNECT method can use host:port
 }
 
+// Remember request target before parse_http_message() decodes it in place
+static void save_raw_uri(struct connection *conn) {
+  const char *s = conn->request, *end = s + conn->request_len, *p;
+
+  free(conn->raw_uri);
+  conn->raw_uri = NULL;
+  if ((s = (const char *) memchr(s, ' ', end - s)) != NULL) {
+    for (p = ++s; p < end && *p != ' ' && *p != '\r' && *p != '\n'; p++);
+    if ((conn->raw_uri = (char *) malloc(p - s + 1)) != NULL) {
+      ht_snprintf(conn->raw_uri, p - s + 1, "%.*s", (int) (p - s), s);
+    }
+  }
+}
+
 static void try_parse(struct connection *conn) {
   struct iobuf *io = &conn->ns_conn->recv_iobuf;
 
@@ -4238,6 +6915,9 @@ static void try_parse(struct connection *conn) {
     memcpy(conn->request, io->buf, conn->request_len);
     //DBG(("%p [%.*s]", conn, conn->request_len, conn->request));
     iobuf_remove(io, conn->request_len);
+    if (conn->server->proxy_routes != NULL) {
+      save_raw_uri(conn);
+    }
     conn->request_len = parse_http_message(conn->request, conn->request_len,
                                            &conn->ht_conn);
     if (conn->request_len > 0) {
@@ -4262,6 +6942,11 @@ static void do_proxy(struct connection *conn) {
     DBG(("%p forwarding", conn));
     ns_forward(conn->ns_conn, conn->endpoint.nc);
   }
+
+  // Request is handled, from now on this is a tunnel
+  if (conn->request_len != 0 && conn->endpoint.nc != NULL) {
+    ns_link(conn->ns_conn, conn->endpoint.nc);
+  }
 }
 
 static void on_recv_data(struct connection *conn) {
@@ -4272,6 +6957,11 @@ static void on_recv_data(struct connection *conn) {
     return;
   }
 
+  if (conn->endpoint_type == EP_UPSTREAM) {
+    forward_upstream_body(conn);
+    return;
+  }
+
   try_parse(conn);
   DBG(("%p %d %zu %d", conn, conn->request_len, io->len, conn->ns_conn->flags));
   if (conn->request_len < 0 ||
@@ -4285,7 +6975,10 @@ static void on_recv_data(struct connection *conn) {
     send_http_error(conn, 505, NULL);
   } else if (conn->request_len > 0 && conn->endpoint_type == EP_NONE) {
 #ifndef UMSERVER_NO_WEBSOCKET
-    send_websocket_handshake_if_requested(&conn->ht_conn);
+    // Websockets of proxied URIs are the backend's to accept
+    if (conn->server->proxy_routes == NULL || find_proxy_route(conn) == NULL) {
+      send_websocket_handshake_if_requested(&conn->ht_conn);
+    }
 #endif
     send_continue_if_expected(conn);
     open_local_endpoint(conn, 0);
@@ -4296,7 +6989,8 @@ static void on_recv_data(struct connection *conn) {
     ns_forward(conn->ns_conn, conn->endpoint.nc);
   }
 #endif
-  if (conn->endpoint_type == EP_USER) {
+  if (conn->endpoint_type == EP_USER &&
+      !(conn->ns_conn->flags & MG_JOB_PENDING)) {
     call_request_handler_if_data_is_buffered(conn);
   }
 #ifndef UMSERVER_NO_DAV
@@ -4354,6 +7048,7 @@ struct ht_connection *ht_connect(struct ht_server *server, const char *host,
   nsconn->connection_data = conn;
 
   conn->server = server;
+  conn->id = ++server->next_conn_id;
   conn->endpoint_type = EP_CLIENT;
   //conn->handler = handler;
   conn->ht_conn.server_param = server->ns_server.server_data;
@@ -4407,7 +7102,9 @@ static void close_local_endpoint(struct connection *conn) {
   struct ht_connection *c = &conn->ht_conn;
   // Must be done before free()
   int keep_alive = should_keep_alive(&conn->ht_conn) &&
-    (conn->endpoint_type == EP_FILE || conn->endpoint_type == EP_USER);
+    (conn->endpoint_type == EP_FILE || conn->endpoint_type == EP_USER ||
+     (conn->endpoint_type == EP_UPSTREAM && conn->endpoint.nc == NULL &&
+      conn->cl == 0 && !conn->close_after_reply));
   DBG(("%p %d %d %d", conn, conn->endpoint_type, keep_alive,
        conn->ns_conn->flags));
 
@@ -4424,6 +7121,12 @@ static void close_local_endpoint(struct connection *conn) {
         conn->endpoint.nc->connection_data = NULL;
       }
       break;
+    case EP_UPSTREAM:
+      if (conn->endpoint.nc != NULL) {
+        release_upstream((struct upstream *) conn->endpoint.nc->connection_data,
+                         0);
+      }
+      break;
     default: break;
   }
 
@@ -4438,6 +7141,9 @@ static void close_local_endpoint(struct connection *conn) {
   iobuf_free(&conn->ns_conn->recv_iobuf);
   free(conn->request);
   free(conn->path_info);
+  free(conn->raw_uri);
+  free(conn->ranges);
+  free_request_body(conn);
 
   conn->endpoint_type = EP_NONE;
   conn->cl = conn->num_bytes_sent = conn->request_len = 0;
@@ -4447,7 +7153,10 @@ static void close_local_endpoint(struct connection *conn) {
   c->num_headers = c->status_code = c->is_websocket = c->content_len = 0;
   conn->endpoint.nc = NULL;
   c->request_method = c->uri = c->http_version = c->query_string = NULL;
-  conn->request = conn->path_info = NULL;
+  conn->request = conn->path_info = conn->raw_uri = NULL;
+  conn->ranges = NULL;
+  conn->close_after_reply = 0;
+  conn->vars_ready = 0;
 
   if (keep_alive) {
     on_recv_data(conn);  // Can call us recursively if pipelining is used
@@ -4458,23 +7167,217 @@ static void close_local_endpoint(struct connection *conn) {
 }
 
 static void transfer_file_data(struct connection *conn) {
+  struct ns_connection *nc = conn->ns_conn;
   char buf[IOBUF_SIZE];
-  int n = read(conn->endpoint.fd, buf, conn->cl < (int64_t) sizeof(buf) ?
-               (int) conn->cl : (int) sizeof(buf));
+  int n;
 
-  if (n <= 0) {
-    close_local_endpoint(conn);
-  } else if (n > 0) {
+  // Keep the send buffer filled up to the high watermark
+  while (!(nc->flags & NSF_THROTTLED) &&
+         nc->send_iobuf.len < nc->server->high_water) {
+    n = read(conn->endpoint.fd, buf, conn->cl < (int64_t) sizeof(buf) ?
+             (int) conn->cl : (int) sizeof(buf));
+    if (n <= 0) {
+      close_local_endpoint(conn);
+      break;
+    }
     conn->cl -= n;
-    ns_send(conn->ns_conn, buf, n);
-    if (conn->cl <= 0) {
+    ns_send(nc, buf, n);
+    if (conn->cl <= 0 &&
+        (conn->ranges == NULL || !next_file_range(conn))) {
       close_local_endpoint(conn);
+      break;
+    }
+  }
+}
+
+#ifndef UMSERVER_NO_THREADS
+static void *worker_thread(void *param) {
+  struct ht_server *server = (struct ht_server *) param;
+  struct worker_pool *pool = server->pool;
+  struct ht_job *job;
+
+  ht_mutex_lock(&pool->mutex);
+  while (!pool->stop) {
+    if ((job = pool->pending) == NULL) {
+      ht_cond_wait(&pool->cond, &pool->mutex);
+      continue;
+    }
+    if ((pool->pending = job->next) == NULL) pool->pending_tail = NULL;
+    ht_mutex_unlock(&pool->mutex);
+
+    job->work(job->param);
+
+    ht_mutex_lock(&pool->mutex);
+    job->next = pool->finished;
+    pool->finished = job;
+    ht_mutex_unlock(&pool->mutex);
+
+    // Kick the IO thread out of select(), it delivers finished jobs
+    ns_server_wakeup(&server->ns_server);
+    ht_mutex_lock(&pool->mutex);
+  }
+  pool->num_threads--;
+  ht_cond_broadcast(&pool->cond);
+  ht_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+static struct worker_pool *create_worker_pool(struct ht_server *server) {
+  const char *opt = server->config_options[WORKER_THREADS];
+  int i, n = opt == NULL ? 0 : atoi(opt);
+  struct worker_pool *pool;
+
+  if ((pool = (struct worker_pool *) calloc(1, sizeof(*pool))) == NULL) {
+    return NULL;
+  }
+  ht_mutex_init(&pool->mutex);
+  ht_cond_init(&pool->cond);
+  server->pool = pool;
+
+  // Workers block on the mutex until all of them are started
+  ht_mutex_lock(&pool->mutex);
+  for (i = 0; i < (n > 0 ? n : 1); i++) {
+    pool->num_threads++;
+    if (ns_start_thread(worker_thread, server) == NULL) pool->num_threads--;
+  }
+  ht_mutex_unlock(&pool->mutex);
+
+  return pool;
+}
+
+// Queue job for the connection with id conn_id, or for the server itself if
+// it is 0: done then gets NULL.
+static int queue_job(struct ht_server *server, unsigned long conn_id,
+                     ht_job_func_t work, ht_job_done_t done, void *param) {
+  struct worker_pool *pool = server->pool;
+  struct ht_job *job;
+
+  if (work == NULL || done == NULL ||
+      (pool == NULL && (pool = create_worker_pool(server)) == NULL) ||
+      pool->num_threads == 0 ||
+      (job = (struct ht_job *) calloc(1, sizeof(*job))) == NULL) {
+    return 0;
+  }
+  job->conn_id = conn_id;
+  job->work = work;
+  job->done = done;
+  job->param = param;
+
+  ht_mutex_lock(&pool->mutex);
+  if (pool->pending_tail != NULL) {
+    pool->pending_tail->next = job;
+  } else {
+    pool->pending = job;
+  }
+  pool->pending_tail = job;
+  ht_cond_broadcast(&pool->cond);
+  ht_mutex_unlock(&pool->mutex);
+
+  return 1;
+}
+
+int ht_queue_job(struct ht_connection *c, ht_job_func_t work,
+                 ht_job_done_t done, void *param) {
+  struct connection *conn = MG_CONN_2_CONN(c);
+
+  if (!queue_job(conn->server, conn->id, work, done, param)) return 0;
+  conn->ns_conn->flags |= MG_JOB_PENDING;
+  return 1;
+}
+
+static struct connection *find_connection(struct ht_server *server,
+                                          unsigned long id) {
+  struct ns_connection *nc;
+  struct connection *conn;
+
+  for (nc = server->ns_server.active_connections; nc != NULL; nc = nc->next) {
+    conn = (struct connection *) nc->connection_data;
+    if (conn != NULL && conn->id == id &&
+        !(nc->flags & (MG_CGI_CONN | MG_PROXY_CONN | MG_UPSTREAM_CONN |
+                       NSF_CLOSE_IMMEDIATELY))) {
+      return conn;
+    }
+  }
+
+  return NULL;
+}
+
+// Runs on the IO thread: hand results of finished jobs to their connections.
+static void deliver_finished_jobs(struct ht_server *server) {
+  struct worker_pool *pool = server->pool;
+  struct ht_job *job, *list = NULL, *next;
+  struct connection *conn;
+  int result;
+
+  ht_mutex_lock(&pool->mutex);
+  job = pool->finished;
+  pool->finished = NULL;
+  ht_mutex_unlock(&pool->mutex);
+
+  // Restore completion order
+  for (; job != NULL; job = next) {
+    next = job->next;
+    job->next = list;
+    list = job;
+  }
+
+  for (job = list; job != NULL; job = next) {
+    next = job->next;
+    if ((conn = find_connection(server, job->conn_id)) == NULL) {
+      job->done(NULL, job->param);
+    } else {
+      conn->ns_conn->flags &= ~MG_JOB_PENDING;
+      if ((result = job->done(&conn->ht_conn, job->param)) == MG_TRUE) {
+        if (conn->ns_conn->flags & MG_HEADERS_SENT) {
+          write_terminating_chunk(conn);
+        }
+        close_local_endpoint(conn);
+      } else if (result == MG_FALSE) {
+        open_local_endpoint(conn, 1);
+      }
     }
+    free(job);
+  }
+}
+
+static void destroy_worker_pool(struct ht_server *server) {
+  struct worker_pool *pool = server->pool;
+  struct ht_job *job, *next;
+
+  ht_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  ht_cond_broadcast(&pool->cond);
+  while (pool->num_threads > 0) {
+    // Keep polling: a worker may be waiting for its wakeup to be read
+    ht_mutex_unlock(&pool->mutex);
+    ns_server_poll(&server->ns_server, 10);
+    ht_mutex_lock(&pool->mutex);
+  }
+  ht_mutex_unlock(&pool->mutex);
+
+  for (job = pool->pending; job != NULL; job = next) {
+    next = job->next;
+    job->done(NULL, job->param);
+    free(job);
   }
+  deliver_finished_jobs(server);
+
+  ht_cond_destroy(&pool->cond);
+  ht_mutex_destroy(&pool->mutex);
+  free(pool);
+  server->pool = NULL;
 }
+#endif // UMSERVER_NO_THREADS
 
 int ht_poll_server(struct ht_server *server, int milliseconds) {
-  return ns_server_poll(&server->ns_server, milliseconds);
+  int n = ns_server_poll(&server->ns_server, milliseconds);
+#ifndef UMSERVER_NO_THREADS
+  if (server->pool != NULL) {
+    deliver_finished_jobs(server);
+  }
+#endif
+  return n;
 }
 
 void ht_destroy_server(struct ht_server **server) {
@@ -4482,7 +7385,26 @@ void ht_destroy_server(struct ht_server **server) {
     struct ht_server *s = *server;
     int i;
 
+#ifndef UMSERVER_NO_THREADS
+    if (s->pool != NULL) {
+      destroy_worker_pool(s);
+    }
+#endif
+    detach_upstreams(s);
     ns_server_free(&s->ns_server);
+    free_proxy_routes(s->proxy_routes);
+#ifndef UMSERVER_NO_SSI
+    clear_ssi_cache(s);
+#endif
+#ifndef UMSERVER_NO_DIRECTORY_LISTING
+    clear_dir_cache(s);
+#endif
+#ifndef UMSERVER_NO_AUTH
+    clear_auth_cache(s);
+#endif
+#ifndef UMSERVER_NO_FILESYSTEM
+    free_etag_index(s);
+#endif
     for (i = 0; i < (int) ARRAY_SIZE(s->config_options); i++) {
       free(s->config_options[i]);  // It is OK to free(NULL)
     }
@@ -4497,7 +7419,7 @@ struct ht_iterator {
 };
 
 static void iter(struct ns_connection *nsconn, enum ns_event ev, void *param) {
-  if (ev == NS_POLL) {
+  if (ev == NS_POLL && !(nsconn->flags & MG_UPSTREAM_CONN)) {
     struct ht_iterator *it = (struct ht_iterator *) param;
     struct connection *c = (struct connection *) nsconn->connection_data;
     if (c != NULL) c->ht_conn.callback_param = it->param;
@@ -4512,61 +7434,105 @@ void ht_iterate_over_connections(struct ht_server *server, ht_handler_t cb,
   ns_iterate(&server->ns_server, iter, &it);
 }
 
-static int get_var(const char *data, size_t data_len, const char *name,
-                   char *dst, size_t dst_len) {
-  const char *p, *e, *s;
-  size_t name_len;
-  int len;
-
-  if (dst == NULL || dst_len == 0) {
-    len = -2;
-  } else if (data == NULL || name == NULL || data_len == 0) {
-    len = -1;
-    dst[0] = '\0';
-  } else {
-    name_len = strlen(name);
-    e = data + data_len;
-    len = -1;
-    dst[0] = '\0';
-
-    // data is "var1=val1&var2=val2...". Find variable first
-    for (p = data; p + name_len < e; p++) {
-      if ((p == data || p[-1] == '&') && p[name_len] == '=' &&
-          !ht_strncasecmp(name, p, name_len)) {
+// Split "var1=val1&var2=val2..." into conn->vars
+static void add_vars(struct connection *conn, const char *data,
+                     size_t data_len) {
+  const char *p = data, *e = data + data_len, *s, *eq;
+  struct ht_var *v;
+  int size;
+
+  for (; p < e; p = s + 1) {
+    if ((s = (const char *) memchr(p, '&', (size_t) (e - p))) == NULL) s = e;
+    if (s == p) continue;
+    if (conn->num_vars >= conn->vars_size) {
+      size = conn->vars_size == 0 ? 16 : conn->vars_size * 2;
+      if ((v = (struct ht_var *) realloc(conn->vars, size * sizeof(*v))) ==
+          NULL) {
+        return;
+      }
+      conn->vars = v;
+      conn->vars_size = size;
+    }
+    v = &conn->vars[conn->num_vars++];
+    eq = (const char *) memchr(p, '=', (size_t) (s - p));
+    v->name = p;
+    v->name_len = (eq == NULL ? s : eq) - p;
+    v->value = eq == NULL ? NULL : eq + 1;
+    v->value_len = eq == NULL ? 0 : (size_t) (s - (eq + 1));
+  }
+}
 
-        // Point p to variable value
-        p += name_len + 1;
+int ht_get_vars(const struct ht_connection *c, const struct ht_var **vars) {
+  struct connection *conn = MG_CONN_2_CONN(c);
 
-        // Point s to the end of the value
-        s = (const char *) memchr(p, '&', (size_t)(e - p));
-        if (s == NULL) {
-          s = e;
-        }
-        assert(s >= p);
+  // Index is dropped on every event, as content may change between them
+  if (!conn->vars_ready) {
+    conn->num_vars = 0;
+    if (c->query_string != NULL) {
+      add_vars(conn, c->query_string, strlen(c->query_string));
+    }
+    if (c->content != NULL) {
+      add_vars(conn, c->content, c->content_len);
+    }
+    conn->vars_ready = 1;
+  }
+  if (vars != NULL) *vars = conn->vars;
 
-        // Decode variable into destination buffer
-        len = ht_url_decode(p, (size_t)(s - p), dst, dst_len, 1);
+  return conn->num_vars;
+}
 
-        // Redirect error code from -1 to -2 (destination buffer too small).
-        if (len == -1) {
-          len = -2;
-        }
-        break;
+int ht_get_var(const struct ht_connection *conn, const char *name,
+               char *dst, size_t dst_len) {
+  const struct ht_var *vars;
+  size_t name_len;
+  int i, n, len = -1;
+
+  if (dst == NULL || dst_len == 0) return -2;
+  dst[0] = '\0';
+  if (name == NULL) return -1;
+
+  name_len = strlen(name);
+  n = ht_get_vars(conn, &vars);
+  for (i = 0; i < n; i++) {
+    if (vars[i].value != NULL && vars[i].name_len == name_len &&
+        !ht_strncasecmp(name, vars[i].name, name_len)) {
+      len = ht_url_decode(vars[i].value, (int) vars[i].value_len,
+                          dst, (int) dst_len, 1);
+
+      // Redirect error code from -1 to -2 (destination buffer too small).
+      if (len == -1) {
+        len = -2;
       }
+      break;
     }
   }
 
   return len;
 }
 
-int ht_get_var(const struct ht_connection *conn, const char *name,
-               char *dst, size_t dst_len) {
-  int len = get_var(conn->query_string, conn->query_string == NULL ? 0 :
-                    strlen(conn->query_string), name, dst, dst_len);
-  if (len < 0) {
-    len = get_var(conn->content, conn->content_len, name, dst, dst_len);
+// Boyer-Moore-Horspool search. skip is made by init_bmh() for the pattern.
+static void init_bmh(const char *pat, size_t pat_len, size_t skip[256]) {
+  size_t i;
+
+  for (i = 0; i < 256; i++) skip[i] = pat_len;
+  for (i = 0; i + 1 < pat_len; i++) {
+    skip[(unsigned char) pat[i]] = pat_len - 1 - i;
   }
-  return len;
+}
+
+static const char *search_bmh(const char *buf, size_t len, const char *pat,
+                              size_t pat_len, const size_t skip[256]) {
+  const unsigned char *s = (const unsigned char *) buf;
+  unsigned char last, ch;
+  size_t i;
+
+  if (pat_len == 0 || len < pat_len) return NULL;
+  last = (unsigned char) pat[pat_len - 1];
+  for (i = 0; i <= len - pat_len; i += skip[ch]) {
+    ch = s[i + pat_len - 1];
+    if (ch == last && !memcmp(buf + i, pat, pat_len - 1)) return buf + i;
+  }
+  return NULL;
 }
 
 static int get_line_len(const char *buf, int buf_len) {
@@ -4582,7 +7548,8 @@ int ht_parse_multipart(const char *buf, int buf_len,
   static const char cd[] = "Content-Disposition: ";
   //struct ht_connection c;
   int hl, bl, n, ll, pos, cdl = sizeof(cd) - 1;
-  //char *p;
+  const char *p;
+  size_t skip[256];
 
   if (buf == NULL || buf_len <= 0) return 0;
   if ((hl = get_request_len(buf, buf_len)) <= 0) return 0;
@@ -4603,17 +7570,211 @@ int ht_parse_multipart(const char *buf, int buf_len,
   }
 
   // Scan body, search for terminating boundary
-  for (pos = hl; pos + (bl - 2) < buf_len; pos++) {
-    if (buf[pos] == '-' && !memcmp(buf, &buf[pos], bl - 2)) {
-      if (data_len != NULL) *data_len = (pos - 2) - hl;
-      if (data != NULL) *data = buf + hl;
-      return pos;
-    }
+  init_bmh(buf, bl - 2, skip);
+  if (hl < buf_len &&
+      (p = search_bmh(buf + hl, buf_len - hl - 1, buf, bl - 2, skip)) != NULL) {
+    pos = (int) (p - buf);
+    if (data_len != NULL) *data_len = (pos - 2) - hl;
+    if (data != NULL) *data = buf + hl;
+    return pos;
   }
 
   return 0;
 }
 
+// Boundary is at most 70 characters, RFC 2046 section 5.1.1
+#define MULTIPART_MAX_BOUNDARY 70
+
+enum {
+  MP_PREAMBLE, MP_BOUNDARY, MP_HEADERS, MP_DATA, MP_DONE, MP_ERROR
+};
+
+struct ht_multipart {
+  struct ht_multipart_handler handler;
+  void *param;
+  int state;
+  char delim[MULTIPART_MAX_BOUNDARY + 5];  // "\r\n--" and the boundary
+  size_t delim_len;
+  size_t skip[256];
+  size_t partial;             // Delimiter bytes matched at end of last piece
+  int line_len, dashes;       // Boundary line: "--" there ends the body
+  char headers[MAX_REQUEST_SIZE];
+  size_t headers_len, line_start;
+};
+
+struct ht_multipart *ht_multipart_create(const char *content_type,
+                                         const struct ht_multipart_handler *h,
+                                         void *param) {
+  char boundary[MULTIPART_MAX_BOUNDARY + 2];
+  struct ht_multipart *mp;
+  int len;
+
+  if (content_type == NULL || h == NULL ||
+      ht_strncasecmp(content_type, "multipart/", 10) != 0 ||
+      (len = ht_parse_header(content_type, "boundary", boundary,
+                             sizeof(boundary))) <= 0 ||
+      len > MULTIPART_MAX_BOUNDARY || strpbrk(boundary, "\r\n") != NULL ||
+      (mp = (struct ht_multipart *) calloc(1, sizeof(*mp))) == NULL) {
+    return NULL;
+  }
+
+  mp->handler = *h;
+  mp->param = param;
+  mp->delim_len = ht_snprintf(mp->delim, sizeof(mp->delim), "\r\n--%s",
+                              boundary);
+  init_bmh(mp->delim, mp->delim_len, mp->skip);
+
+  // First boundary may come without preceding CRLF
+  mp->state = MP_PREAMBLE;
+  mp->partial = 2;
+
+  return mp;
+}
+
+void ht_multipart_free(struct ht_multipart *mp) {
+  free(mp);
+}
+
+static void emit_part_data(struct ht_multipart *mp, const char *p, size_t n) {
+  if (mp->state == MP_DATA && n > 0 && mp->handler.data != NULL) {
+    mp->handler.data(mp->param, p, n);
+  }
+}
+
+static void end_part(struct ht_multipart *mp) {
+  if (mp->state == MP_DATA && mp->handler.end != NULL) {
+    mp->handler.end(mp->param);
+  }
+  mp->state = MP_BOUNDARY;
+  mp->line_len = mp->dashes = 0;
+}
+
+// Pass part contents up to the next delimiter, or all of the piece except
+// a possible delimiter start at its end. Return where parsing stopped.
+static const char *scan_part_data(struct ht_multipart *mp, const char *p,
+                                  const char *e) {
+  size_t n = e - p, k;
+  const char *q;
+
+  // Delimiter started at the end of the previous piece
+  if (mp->partial > 0) {
+    k = mp->delim_len - mp->partial;
+    if (k > n) k = n;
+    if (!memcmp(p, mp->delim + mp->partial, k)) {
+      if ((mp->partial += k) == mp->delim_len) {
+        mp->partial = 0;
+        end_part(mp);
+      }
+      return p + k;
+    }
+    // It was data. The delimiter has CR only at its start, so no shorter
+    // match could have begun inside the matched bytes.
+    emit_part_data(mp, mp->delim, mp->partial);
+    mp->partial = 0;
+  }
+
+  if ((q = search_bmh(p, n, mp->delim, mp->delim_len, mp->skip)) != NULL) {
+    emit_part_data(mp, p, q - p);
+    end_part(mp);
+    return q + mp->delim_len;
+  }
+
+  // Hold back the tail if it looks like the start of a delimiter
+  k = n < mp->delim_len - 1 ? n : mp->delim_len - 1;
+  for (q = (const char *) memchr(e - k, '\r', k); q != NULL;
+       q = (const char *) memchr(q + 1, '\r', e - q - 1)) {
+    if (!memcmp(q, mp->delim, e - q)) {
+      mp->partial = e - q;
+      break;
+    }
+  }
+  emit_part_data(mp, p, (q == NULL ? e : q) - p);
+
+  return e;
+}
+
+static void begin_part(struct ht_multipart *mp) {
+  static const char cd[] = "Content-Disposition:";
+  char var_name[256], file_name[MAX_PATH_SIZE];
+  const char *s, *end = mp->headers + mp->line_start;
+  int cdl = sizeof(cd) - 1, ll;
+
+  var_name[0] = file_name[0] = '\0';
+  for (s = mp->headers; s < end; s += ll) {
+    ll = get_line_len(s, end - s);
+    if (ll > cdl && !ht_strncasecmp(cd, s, cdl)) {
+      parse_header(s + cdl, ll - cdl, "name", var_name, sizeof(var_name));
+      parse_header(s + cdl, ll - cdl, "filename", file_name,
+                   sizeof(file_name));
+    }
+  }
+
+  mp->state = MP_DATA;
+  mp->headers[mp->line_start] = '\0';
+  if (mp->handler.begin != NULL) {
+    mp->handler.begin(mp->param, var_name, file_name, mp->headers,
+                      mp->line_start);
+  }
+}
+
+// Collect part header lines until an empty one
+static const char *read_part_headers(struct ht_multipart *mp, const char *p,
+                                     const char *e) {
+  const char *q, *line;
+  size_t n;
+
+  while (p < e) {
+    q = (const char *) memchr(p, '\n', e - p);
+    n = (q == NULL ? e : q + 1) - p;
+    if (mp->headers_len + n >= sizeof(mp->headers)) {
+      mp->state = MP_ERROR;
+      return e;
+    }
+    memcpy(mp->headers + mp->headers_len, p, n);
+    mp->headers_len += n;
+    p += n;
+    if (q == NULL) break;
+
+    line = mp->headers + mp->line_start;
+    n = mp->headers_len - mp->line_start;
+    if (n == 1 || (n == 2 && line[0] == '\r')) {
+      begin_part(mp);
+      break;
+    }
+    mp->line_start = mp->headers_len;
+  }
+
+  return p;
+}
+
+int ht_multipart_feed(struct ht_multipart *mp, const char *data, size_t len) {
+  const char *p = data, *e = data + len;
+
+  while (p < e && mp->state != MP_DONE && mp->state != MP_ERROR) {
+    switch (mp->state) {
+      case MP_PREAMBLE:
+      case MP_DATA:
+        p = scan_part_data(mp, p, e);
+        break;
+      case MP_BOUNDARY:
+        // Rest of the boundary line: "--" for the last one, or padding
+        if (mp->line_len++ < 2 && *p == '-' && ++mp->dashes == 2) {
+          mp->state = MP_DONE;
+        } else if (*p == '\n') {
+          mp->state = MP_HEADERS;
+          mp->headers_len = mp->line_start = 0;
+        }
+        p++;
+        break;
+      case MP_HEADERS:
+        p = read_part_headers(mp, p, e);
+        break;
+    }
+  }
+
+  return mp->state == MP_DONE ? 1 : mp->state == MP_ERROR ? -1 : 0;
+}
+
 const char **ht_get_valid_option_names(void) {
   return static_config_options;
 }
@@ -4661,12 +7822,72 @@ const char *ht_set_option(struct ht_server *server, const char *name,
     *v = NULL;
   }
 
+  if (ind == REVERSE_PROXY) {
+    detach_upstreams(server);
+    free_proxy_routes(server->proxy_routes);
+    server->proxy_routes = NULL;
+  }
+  if (ind == UPLOAD_SPOOL_THRESHOLD) {
+    server->spool_threshold = 0;
+  }
+#ifndef UMSERVER_NO_DIRECTORY_LISTING
+  if (ind == HIDE_FILES_PATTERN) {
+    clear_dir_cache(server);
+  }
+#endif
+#ifndef UMSERVER_NO_FILESYSTEM
+  if (ind == ETAG_INDEX_FILE) {
+    free_etag_index(server);
+  }
+#endif
+
   if (value == NULL || value[0] == '\0') return NULL;
 
   *v = ht_strdup(value);
   DBG(("%s [%s]", name, *v));
 
-  if (ind == LISTENING_PORT) {
+  if (ind == REVERSE_PROXY) {
+    int ok;
+    server->proxy_routes = parse_proxy_routes(value, &ok);
+    if (!ok) {
+      error_msg = "Invalid reverse_proxy, use /prefix=http://host:port|...";
+    }
+#ifndef UMSERVER_NO_FILESYSTEM
+  } else if (ind == ETAG_INDEX_FILE) {
+    load_etag_index(server, value);
+    if (server->etag_fp == NULL) {
+      error_msg = "Cannot open etag_index_file";
+    }
+#endif
+  } else if (ind == ACCEPT_BATCH) {
+    int64_t n = to64(value);
+    if (n <= 0) {
+      error_msg = "accept_batch must be a positive number";
+    } else {
+      server->ns_server.accept_batch = (int) n;
+    }
+  } else if (ind == UPLOAD_SPOOL_THRESHOLD) {
+    server->spool_threshold = to64(value);
+  } else if (ind == MEMORY_BUDGET) {
+    server->ns_server.mem_budget = (size_t) to64(value);
+  } else if (ind == SEND_BUFFER_HIGH_WATERMARK ||
+             ind == SEND_BUFFER_LOW_WATERMARK) {
+    // The two are applied together, from both option values, and only when
+    // low is below high, so the result does not depend on the option order
+    const char *hv = server->config_options[SEND_BUFFER_HIGH_WATERMARK],
+               *lv = server->config_options[SEND_BUFFER_LOW_WATERMARK];
+    int64_t high = hv == NULL ? 0 : to64(hv), low = lv == NULL ? 0 : to64(lv);
+    if (high <= 0) high = (int64_t) server->ns_server.high_water;
+    if (low <= 0) low = (int64_t) server->ns_server.low_water;
+    if (to64(value) <= 0) {
+      error_msg = "Watermark must be a positive number of bytes";
+    } else if (low >= high) {
+      error_msg = "Low watermark must be below high watermark";
+    } else {
+      server->ns_server.high_water = (size_t) high;
+      server->ns_server.low_water = (size_t) low;
+    }
+  } else if (ind == LISTENING_PORT) {
     int port = ns_bind(&server->ns_server, value);
     if (port < 0) {
       error_msg = "Cannot bind to port";
@@ -4725,9 +7946,11 @@ static void on_accept(struct ns_connection *nc, union socket_address *sa) {
   struct ht_server *server = (struct ht_server *) nc->server;
   struct connection *conn;
 
+  // Pooled connections have zeroed room for us right after them
   if (!check_acl(server->config_options[ACCESS_CONTROL_LIST],
                  ntohl(* (uint32_t *) &sa->sin.sin_addr)) ||
-      (conn = (struct connection *) calloc(1, sizeof(*conn))) == NULL) {
+      (conn = (nc->flags & NSF_POOLED) ? (struct connection *) (nc + 1) :
+       (struct connection *) calloc(1, sizeof(*conn))) == NULL) {
     nc->flags |= NSF_CLOSE_IMMEDIATELY;
   } else {
     // Circularly link two connection structures
@@ -4736,6 +7959,7 @@ static void on_accept(struct ns_connection *nc, union socket_address *sa) {
 
     // Initialize the rest of connection attributes
     conn->server = server;
+    conn->id = ++server->next_conn_id;
     conn->ht_conn.server_param = nc->server->server_data;
     set_ips(nc, 1);
     set_ips(nc, 0);
@@ -4772,6 +7996,11 @@ static void ht_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
   struct connection *conn = (struct connection *) nc->connection_data;
   struct ht_server *server = (struct ht_server *) nc->server;
 
+  if (nc->flags & MG_UPSTREAM_CONN) {
+    upstream_ev_handler(nc, ev, p);
+    return;
+  }
+
   // Send NS event to the handler. Note that call_user won't send an event
   // if conn == NULL. Therefore, repeat this for NS_ACCEPT event as well.
 #ifdef UMSERVER_SEND_NS_EVENTS
@@ -4858,7 +8087,8 @@ static void ht_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
         call_user(conn, MG_CLOSE);
         close_local_endpoint(conn);
         conn->ns_conn = NULL;
-        free(conn);
+        free(conn->vars);
+        if (!(nc->flags & NSF_POOLED)) free(conn);
       }
       break;
 
@@ -4867,6 +8097,16 @@ static void ht_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
         nc->flags |= NSF_FINISHED_SENDING_DATA;
       }
 
+      // Stop reading what the other side cannot take yet. Linked
+      // connections are throttled by ns_server_poll() itself.
+      if (conn != NULL && nc->forward_to == NULL) {
+        ns_throttle(nc, conn->endpoint_type == EP_FILE ? nc :
+                    conn->endpoint_type == EP_CGI ||
+                    conn->endpoint_type == EP_PROXY ||
+                    conn->endpoint_type == EP_UPSTREAM ?
+                    conn->endpoint.nc : NULL);
+      }
+
       if (conn != NULL && conn->endpoint_type == EP_FILE) {
         transfer_file_data(conn);
       }
@@ -4879,7 +8119,8 @@ static void ht_ev_handler(struct ns_connection *nc, enum ns_event ev, void *p) {
           ping_idle_websocket_connection(conn, current_time);
         }
 
-        if (nc->last_io_time + UMSERVER_IDLE_TIMEOUT_SECONDS < current_time) {
+        if (nc->last_io_time + UMSERVER_IDLE_TIMEOUT_SECONDS < current_time &&
+            !(nc->flags & MG_JOB_PENDING)) {
           ht_ev_handler(nc, NS_CLOSE, NULL);
           nc->flags |= NSF_CLOSE_IMMEDIATELY;
         }
@@ -4898,6 +8139,8 @@ static void iter2(struct ns_connection *nc, enum ns_event ev, void *param) {
   int n;
   (void) ev;
 
+  if (nc->flags & MG_UPSTREAM_CONN) return;
+
   //DBG(("%p [%s]", conn, msg));
   if (sscanf(msg, "%p %n", &func, &n) && func != NULL) {
     conn->ht_conn.callback_param = (void *) (msg + n);
@@ -4932,6 +8175,16 @@ void ht_set_listening_socket(struct ht_server *server, int sock) {
   server->ns_server.listening_sock = (sock_t) sock;
 }
 
+void ht_get_stats(struct ht_server *server, struct ht_stats *stats) {
+  const struct ns_stats *ns = &server->ns_server.stats;
+
+  stats->buffered_bytes = ns->buffered;
+  stats->peak_buffered_bytes = ns->peak_buffered;
+  stats->num_connections = ns->num_connections;
+  stats->num_throttled = ns->num_throttled;
+  stats->num_pauses = ns->num_pauses;
+}
+
 int ht_get_listening_socket(struct ht_server *server) {
   return server->ns_server.listening_sock;
 }
@@ -4945,7 +8198,11 @@ const char *ht_get_option(const struct ht_server *server, const char *name) {
 struct ht_server *ht_create_server(void *server_data, ht_handler_t handler) {
   struct ht_server *server = (struct ht_server *) calloc(1, sizeof(*server));
   ns_server_init(&server->ns_server, server_data, ht_ev_handler);
+  server->ns_server.conn_data_size = sizeof(struct connection);
   set_default_option_values(server->config_options);
   server->event_handler = handler;
+#if !defined(UMSERVER_NO_WEBSOCKET) || !defined(UMSERVER_NO_FILESYSTEM)
+  select_sha1_impl();
+#endif
   return server;
 }
@@ -62,10 +62,21 @@ enum ht_event
   MG_REPLY,       // If callback returns MG_FALSE, Mongoose closes connection
   MG_CLOSE,       // Connection is closed, callback return value is ignored
   MG_WS_HANDSHAKE,  // New websocket connection, handshake request
-  MG_HTTP_ERROR   // If callback returns MG_FALSE, Mongoose continues with err
+  MG_HTTP_ERROR,  // If callback returns MG_FALSE, Mongoose continues with err
+  MG_BODY         // Request body piece, see below
 };
 typedef int (*ht_handler_t)(struct ht_connection *, enum ht_event);
 
+// Request body comes with the first MG_BODY, which has NULL content. If it
+// returns MG_TRUE, the body, plain or chunked, is buffered and passed to
+// MG_REQUEST in content, content_len. Bodies above upload_spool_threshold
+// bytes are kept in a temporary file, mapped into memory for MG_REQUEST.
+// To stream the body instead, return MG_MORE. Pieces of the body then come
+// in further MG_BODY calls, followed by MG_REQUEST with empty content once
+// the body is complete. Otherwise the body is buffered as it came, so that
+// a request the handler returns MG_FALSE for still has it: MG_REQUEST gets
+// a plain body as content, and a chunked one not at all.
+
 // Websocket opcodes, from http://tools.ietf.org/html/rfc6455
 enum
 {
@@ -91,6 +102,19 @@ void ht_wakeup_server(struct ht_server *);
 void ht_wakeup_server_ex(struct ht_server *, ht_handler_t, const char *, ...);
 struct ht_connection *ht_connect(struct ht_server *, const char *, int, int);
 
+// Buffer usage, as of the last ht_poll_server() call. Reading a connection
+// is paused while its peer has more than send_buffer_high_watermark bytes
+// to send, or all buffers together exceed memory_budget.
+struct ht_stats
+{
+  size_t buffered_bytes;       // Data held in all connection buffers
+  size_t peak_buffered_bytes;  // Maximum of the above
+  int num_connections;         // Including CGI and proxy connections
+  int num_throttled;           // Connections that are paused
+  unsigned long num_pauses;    // Number of times a connection got paused
+};
+void ht_get_stats(struct ht_server *, struct ht_stats *);
+
 // Connection management functions
 void ht_send_status(struct ht_connection *, int status_code);
 void ht_send_header(struct ht_connection *, const char *name, const char *val);
@@ -110,12 +134,53 @@ const char *ht_get_header(const struct ht_connection *, const char *name);
 const char *ht_get_mime_type(const char *name, const char *default_mime_type);
 int ht_get_var(const struct ht_connection *conn, const char *var_name,
                char *buf, size_t buf_len);
+
+// Query string and form variables, split in one pass on first use during an
+// event. Names and values point into the request and are still URL-encoded,
+// value is NULL for a name without '='. Query string variables come first.
+struct ht_var
+{
+  const char *name, *value;
+  size_t name_len, value_len;
+};
+int ht_get_vars(const struct ht_connection *, const struct ht_var **vars);
 int ht_parse_header(const char *hdr, const char *var_name, char *buf, size_t);
 int ht_parse_multipart(const char *buf, int buf_len,
                        char *var_name, int var_name_len,
                        char *file_name, int file_name_len,
                        const char **data, int *data_len);
 
+// Incremental multipart/form-data parser, e.g. for bodies streamed with
+// MG_BODY. Body pieces are fed as they arrive. begin is called at the start
+// of each part with its name, file name and raw headers, data with pieces
+// of the part contents, pointing into the fed buffer where possible, and
+// end when the part is over. ht_multipart_feed() returns 1 once the closing
+// boundary is seen, -1 on malformed input, and 0 otherwise.
+struct ht_multipart;
+struct ht_multipart_handler
+{
+  void (*begin)(void *param, const char *var_name, const char *file_name,
+                const char *headers, size_t headers_len);
+  void (*data)(void *param, const char *data, size_t data_len);
+  void (*end)(void *param);
+};
+struct ht_multipart *ht_multipart_create(const char *content_type,
+                                         const struct ht_multipart_handler *,
+                                         void *param);
+int ht_multipart_feed(struct ht_multipart *, const char *data, size_t len);
+void ht_multipart_free(struct ht_multipart *);
+
+// Worker pool. A MG_REQUEST handler that has blocking work to do queues it
+// with ht_queue_job() and returns MG_MORE. work(param) runs on a pool thread;
+// when it returns, done(conn, param) is called on the serving thread, where
+// the reply can be sent. done returns MG_TRUE when the reply is complete, or
+// MG_MORE to keep the request open (e.g. after queueing another job). If the
+// connection has been closed meanwhile, done gets NULL and must only free param.
+typedef void (*ht_job_func_t)(void *param);
+typedef int (*ht_job_done_t)(struct ht_connection *, void *param);
+int ht_queue_job(struct ht_connection *, ht_job_func_t work,
+                 ht_job_done_t done, void *param);
+
 // Utility functions
 void *ht_start_thread(void *(*func)(void *), void *param);
 char *ht_md5(char buf[33], ...);
@@ -132,6 +197,14 @@ struct ht_expansion
 void ht_template(struct ht_connection *, const char *text,
                  struct ht_expansion *expansions);
 
+// Parse template once, render it many times. Expansions array must stay
+// valid for the lifetime of the compiled template.
+struct ht_template;
+struct ht_template *ht_template_compile(const char *text,
+                                        struct ht_expansion *expansions);
+void ht_template_render(struct ht_connection *, const struct ht_template *);
+void ht_template_free(struct ht_template *);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -0,0 +1,62 @@
+# BENCHMARKING umcomp and umdeps.
+#
+# Generates an app of $1 modules (8000 by default) in $2 (/tmp/umbench by
+# default), then times a full compile, a compile from the cache and a
+# dependency graph. Each module includes three others and every fifth has
+# a stylesheet, and the entry point includes them all. The same arguments
+# always give the same app, so timings can be compared between builds, e.g.
+# "make bench" here and on an older checkout. "make bench MODULES=2000"
+# changes the size.
+
+tools=$(cd "$(dirname "$0")" && pwd)
+modules=${1:-8000}
+dir=${2:-/tmp/umbench}
+
+rm -rf "$dir"
+mkdir -p "$dir/src/App" "$dir/out"
+for i in $(seq 0 $(( (modules - 1) / 50 ))); do mkdir "$dir/src/App/Mod$i"; done
+
+awk -v n="$modules" -v src="$dir/src" 'BEGIN {
+  main = src "/App/main.js";
+  for (i = 0; i < n; i++) {
+    name = "App/Mod" int(i / 50) "/File" i;
+    file = src "/" name ".js";
+    print "include(\x27" name ".js\x27);" > main;
+    for (k = 0; k < 3; k++) {
+      j = (i * (7 + 6 * k) + 5 * k + 1) % n;
+      print "include(\x27App/Mod" int(j / 50) "/File" j ".js\x27);" > file;
+    }
+    if (i % 5 == 0) {
+      print "include(\x27" name ".css\x27);" > file;
+      print ".m" i " { color: red; } /* Module " i " */" > (src "/" name ".css");
+      close(src "/" name ".css");
+    }
+    print "/* Module " i ", include(\x27App/None.js\x27) is a comment */" > file;
+    for (k = 0; k < 20; k++) {
+      print "App.Mod" int(i / 50) ".File" i "_" k " = function(a, b) {" > file;
+      print "  return a + b + \"" k "\"; // Line " k > file;
+      print "};" > file;
+    }
+    close(file);
+  }
+}'
+
+echo "Generated $modules modules in $dir/src"
+cd "$dir"
+
+t() {
+  local start=$(date +%s%N)
+  "$@" > /dev/null
+  echo "$(( ($(date +%s%N) - start) / 1000000 )) ms"
+}
+
+echo "umcomp, full:        $(t "$tools/umcomp" src/App/main.js multi /res \
+  -out_js out/app.js -out_css out/app.css)"
+echo "umcomp, -level 2:    $(t "$tools/umcomp" src/App/main.js multi /res \
+  -out_js out/min.js -out_css out/min.css -level 2)"
+t "$tools/umcomp" src/App/main.js multi /res -out_js out/app.js \
+  -out_css out/app.css -cache out/.umcache > /dev/null
+echo "umcomp, from cache:  $(t "$tools/umcomp" src/App/main.js multi /res \
+  -out_js out/app.js -out_css out/app.css -cache out/.umcache)"
+cd src
+echo "umdeps:              $(t "$tools/umdeps" . res multi App)"
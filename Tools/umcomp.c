@@ -14,15 +14,47 @@
 #include <wchar.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include "umlib.h"
 
 #define SIZEOF(a) sizeof(a) / sizeof((a)[0])
 
+struct source
+{
+  char *path;
+  char *data;
+  size_t len;
+  unsigned long long hash;
+  char *min;              /* Minified data, at the current level */
+  size_t minlen;
+  struct um_buf marks;    /* Of min, for source maps */
+  long long mtime, size;  /* When last seen, data is dropped if they change */
+  int gen;                /* Last compile it was walked in */
+};
+
+void compile();
+void writebundle(const char *js_path, const char *css_path);
+char *langpath(const char *path, const char *lang);
+char *addhashed(const char *path, const char *mapname);
+void addstr(struct um_buf *out, const char *s);
+int affected(const struct um_buf *changed);
+char *dirof(const char *fname);
 int takesrcpath(const char *fname, const char *include);
 void walk(const char *fname);
 void addtoincs(const char *fname);
+void addtobundle(const char *fname);
 void addtonames(const char *fname);
 void addsayings(const char *root);
-void writeto(const char *fname, FILE *fpout);
+void addlangsayings();
+unsigned long long filehash(const char *fname);
+int uptodate(const char *fname, unsigned long long sig);
+void setuptodate(const char *fname, unsigned long long sig);
+void writeto(const char *fname, FILE *fpout, struct um_srcmap *map);
+void mapsource(struct um_srcmap *map, const char *fname, const char *data,
+               size_t len, const char *text, size_t textlen,
+               const struct um_buf *marks);
+char *relpath(const char *from, const char *path);
+struct source *findsource(const char *fname);
+struct source *addsource(const char *fname);
 void showhelp();
 int comparator(const void *p1, const void *p2);
 
@@ -30,17 +62,37 @@ char **incs = 0;
 int incslen = 0, incssize = 0;
 char **names = 0;
 int nameslen = 0, namessize = 0;
+struct source *srcs = 0;
+int srcslen = 0, srcssize = 0;
+char **bundle = 0;
+int bundlelen = 0, bundlesize = 0;
+char **langs = 0;
+int langslen = 0, langssize = 0;
+struct um_set incset, nameset, srcset, sayset, bundleset;
+struct um_buf head, decls, manifest;
+struct um_cache cache;
+struct um_watch watch;
 char *src_path = 0;
 char *res_path = 0;
 char *entry = 0;
 char *lang = 0;
+char *out_js_path = 0, *out_css_path = 0;
 FILE *out_js = 0, *out_css = 0;
+char **args = 0;
+int nargs = 0;
+int gen = 0;
+int watching = 0;
+int level = 0;
+int mapping = 0;
+char *map_path = 0;
+char *manifest_path = 0;
 
 int main(int argc, char *argv[])
 {
-  int i = 1, j = 0;
-  int flag = 0;
-  char *ptr;
+  int i = 1;
+  char *cache_path = 0, *ptr;
+  char **p;
+  struct um_buf changed;
 
   if (argc == 1 || !strcmp(argv[1], "-h")) showhelp();
   else
@@ -49,17 +101,113 @@ int main(int argc, char *argv[])
     lang = argv[i++];
     res_path = argv[i];
 
+    /* Several languages can be given, separated by commas */
+    for (ptr = strtok(lang, ","); ptr; ptr = strtok(0, ","))
+    {
+      if (p = (char **)um_grow(langs, &langslen, langssize, sizeof *langs))
+      {
+        langs = p;
+        langs[langssize++] = ptr;
+      }
+    }
+
     while (i++ < (argc - 1))
     {
-      if (!strcmp(argv[i], "-out_js")) out_js = fopen(argv[++i], "w");
-      else if (!strcmp(argv[i], "-out_css")) out_css = fopen(argv[++i], "w");
+      if (!strcmp(argv[i], "-out_js")) out_js_path = argv[++i];
+      else if (!strcmp(argv[i], "-out_css")) out_css_path = argv[++i];
+      else if (!strcmp(argv[i], "-cache")) cache_path = argv[++i];
+      else if (!strcmp(argv[i], "-watch")) watching = 1;
+      else if (!strcmp(argv[i], "-level")) level = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-map")) mapping = 1;
+      else if (!strcmp(argv[i], "-manifest")) manifest_path = argv[++i];
+    }
+    args = argv;
+    nargs = argc;
+
+    if (watching && !um_watch_init(&watch))
+    {
+      fprintf(stderr, "Watching is not supported on this system\n");
+      watching = 0;
+    }
+    um_cache_load(&cache, cache_path ? cache_path : watching ? "" : 0);
+
+    compile();
+    um_cache_save(&cache);
+
+    /* Sources stay in memory, and the outputs are compiled again as soon as
+       one of their inputs changes */
+    memset(&changed, 0, sizeof(changed));
+    while (watching && um_watch_wait(&watch, &changed) > 0)
+    {
+      if (affected(&changed))
+      {
+        compile();
+        um_cache_save(&cache);
+      }
+      changed.len = 0;
+    }
+    um_buf_free(&changed);
+    um_watch_free(&watch);
+    um_cache_free(&cache);
+
+    free(names);
+    um_set_free(&nameset);
+    free(incs);
+    um_set_free(&incset);
+    um_set_free(&sayset);
+    free(bundle);
+    um_set_free(&bundleset);
+    free(langs);
+    um_buf_free(&head);
+    um_buf_free(&decls);
+    um_buf_free(&manifest);
+    free(map_path);
+
+    for (i = 0; i < srcssize; i++)
+    {
+      free(srcs[i].data);
+      free(srcs[i].min);
+      um_buf_free(&srcs[i].marks);
     }
-    if (!out_js) out_js = stdout;
+    free(srcs);
+    um_set_free(&srcset);
+
+    if (src_path) free(src_path);
+  }
+
+  return 0;
+}
+
+/* Walk the sources from the entry point, and write the outputs unless the
+   arguments and all inputs are the same as when they were last written */
+void compile()
+{
+  char *js_path, *css_path, *data, *mapname;
+  size_t len = 0;
+  struct stat info;
+  FILE *fp;
+  int i = 0, j = 0;
+  int flag = 0;
+
+  gen++;
+  free(names);
+  names = 0;
+  nameslen = namessize = 0;
+  um_set_free(&nameset);
+  free(incs);
+  incs = 0;
+  incslen = incssize = 0;
+  um_set_free(&incset);
+  um_set_free(&sayset);
+  if (src_path) free(src_path);
+  src_path = 0;
 
-    walk(entry);
-    addtoincs(entry);
+  walk(entry);
+  addtoincs(entry);
 
-    fprintf(out_js, "%s", "\
+  /* What comes before and after the language is the same in all bundles */
+  head.len = decls.len = 0;
+  addstr(&decls, "\
 function inherit(childCtor, parentCtor) {\
 /** @constructor */\
 function tempCtor() {};\
@@ -75,170 +223,494 @@ return typeof args[number] != 'undefined' ? args[number] : match;});};}\
 if (!String.prototype.paddingLeft) { String.prototype.paddingLeft =\
 function(paddingValue) { return String(paddingValue + this).slice(\
 -paddingValue.length); };}");
+  if (level) um_minify_js(decls.buf, decls.len, level, &head, 0);
+  else um_buf_add(&head, decls.buf, decls.len);
+  decls.len = 0;
+
+  addstr(&decls, "var RES_PATH = '");
+  addstr(&decls, res_path);
+  addstr(&decls, "';");
+
+  qsort(names, namessize, sizeof(char*), comparator);
+  for (i = 0; i < namessize; i++)
+  {
+    for (j = 0; j < (int)strlen(names[i]); j++)
+    {
+      if (names[i][j] == '.')
+      {
+        flag = 1;
+        break;
+      }
+    }
+    if (!flag) addstr(&decls, "var ");
+    addstr(&decls, names[i]);
+    addstr(&decls, " = new Object();\n");
+    flag = 0;
+  }
 
-    if (strcmp("multi", lang)) fprintf(out_js, "var lang = '%s';", lang);
-    else fprintf(out_js, "var lang = '%s';", "");
+  /* Sources are walked once, and the bundle of each language takes them
+     with its own Sayings. The CSS does not depend on the language. */
+  for (i = 0; i < langssize; i++)
+  {
+    lang = langs[i];
+    js_path = out_js_path;
+    if (langssize > 1 && out_js_path) js_path = langpath(out_js_path, lang);
+    css_path = i ? 0 : out_css_path;
 
-    fprintf(out_js, "var RES_PATH = '%s';", res_path);
+    if (!out_js_path || js_path) writebundle(js_path, css_path);
+    if (manifest_path && js_path)
+    {
+      mapname = map_path ? addhashed(map_path, 0) : 0;
+      free(addhashed(js_path, mapname));
+      free(mapname);
+    }
+    if (manifest_path && css_path) free(addhashed(css_path, 0));
+    if (js_path != out_js_path) free(js_path);
+  }
 
-    qsort(names, namessize, sizeof(char*), comparator);
-    for (i = 0; i < namessize; i++)
+  /* The manifest is only written when a name changes, so that whatever
+     watches it is not woken up for nothing */
+  if (manifest_path)
+  {
+    addstr(&manifest, manifest.len ? "\n}\n" : "{\n}\n");
+    data = stat(manifest_path, &info) ? 0 : um_readfile(manifest_path, &len);
+    if (!data || len != manifest.len || memcmp(data, manifest.buf, len))
     {
-      for (j = 0; j < (int)strlen(names[i]); j++)
+      if (fp = fopen(manifest_path, "w"))
       {
-        if (names[i][j] == '.')
-        {
-          flag = 1;
-          break;
-        }
+        fwrite(manifest.buf, 1, manifest.len, fp);
+        fclose(fp);
       }
-      if (!flag) fprintf(out_js, "var %s = new Object();\n", names[i]);
-      else fprintf(out_js, "%s = new Object();\n", names[i]);
-      free(names[i]);
-      flag = 0;
+      else fprintf(stderr, "Error writing: %s\n", manifest_path);
     }
-    free(names);
+    free(data);
+    manifest.len = 0;
+  }
+}
 
-    for (i = 0; i < incssize; i++)
+/* Copy an output to the name with "h-" and the hash of its contents before
+   the extension, e.g. App.js to App.h-1a2b3c4d.js and App.js.map to
+   App.js.h-5e6f7a8b.map, unless it is there already, and add both names to
+   the manifest. If mapname is given, the copy refers to that source map
+   instead, so that a cached bundle keeps its own map.
+   Return the new name, without the directory, or 0. */
+char *addhashed(const char *path, const char *mapname)
+{
+  static const char url[] = "\n//# sourceMappingURL=";
+  unsigned long long h;
+  struct stat info;
+  struct um_buf copy;
+  const char *name, *ptr;
+  char *data, *hashed, hex[11];
+  size_t len = 0;
+  FILE *fp;
+
+  if (!(data = um_readfile(path, &len))) return 0;
+
+  memset(&copy, 0, sizeof(copy));
+  for (ptr = data; mapname && (ptr = strstr(ptr, url)); ptr++)
+  {
+    copy.len = 0;
+    um_buf_add(&copy, data, ptr - data);
+    addstr(&copy, url);
+    addstr(&copy, mapname);
+    addstr(&copy, "\n");
+  }
+  if (copy.len)
+  {
+    free(data);
+    data = copy.buf;
+    len = copy.len;
+  }
+
+  h = um_hash64(data, len, 0);
+  sprintf(hex, "h-%08x", (unsigned int)(h ^ (h >> 32)) & 0xffffffff);
+
+  if (hashed = langpath(path, hex))
+  {
+    if (stat(hashed, &info))
     {
-      if (ptr = strrchr(incs[i], '.'))
+      if ((fp = fopen(hashed, "w")) && fwrite(data, 1, len, fp) == len)
       {
-        if (out_js && !strcmp(ptr, ".js")) writeto(incs[i], out_js);
-        else if (out_css && !strcmp(ptr, ".css")) writeto(incs[i], out_css);
+        fclose(fp);
+      }
+      else
+      {
+        if (fp) fclose(fp);
+        fprintf(stderr, "Error writing: %s\n", hashed);
       }
-      free(incs[i]);
     }
-    free(incs);
 
-    fclose(out_js);
-    if (out_css) fclose(out_css);
-    if (src_path) free(src_path);
+    for (name = path + strlen(path);
+         name > path && name[-1] != '/' && name[-1] != '\\'; name--) ;
+    ptr = hashed + (name - path);
+    memmove(hashed, ptr, strlen(ptr) + 1);
+    addstr(&manifest, manifest.len ? ",\n  \"" : "{\n  \"");
+    addstr(&manifest, name);
+    addstr(&manifest, "\": \"");
+    addstr(&manifest, hashed);
+    addstr(&manifest, "\"");
   }
+  free(data);
 
-  return 0;
+  return hashed;
+}
+
+/* Write the bundle of the current language, and the CSS if css_path is
+   given, unless the arguments and all inputs are the same as when they
+   were last written */
+void writebundle(const char *js_path, const char *css_path)
+{
+  struct um_srcmap map;
+  struct um_buf langline;
+  unsigned long long sig = 0;
+  const char *file;
+  char *ptr;
+  int i = 0;
+
+  free(bundle);
+  bundle = 0;
+  bundlelen = bundlesize = 0;
+  um_set_free(&bundleset);
+
+  for (i = 0; i < incssize; i++)
+  {
+    if (incs[i]) addtobundle(incs[i]);
+    else addlangsayings();
+  }
+
+  /* The signature covers the build, through the output version, what comes
+     before the modules, and every module */
+  sig = um_hash64(UM_OUTPUT_VERSION, sizeof(UM_OUTPUT_VERSION), sig);
+  for (i = 1; i < nargs; i++) sig = um_hash64(args[i], strlen(args[i]) + 1, sig);
+  sig = um_hash64(lang, strlen(lang) + 1, sig);
+  sig = um_hash64(head.buf, head.len, sig);
+  sig = um_hash64(decls.buf, decls.len, sig);
+  for (i = 0; i < bundlesize; i++)
+  {
+    sig = um_hash64(bundle[i], strlen(bundle[i]) + 1, sig);
+    sig ^= filehash(bundle[i]);
+  }
+
+  /* The source map goes next to the bundle, with .map added */
+  free(map_path);
+  map_path = 0;
+  if (mapping && js_path &&
+      (map_path = (char *)malloc(strlen(js_path) + 5)))
+  {
+    strcat(strcpy(map_path, js_path), ".map");
+  }
+
+  if (uptodate(js_path, sig) && (!css_path || uptodate(css_path, sig)) &&
+      (!map_path || uptodate(map_path, sig))) return;
+
+  out_js = js_path ? fopen(js_path, "w") : 0;
+  out_css = css_path ? fopen(css_path, "w") : 0;
+  if (!out_js) out_js = stdout;
+  memset(&map, 0, sizeof(map));
+  memset(&langline, 0, sizeof(langline));
+
+  addstr(&langline, "var lang = '");
+  addstr(&langline, strcmp("multi", lang) ? lang : "");
+  addstr(&langline, "';");
+  fwrite(head.buf, 1, head.len, out_js);
+  fwrite(langline.buf, 1, langline.len, out_js);
+  fwrite(decls.buf, 1, decls.len, out_js);
+  um_srcmap_text(&map, head.buf, head.len);
+  um_srcmap_text(&map, langline.buf, langline.len);
+  um_srcmap_text(&map, decls.buf, decls.len);
+  um_buf_free(&langline);
+
+  for (i = 0; i < bundlesize; i++)
+  {
+    if (ptr = strrchr(bundle[i], '.'))
+    {
+      if (out_js && !strcmp(ptr, ".js"))
+      {
+        writeto(bundle[i], out_js, map_path ? &map : 0);
+      }
+      else if (out_css && !strcmp(ptr, ".css")) writeto(bundle[i], out_css, 0);
+    }
+  }
+
+  if (map_path)
+  {
+    for (file = js_path + strlen(js_path);
+         file > js_path && file[-1] != '/' && file[-1] != '\\'; file--) ;
+    fprintf(out_js, "\n//# sourceMappingURL=%s.map\n", file);
+    if (!um_srcmap_write(&map, map_path, file))
+    {
+      fprintf(stderr, "Error writing: %s\n", map_path);
+    }
+  }
+  um_srcmap_free(&map);
+
+  if (out_js != stdout) fclose(out_js);
+  else fflush(out_js);
+  if (out_css) fclose(out_css);
+  if (out_js != stdout) setuptodate(js_path, sig);
+  if (out_css) setuptodate(css_path, sig);
+  if (map_path) setuptodate(map_path, sig);
+  if (watching) fprintf(stderr, "Compiled: %s\n", js_path ? js_path : entry);
+}
+
+/* Output path of one language when there are several: the language goes
+   before the extension, e.g. App.js becomes App.en.js */
+char *langpath(const char *path, const char *lang)
+{
+  const char *ext = strrchr(path, '.');
+  char *p;
+
+  if (!ext || strpbrk(ext, "/\\")) ext = path + strlen(path);
+  if (p = (char *)malloc(strlen(path) + strlen(lang) + 2))
+  {
+    memcpy(p, path, ext - path);
+    p[ext - path] = '.';
+    strcpy(strcpy(p + (ext - path) + 1, lang) + strlen(lang), ext);
+  }
+  else fprintf(stderr, "Memory not allocated");
+
+  return p;
+}
+
+void addstr(struct um_buf *out, const char *s)
+{
+  um_buf_add(out, s, strlen(s));
+}
+
+/* Whether one of the changed paths is an input, or in a Sayings directory
+   where a file may have appeared */
+int affected(const struct um_buf *changed)
+{
+  const char *p;
+  char *dir;
+  int r = 0;
+
+  for (p = changed->buf; !r && p < changed->buf + changed->len;
+       p += strlen(p) + 1)
+  {
+    if (!*p || um_set_find(&incset, p) || um_set_find(&sayset, p)) r = 1;
+    else if (dir = dirof(p))
+    {
+      r = um_set_find(&sayset, dir) != 0;
+      free(dir);
+    }
+  }
+
+  return r;
+}
+
+char *dirof(const char *fname)
+{
+  const char *p = fname + strlen(fname);
+  char *dir;
+
+  while (p > fname && p[-1] != '/' && p[-1] != '\\') p--;
+  if (p > fname) p--;
+  else
+  {
+    fname = ".";
+    p = fname + 1;
+  }
+
+  if (dir = (char *)malloc(p - fname + 1))
+  {
+    memcpy(dir, fname, p - fname);
+    dir[p - fname] = '\0';
+  }
+  else fprintf(stderr, "Memory not allocated");
+
+  return dir;
 }
 
 void walk(const char *fname)
 {
-  FILE *fp;
-  char *include = "include ( |";
-  char *buffer = 0, *buffer2 = 0, *buffer3 = 0; int buflen = 0;
+  struct um_cache_entry *ce;
+  struct source *src;
+  struct um_buf found;
+  struct stat info;
+  const char *inc, *incs = 0;
+  char *path;
+  int i, n = 0, statok;
+
+  /* Each file is scanned once per compile, even if it includes itself in a
+     cycle. Its contents are kept for writeto(), and for the next compile
+     while the file stays the same. */
+  if ((src = findsource(fname)) && src->gen == gen) return;
+  if (!src && !(src = addsource(fname))) return;
+  src->gen = gen;
+  memset(&found, 0, sizeof(found));
+
+  statok = !stat(fname, &info);
+  if (src->data &&
+      (!statok || src->mtime != um_mtime(&info) || src->size != info.st_size))
+  {
+    free(src->data);
+    free(src->min);
+    src->data = src->min = 0;
+    um_buf_free(&src->marks);
+  }
+  src->mtime = statok ? um_mtime(&info) : -1;
+  src->size = statok ? info.st_size : -1;
+  if (watching)
+  {
+    if (path = dirof(fname)) um_watch_dir(&watch, path);
+    free(path);
+  }
+
+  /* Files unchanged since the cache was written are not read at all */
+  if (statok && (ce = um_cache_find(&cache, fname, &info)) && ce->parsed)
+  {
+    src->hash = ce->hash;
+    incs = ce->incs;
+    n = ce->num_incs;
+  }
+  else if (src->data || (src->data = um_readfile(fname, &src->len)))
+  {
+    src->hash = um_hash64(src->data, src->len, 0);
+    n = um_scan_includes(src->data, src->len, &found);
+    incs = found.buf ? found.buf : "";
+    if (statok) um_cache_put(&cache, fname, &info, src->hash, incs, found.len, n);
+  }
+
+  for (i = 0, inc = incs; i < n; i++, inc += strlen(inc) + 1)
+  {
+    if (!src_path && !takesrcpath(fname, inc)) break;
+    addtonames(inc);
+
+    if (!(path = (char *)malloc(strlen(src_path) + strlen(inc) + 1)))
+    {
+      fprintf(stderr, "Memory not allocated");
+      break;
+    }
+    strcat(strcpy(path, src_path), inc);
+
+    walk(path);
+    addtoincs(path);
+    if (!strcmp("Sayings/Base.js", inc)) addtoincs(0);
+
+    free(path);
+  }
+
+  um_buf_free(&found);
+}
+
+/* Add Sayings of the language from each directory between src_path and
+   the entry point */
+void addlangsayings()
+{
+  char *buffer2 = 0, *buffer3 = 0;
   char *bufsay = 0, *bufp = 0, *startbuf = 0;
-  int i = 0, ininc = 0, incomm = 0, incomn = 0, size = 0;
-  char bch, ch = 1;
 
-  if (fp = fopen(fname, "r"))
+  buffer3 = (char*)malloc(strlen(entry) +
+      strlen("/Sayings/") + strlen(lang) + 1);
+  buffer2 = (char*)malloc(strlen(entry) +
+      strlen("/Sayings/") + strlen(lang) + 1);
+  bufsay = (char*)malloc(strlen(entry) +
+      strlen("/Sayings/") + strlen(lang) + 1);
+  startbuf = bufsay;
+
+  if (buffer2 && bufsay)
   {
-    if (buffer = (char *)malloc(buflen = strlen(fname) + 100))
+    strcpy(buffer2, src_path);
+    strcpy(bufsay, entry);
+    bufp = strrchr(bufsay, '/');
+    if (bufp) bufsay[bufp - bufsay + 1] = '\0';
+    bufsay += strlen(src_path);
+
+    while (strlen(bufsay) > 0)
     {
-      while ((bch = ch) && (ch = fgetc(fp)) != -1)
+      bufp = strchr(bufsay, '/');
+      if (!bufp) bufp = strchr(bufsay, '\0');
+
+      if (bufp)
       {
-        if (!incomm && bch == '/' && ch == '*') { incomm = 1; continue; }
-        if (incomm && bch == '*' && ch == '/') { incomm = 0; continue; }
-        if (!incomn && bch == '/' && ch == '/') { incomn = 1; continue; }
-        if (incomn && ch == '\n') { incomn = 0; continue; }
+        if (bufp[0] == '/') bufp++;
+        strncat(buffer2, bufsay, bufp - bufsay);
+        bufsay = bufp;
+      }
 
-        if (!incomm && !incomn)
-        {
-          if (!ininc)
-          {
-            if (include[i] == ' ')
-            {
-              if (isspace(ch)) continue;
-              i++;
-            }
-            if (include[i] == ch) i++;
-            else
-            {
-              if (include[i] == '|' && (ch == '\'' || ch == '"'))
-              {
-                ininc = 1;
-                size = 0;
-              }
-              i = 0;
-            }
-          }
-          else
-          {
-            if (ch == '\'' || ch == '"')
-            {
-              if (!src_path && !(buffer[size] = '\0') &&
-                  !takesrcpath(fname, buffer)) break;
-              buffer[size] = '\0'; addtonames(buffer); buffer[size] = ' ';
-              memmove(buffer + strlen(src_path), buffer, size);
-              strncpy(buffer, src_path, strlen(src_path));
-              buffer[size + strlen(src_path)] = '\0';
-
-              walk(buffer);
-              addtoincs(buffer);
-
-              if (!strcmp("Sayings/Base.js", (buffer + strlen(src_path))))
-              {
-                buffer3 = (char*)malloc(strlen(entry) +
-                    strlen("/Sayings/") + strlen(lang) + 1);
-                buffer2 = (char*)malloc(strlen(entry) +
-                    strlen("/Sayings/") + strlen(lang) + 1);
-                bufsay = (char*)malloc(strlen(entry) +
-                    strlen("/Sayings/") + strlen(lang) + 1);
-                startbuf = bufsay;
-
-                if (buffer2 && bufsay)
-                {
-                  strcpy(buffer2, src_path);
-                  strcpy(bufsay, entry);
-                  bufp = strrchr(bufsay, '/');
-                  if (bufp) bufsay[bufp - bufsay + 1] = '\0';
-                  bufsay += strlen(src_path);
-
-                  while (strlen(bufsay) > 0)
-                  {
-                    bufp = strchr(bufsay, '/');
-                    if (!bufp) bufp = strchr(bufsay, '\0');
-
-                    if (bufp)
-                    {
-                      if (bufp[0] == '/') bufp++;
-                      strncat(buffer2, bufsay, bufp - bufsay);
-                      bufsay = bufp;
-                    }
-
-                    strcpy(buffer3, buffer2);
-                    strcat(buffer3, "Sayings");
-                    if (strcmp(lang, "multi"))
-                    {
-                      strcat(buffer3, "/");
-                      strcat(buffer3, lang);
-                    }
-
-                    addsayings(buffer3);
-                  }
-
-                  if (buffer3) free(buffer3);
-                  if (buffer2) free(buffer2);
-                  if (startbuf) free(startbuf);
-                }
-              }
-
-              ininc = 0;
-              continue;
-            }
-            if (((buflen - strlen(fname)) - size) <= 2)
-            {
-              buflen = 2 * size;
-              if (!(buffer = (char *)realloc(buffer, buflen))) break;
-            }
-            buffer[size++] = ch;
-          }
-        }
+      strcpy(buffer3, buffer2);
+      strcat(buffer3, "Sayings");
+      if (strcmp(lang, "multi"))
+      {
+        strcat(buffer3, "/");
+        strcat(buffer3, lang);
       }
+
+      addsayings(buffer3);
     }
+  }
+
+  if (buffer3) free(buffer3);
+  if (buffer2) free(buffer2);
+  if (startbuf) free(startbuf);
+}
 
-    if (buffer) free(buffer);
-    else fprintf(stderr, "Memory not allocated");
+/* Content hash of an output input, from the cache if the file has not
+   changed. Sayings are never walked, so they only get here. */
+unsigned long long filehash(const char *fname)
+{
+  struct source *src = findsource(fname);
+  struct um_cache_entry *ce;
+  struct stat info;
+  unsigned long long hash = 0;
+  char *data;
+  size_t len = 0;
 
-    fclose(fp);
+  if (src && src->gen == gen) return src->hash;
+  if (stat(fname, &info)) return 0;
+  if (ce = um_cache_find(&cache, fname, &info)) return ce->hash;
+  if (data = um_readfile(fname, &len))
+  {
+    hash = um_hash64(data, len, 0);
+    um_cache_put(&cache, fname, &info, hash, 0, 0, 0);
+    free(data);
   }
-  else fprintf(stderr, "Error opening: %s\n", fname);
+
+  return hash;
+}
+
+int uptodate(const char *fname, unsigned long long sig)
+{
+  struct um_cache_entry *ce;
+  struct stat info;
+
+  return fname && !stat(fname, &info) &&
+    (ce = um_cache_find(&cache, fname, &info)) && ce->hash == sig;
+}
+
+void setuptodate(const char *fname, unsigned long long sig)
+{
+  struct stat info;
+
+  if (fname && !stat(fname, &info)) um_cache_put(&cache, fname, &info, sig, 0, 0, 0);
+}
+
+struct source *findsource(const char *fname)
+{
+  struct um_entry *e = um_set_find(&srcset, fname);
+  return e ? &srcs[e->value] : 0;
+}
+
+struct source *addsource(const char *fname)
+{
+  struct source *src, *p;
+  struct um_entry *e;
+
+  if ((p = (struct source *)
+       um_grow(srcs, &srcslen, srcssize, sizeof *srcs)) &&
+      (e = um_set_add(&srcset, fname, srcssize, 0)))
+  {
+    srcs = p;
+    src = &srcs[srcssize++];
+    memset(src, 0, sizeof *src);
+    src->path = (char *)e->key;
+    return src;
+  }
+  if (p) srcs = p;
+  fprintf(stderr, "Memory not allocated");
+  return 0;
 }
 
 int takesrcpath(const char *fname, const char *include)
@@ -281,26 +753,48 @@ int takesrcpath(const char *fname, const char *include)
 
 void addtoincs(const char *fname)
 {
-  int i = 0;
-  for (i = 0; i < incssize; i++)
+  struct um_entry *e;
+  char **p;
+
+  /* 0 marks where the Sayings of each language go */
+  if (fname && um_set_find(&incset, fname)) return;
+  if ((p = (char **)um_grow(incs, &incslen, incssize, sizeof *incs)) &&
+      (!fname || (e = um_set_add(&incset, fname, incssize, 0))))
+  {
+    incs = p;
+    incs[incssize++] = fname ? (char *)e->key : 0;
+  }
+  else
   {
-    if (strcmp(incs[i], fname) == 0) return;
+    if (p) incs = p;
+    fprintf(stderr, "Memory not allocated");
   }
-  if ((incslen - incssize) <= 2)
+}
+
+void addtobundle(const char *fname)
+{
+  struct um_entry *e;
+  char **p;
+
+  if (um_set_find(&bundleset, fname)) return;
+  if ((p = (char **)um_grow(bundle, &bundlelen, bundlesize, sizeof *bundle)) &&
+      (e = um_set_add(&bundleset, fname, bundlesize, 0)))
   {
-    incslen += 50;
-    incs = (char **)realloc(incs, incslen * (sizeof *incs));
+    bundle = p;
+    bundle[bundlesize++] = (char *)e->key;
   }
-  if (incs && (incs[incssize] = (char *)malloc(strlen(fname) + 1)))
+  else
   {
-    strcpy(incs[incssize++], fname);
+    if (p) bundle = p;
+    fprintf(stderr, "Memory not allocated");
   }
-  else fprintf(stderr, "Memory not allocated");
 }
 
 void addtonames(const char *nsp)
 {
-  int i = 0, j = 0, flag = 0;
+  struct um_entry *e;
+  char **p;
+  int i = 0, flag = 0;
   char *buffer = (char*)malloc(strlen(nsp) + 1);
   strcpy(buffer, nsp);
 
@@ -329,25 +823,24 @@ void addtonames(const char *nsp)
       {
         buffer[i] = '\0';
 
-        for (j = 0; j < namessize; j++)
+        if (um_set_find(&nameset, buffer))
         {
-          if (strcmp(names[j], buffer) == 0)
-          {
-            free(buffer);
-            return;
-          }
+          free(buffer);
+          return;
         }
 
-        if ((nameslen - namessize) <= 2)
+        if ((p = (char **)um_grow(names, &nameslen, namessize,
+                                  sizeof *names)) &&
+            (e = um_set_add(&nameset, buffer, namessize, 0)))
         {
-          nameslen += 50;
-          names = (char **)realloc(names, nameslen * (sizeof *names));
+          names = p;
+          names[namessize++] = (char *)e->key;
         }
-        if (names && (names[namessize] = (char *)malloc(strlen(buffer) + 1)))
+        else
         {
-          strcpy(names[namessize++], buffer);
+          if (p) names = p;
+          fprintf(stderr, "Memory not allocated");
         }
-        else fprintf(stderr, "Memory not allocated");
       }
     }
   }
@@ -363,8 +856,10 @@ void addsayings(const char *root)
   char *path = 0, *ptr = 0;
   int size = 0, csize = 0;
 
+  um_set_add(&sayset, root, 0, 0);
   if (dir = opendir(root))
   {
+    if (watching) um_watch_dir(&watch, root);
     if (path = (char*)malloc(size = strlen(root) + 50))
     {
       while (entry = readdir(dir))
@@ -384,7 +879,7 @@ void addsayings(const char *root)
           stat(path, &info);
 
           if ((info.st_mode & S_IFMT) == S_IFDIR) addsayings(path);
-          else if (ptr) { addtoincs(path); printf("%s\n", path); }
+          else if (ptr) { addtobundle(path); printf("%s\n", path); }
         }
       }
     }
@@ -393,30 +888,160 @@ void addsayings(const char *root)
   }
 }
 
-void writeto(const char *fname, FILE *fpout)
+void writeto(const char *fname, FILE *fpout, struct um_srcmap *map)
 {
-  FILE *fp;
-  char ch;
+  struct source *src = findsource(fname);
+  struct um_buf min, marks;
+  const char *text;
+  char *data, *ptr;
+  size_t len = 0, textlen;
+
+  /* Only sources walked in this compile are known to be current */
+  if (src && src->gen != gen) src = 0;
+  if (src && !src->data) src->data = um_readfile(fname, &src->len);
+  if (src) data = src->data, len = src->len;
+  else data = um_readfile(fname, &len);
+  if (!data) return;
 
-  if (fp = fopen(fname, "r"))
+  text = data;
+  textlen = len;
+  memset(&min, 0, sizeof(min));
+  memset(&marks, 0, sizeof(marks));
+
+  /* Minified sources are kept, for the other bundles and the next compile */
+  if (level && src && src->min)
+  {
+    text = src->min;
+    textlen = src->minlen;
+    marks = src->marks;
+  }
+  else if (level)
   {
-    while ((ch = fgetc(fp)) != -1)
+    if ((ptr = strrchr(fname, '.')) && !strcmp(ptr, ".css"))
     {
-      fprintf(fpout, "%c", ch);
+      um_minify_css(data, len, level, &min, mapping ? &marks : 0);
     }
-    fclose(fp);
+    else um_minify_js(data, len, level, &min, mapping ? &marks : 0);
+
+    text = min.buf;
+    textlen = min.len;
+    if (src)
+    {
+      src->min = min.buf;
+      src->minlen = min.len;
+      src->marks = marks;
+    }
+  }
+
+  if (text) fwrite(text, 1, textlen, fpout);
+  if (map && text) mapsource(map, fname, data, len, text, textlen,
+                             level ? &marks : 0);
+
+  if (!src)
+  {
+    free(data);
+    um_buf_free(&min);
+    um_buf_free(&marks);
+  }
+}
+
+/* Add what was written of a source to the map: line by line if it was
+   copied as it is, token by token if it was minified */
+void mapsource(struct um_srcmap *map, const char *fname, const char *data,
+               size_t len, const char *text, size_t textlen,
+               const struct um_buf *marks)
+{
+  const size_t *m;
+  const char *p, *q, *end = text + textlen;
+  size_t i, n, out = 0, in = 0;
+  char *path;
+  int src, line = 0, col = 0;
+
+  path = relpath(map_path, fname);
+  src = um_srcmap_source(map, path ? path : fname);
+  free(path);
+
+  if (!marks)
+  {
+    for (p = text; p < end; p = q, line++)
+    {
+      q = (q = (const char *)memchr(p, '\n', end - p)) ? q + 1 : end;
+      if (*p != '\n') um_srcmap_mark(map, src, line, 0);
+      um_srcmap_text(map, p, q - p);
+    }
+    return;
   }
-  else fprintf(stderr, "Error opening: %s\n", fname);
+
+  m = (const size_t *)marks->buf;
+  n = marks->len / (2 * sizeof(size_t));
+  for (i = 0; i < n; i++)
+  {
+    um_srcmap_text(map, text + out, m[2 * i] - out);
+    out = m[2 * i];
+    for (; in < m[2 * i + 1] && in < len; in++)
+    {
+      if (data[in] == '\n') line++, col = 0;
+      else if ((data[in] & 0xc0) != 0x80) col++;
+    }
+    um_srcmap_mark(map, src, line, col);
+  }
+  um_srcmap_text(map, text + out, textlen - out);
+}
+
+/* Path, relative to the current directory, as seen from the directory of
+   the file from. Return 0, to keep it as it is, unless both are relative
+   and go down from the current directory only. */
+char *relpath(const char *from, const char *path)
+{
+  const char *f = from, *p = path, *s;
+  char *rel;
+  int ups = 0;
+
+  if (*from == '/' || *from == '\\' || strchr(from, ':') ||
+      *path == '/' || *path == '\\' || strchr(path, ':') ||
+      strstr(from, "..") || strstr(path, "..")) return 0;
+
+  /* Skip the directories both have in common */
+  for (;;)
+  {
+    for (s = f; *s && *s != '/' && *s != '\\'; s++) ;
+    if (!*s || strncmp(f, p, s - f + 1)) break;
+    p += s - f + 1;
+    f = s + 1;
+  }
+  for (s = f; *s; s++) if (*s == '/' || *s == '\\') ups++;
+
+  if (rel = (char *)malloc(3 * ups + strlen(p) + 1))
+  {
+    for (*rel = '\0'; ups > 0; ups--) strcat(rel, "../");
+    strcat(rel, p);
+  }
+
+  return rel;
 }
 
 void showhelp()
 {
   printf("\
-Usage: umcomp.exe [ENTRY_POINT] -out_js [OUTPUT_JAVASCRIPT] -out_css [OUTPUT_CSS]\n\
+Usage: umcomp.exe [ENTRY_POINT] -out_js [OUTPUT_JAVASCRIPT] -out_css [OUTPUT_CSS] -level [COMPILATION_LEVEL] -map -manifest [MANIFEST_FILE] -cache [CACHE_FILE] -watch\n\
 Take the [ENTRY_POINT] and the subsequent included files, and compile using \
 the [COMPILATION_LEVEL]. The final results are output to [OUTPUT_JAVASCRIPT] \
 and [OUTPUT_CSS] files, respectively. If no output file is specified, the \
-compiled JavaScript is output to STDOUT.\n\n\
+compiled JavaScript is output to STDOUT. The [COMPILATION_LEVEL] is 0 to copy \
+the sources as they are (the default), 1 to remove comments, and 2 to also \
+remove whitespace where it is not needed. With -map, a source map is written \
+next to each JavaScript output, with .map added to its name. With -manifest, \
+each output is also copied to a name with h- and the hash of its contents \
+before the extension, e.g. App.h-1a2b3c4d.js and App.js.h-5e6f7a8b.map, and \
+[MANIFEST_FILE] maps the names to the hashed ones, in JSON. Hashed copies can \
+be served with far-future cache headers by umserver, with its \
+immutable_pattern option set to \
+**.h-????????.js$|**.h-????????.css$|**.h-????????.map$, which matches only \
+these names. Old copies are kept, for the pages that still refer to them. Several languages can be given, separated by commas, \
+e.g. en,pt: the sources are then read once, and each language gets its own \
+JavaScript output, named with the language before the extension. With -watch, \
+the sources are kept in memory and compiled again whenever one of them \
+changes, until interrupted.\n\n\
 Example 1: umcomp.exe ./src/store/main.js -out_js ./out/store.min.js -out_css ./out/store.min.css\n\n\
 Example 2: umcomp.exe ./src/store/main.js > ./out/store.min.js\n");
 }
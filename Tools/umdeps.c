@@ -14,20 +14,67 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include "umlib.h"
 
+struct depfile
+{
+  const char *path;
+  const char *lib;      /* Library it was found in, for Sayings */
+  struct um_buf out;    /* Its addDep() line */
+  struct stat info;
+  int scanned;          /* Read, so its cache entry is put by main() */
+  unsigned long long hash;
+  struct um_buf incs;
+  int num_incs;
+};
+
+void build(int threads);
+int affected(const struct um_buf *changed);
+void addstr(struct um_buf *out, const char *s);
 void walk(const char *root);
 void adddep(const char *jsfile);
-void addsayings(const char *root);
+void scandep(void *param, int i);
+void addsayings(const char *root, struct um_buf *out);
+int issaybase(const char *include);
 void showhelp();
 
 char *srcpath = 0;
 char *respath = 0;
 char *lang = 0;
 char *curlib = 0;
+const char *walklib = 0;
+struct um_set deps;
+struct um_arena strs;
+struct depfile *files = 0;
+int fileslen = 0, filessize = 0;
+struct um_cache cache;
+struct um_watch watch;
+struct um_buf last;     /* Output of the previous build */
+char **libs = 0;
+int numlibs = 0;
+char *out_path = 0;
+int watching = 0;
+
 int main(int argc, char *argv[])
 {
   int b = 0;
   int n = 0;
+  int threads = 1;
+  char *cache_path = 0;
+  struct um_buf changed;
+
+  /* Take out -j [THREADS], files are then scanned in parallel, -cache
+     [CACHE_FILE], -out [OUTPUT] and -watch */
+  for (n = b = 1; n < argc; n++)
+  {
+    if (!strcmp(argv[n], "-j") && n + 1 < argc) threads = atoi(argv[++n]);
+    else if (!strcmp(argv[n], "-cache") && n + 1 < argc) cache_path = argv[++n];
+    else if (!strcmp(argv[n], "-out") && n + 1 < argc) out_path = argv[++n];
+    else if (!strcmp(argv[n], "-watch")) watching = 1;
+    else argv[b++] = argv[n];
+  }
+  argc = b;
+  if (threads < 1) threads = 1;
 
   if (argc == 1 || !strcmp(argv[1], "-h"))
   {
@@ -38,43 +85,160 @@ int main(int argc, char *argv[])
     srcpath = argv[1];
     respath = argv[2];
     lang = argv[3];
+    libs = argv + 4;
+    numlibs = argc - 4;
     b = strlen(srcpath) - 1;
     if (strchr("/\\", srcpath[b])) srcpath[b] = 0;
-    fprintf(stdout, "// THIS FILE IS AUTO-GENERATED BY UMDEPS.\n");
-    fprintf(stdout, "SRC_PATH = '%s';\n", srcpath);
-    fprintf(stdout, "RES_PATH = '%s';\n", respath);
-    if (strcmp(lang, "multi"))
+
+    if (watching && !um_watch_init(&watch))
     {
-      fprintf(stdout, "lang = '%s';\n", lang);
+      fprintf(stderr, "Watching is not supported on this system\n");
+      watching = 0;
     }
+    um_cache_load(&cache, cache_path ? cache_path : watching ? "" : 0);
+
+    build(threads);
+    um_cache_save(&cache);
 
-    if (argc <= 4)
+    /* File scans stay in memory, and the graph is built again as soon as a
+       file is changed, added or removed */
+    memset(&changed, 0, sizeof(changed));
+    while (watching && um_watch_wait(&watch, &changed) > 0)
     {
-      walk(srcpath);
+      if (affected(&changed))
+      {
+        build(threads);
+        um_cache_save(&cache);
+      }
+      changed.len = 0;
     }
-    else
+    um_buf_free(&changed);
+    um_watch_free(&watch);
+    um_cache_free(&cache);
+    um_buf_free(&last);
+
+    free(files);
+    um_set_free(&deps);
+    um_arena_free(&strs);
+  }
+
+  return 0;
+}
+
+/* List and scan the files, then output the graph. With -out, the file is
+   only written if the graph has changed since the last build. */
+void build(int threads)
+{
+  struct um_buf res;
+  struct depfile *file;
+  FILE *fp;
+  int b = 0;
+  int n = 0;
+
+  filessize = 0;
+  um_set_free(&deps);
+  um_arena_free(&strs);
+  memset(&res, 0, sizeof(res));
+
+  addstr(&res, "// THIS FILE IS AUTO-GENERATED BY UMDEPS.\n");
+  addstr(&res, "SRC_PATH = '");
+  addstr(&res, srcpath);
+  addstr(&res, "';\nRES_PATH = '");
+  addstr(&res, respath);
+  addstr(&res, "';\n");
+  if (strcmp(lang, "multi"))
+  {
+    addstr(&res, "lang = '");
+    addstr(&res, lang);
+    addstr(&res, "';\n");
+  }
+
+  if (!numlibs)
+  {
+    walklib = 0;
+    walk(srcpath);
+  }
+  else
+  {
+    for (n = 0; n < numlibs; n++)
     {
-      b = 0;
-      for (n = 4; n < argc; n++)
+      if (((strlen(srcpath)+strlen(libs[n])) > (size_t)b))
       {
-        if (((strlen(srcpath)+strlen(argv[n])) > (size_t)b))
-        {
-          b = (strlen(srcpath) + strlen(argv[n])) * 2;
-          if (!(curlib = (char*)realloc(curlib, b))) break;
-        }
-        strcpy(curlib, srcpath);
-        strcat(curlib, "/");
-        strcat(curlib, argv[n]);
-        walk(curlib);
+        b = (strlen(srcpath) + strlen(libs[n])) * 2;
+        if (!(curlib = (char*)realloc(curlib, b))) break;
       }
+      strcpy(curlib, srcpath);
+      strcat(curlib, "/");
+      strcat(curlib, libs[n]);
+      walklib = um_strdup(&strs, curlib);
+      walk(curlib);
+    }
+
+    free(curlib);
+    curlib = 0;
+  }
+
+  /* Files are listed first, then scanned, and printed in listing order
+     whatever the number of threads */
+  um_parallel(filessize, threads, scandep, 0);
+  for (n = 0; n < filessize; n++)
+  {
+    file = &files[n];
+    um_buf_add(&res, file->out.buf, file->out.len);
+    if (file->scanned)
+    {
+      um_cache_put(&cache, file->path, &file->info, file->hash,
+                   file->incs.buf ? file->incs.buf : "", file->incs.len,
+                   file->num_incs);
+    }
+    um_buf_free(&file->out);
+    um_buf_free(&file->incs);
+  }
+
+  if (!out_path)
+  {
+    fwrite(res.buf, 1, res.len, stdout);
+    fflush(stdout);
+  }
+  else if (res.len != last.len || memcmp(res.buf, last.buf, res.len))
+  {
+    if (fp = fopen(out_path, "w"))
+    {
+      fwrite(res.buf, 1, res.len, fp);
+      fclose(fp);
+      if (watching) fprintf(stderr, "Written: %s\n", out_path);
+    }
+    else fprintf(stderr, "Error opening: %s\n", out_path);
+  }
+
+  um_buf_free(&last);
+  last = res;
+}
 
-      free(curlib);
+/* Whether one of the changed paths is a file or directory walk() takes */
+int affected(const struct um_buf *changed)
+{
+  const char *p, *name, *ptr;
+
+  for (p = changed->buf; p < changed->buf + changed->len; p += strlen(p) + 1)
+  {
+    if (!*p) return 1;
+    name = p + strlen(p);
+    while (name > p && name[-1] != '/' && name[-1] != '\\') name--;
+    if (name[0] != '.' && (!(ptr = strrchr(name, '.')) || !strcmp(ptr, ".js")))
+    {
+      return 1;
     }
   }
 
   return 0;
 }
 
+void addstr(struct um_buf *out, const char *s)
+{
+  um_buf_add(out, s, strlen(s));
+}
+
 void walk(const char *root)
 {
   DIR *dir;
@@ -85,6 +249,7 @@ void walk(const char *root)
 
   if (dir = opendir(root))
   {
+    if (watching) um_watch_dir(&watch, root);
     if (path = (char *)malloc(size = strlen(root) + 50))
     {
       while (entry = readdir(dir))
@@ -119,83 +284,99 @@ void walk(const char *root)
 
 void adddep(const char *jsfile)
 {
-  FILE *fp;
-  char *include = "include ( |";
-  char *saybase = "Sayings/Base.js";
-  char *buffer = 0;
-  int saycnt = 0;
-  int i = 0, ininc = 0, incomm = 0, incomn = 0;
-  char bch, ch = 1;
+  struct um_entry *e;
+  struct depfile *p;
+  int added = 0;
+
+  /* Libraries given more than once, or nested, list each file once */
+  if (!(e = um_set_add(&deps, jsfile, filessize, &added)) || !added) return;
 
-  if (fp = fopen(jsfile, "r"))
+  if (p = (struct depfile *)um_grow(files, &fileslen, filessize, sizeof *files))
   {
-    fprintf(stdout, "addDep('%s', [", (jsfile + strlen(srcpath) + 1));
-    while ((bch = ch) && (ch = fgetc(fp)) != -1)
-    {
-      if (!incomm && bch == '/' && ch == '*') { incomm = 1; continue; }
-      if (incomm && bch == '*' && ch == '/') { incomm = 0; continue; }
-      if (!incomn && bch == '/' && ch == '/') { incomn = 1; continue; }
-      if (incomn && ch == '\n') { incomn = 0; continue; }
+    files = p;
+    memset(&files[filessize], 0, sizeof(files[filessize]));
+    files[filessize].path = e->key;
+    files[filessize].lib = walklib;
+    filessize++;
+  }
+  else fprintf(stderr, "Memory not allocated");
+}
 
-      if (!incomm && !incomn)
+void scandep(void *param, int n)
+{
+  struct depfile *file = &files[n];
+  struct um_buf *out = &file->out;
+  struct um_cache_entry *ce;
+  const char *inc = 0;
+  char *buffer = 0, *data;
+  size_t len = 0;
+  int i = 0, num = 0, statok;
+
+  /* Unchanged files are not read. Threads only look the cache up, new
+     scans are put into it by main(). */
+  if ((statok = !stat(file->path, &file->info)) &&
+      (ce = um_cache_find(&cache, file->path, &file->info)) && ce->parsed)
+  {
+    inc = ce->incs;
+    num = ce->num_incs;
+  }
+  else if (data = um_readfile(file->path, &len))
+  {
+    file->hash = um_hash64(data, len, 0);
+    num = file->num_incs = um_scan_includes(data, len, &file->incs);
+    inc = file->incs.buf;
+    file->scanned = statok;
+    free(data);
+  }
+  else return;
+
+  um_buf_add(out, "addDep('", 8);
+  um_buf_add(out, file->path + strlen(srcpath) + 1,
+             strlen(file->path + strlen(srcpath) + 1));
+  um_buf_add(out, "', [", 4);
+  for (i = 0; i < num; i++, inc += strlen(inc) + 1)
+  {
+    um_buf_add(out, "'", 1);
+    um_buf_add(out, inc, strlen(inc));
+    um_buf_add(out, "',", 2);
+    if (file->lib && issaybase(inc))
+    {
+      buffer = (char*)malloc(strlen(file->lib) +
+          strlen("/Sayings/") + strlen(lang) + 1);
+      if (buffer)
       {
-        if (!ininc)
+        strcpy(buffer, file->lib);
+        strcat(buffer, "/Sayings");
+        if (strcmp(lang, "multi"))
         {
-          if (include[i] == ' ')
-          {
-            if (isspace(ch)) continue;
-            i++;
-          }
-          if (include[i] == ch) i++;
-          else
-          {
-            if (include[i] == '|' && (ch == '\'' || ch == '"'))
-            {
-              ininc = 1;
-              fprintf(stdout, "'");
-            }
-            i = 0;
-          }
-        }
-        else
-        {
-          if (ch == '\'' || ch == '"')
-          {
-            fprintf(stdout, "',");
-            ininc = 0;
-            if (saycnt == 15)
-            {
-              buffer = (char*)malloc(strlen(curlib) +
-                  strlen("/Sayings/") + strlen(lang) + 1);
-              if (buffer)
-              {
-                strcpy(buffer, curlib);
-                strcat(buffer, "/Sayings");
-                if (strcmp(lang, "multi"))
-                {
-                  strcat(buffer, "/");
-                  strcat(buffer, lang);
-                }
-                addsayings(buffer);
-                free(buffer);
-              }
-            }
-            saycnt = 0;
-            continue;
-          }
-          if (saybase[saycnt] == ch) saycnt++;
-          else saycnt = 0;
-          fprintf(stdout, "%c", ch);
+          strcat(buffer, "/");
+          strcat(buffer, lang);
         }
+        addsayings(buffer, out);
+        free(buffer);
       }
     }
-    fprintf(stdout, "]);\n");
-    fclose(fp);
   }
-  else fprintf(stderr, "Error opening: %s\n", jsfile);
+  um_buf_add(out, "]);\n", 4);
 }
 
-void addsayings(const char *root)
+/* Whether the include ends with Sayings/Base.js, as matched while reading
+   it: a mismatch starts over from the next character */
+int issaybase(const char *include)
+{
+  char *saybase = "Sayings/Base.js";
+  int saycnt = 0;
+
+  for (; *include; include++)
+  {
+    if (saybase[saycnt] == *include) saycnt++;
+    else saycnt = 0;
+  }
+
+  return saycnt == 15;
+}
+
+void addsayings(const char *root, struct um_buf *out)
 {
   DIR *dir;
   struct dirent *entry;
@@ -223,8 +404,14 @@ void addsayings(const char *root)
           strcat(strcat(path, "/"), entry->d_name);
           stat(path, &info);
 
-          if ((info.st_mode & S_IFMT) == S_IFDIR) addsayings(path);
-          else if (ptr) fprintf(stdout, "'%s',", (path + strlen(srcpath) + 1));
+          if ((info.st_mode & S_IFMT) == S_IFDIR) addsayings(path, out);
+          else if (ptr)
+          {
+            um_buf_add(out, "'", 1);
+            um_buf_add(out, path + strlen(srcpath) + 1,
+                       strlen(path + strlen(srcpath) + 1));
+            um_buf_add(out, "',", 2);
+          }
         }
       }
     }
@@ -240,8 +427,13 @@ void addsayings(const char *root)
 void showhelp()
 {
   printf("\
-Usage: umdeps.exe [INPUT_PATH] [LIBRARY_1] [LIBRARY_2] [LIBRARY_N]\n\
+Usage: umdeps.exe [INPUT_PATH] [LIBRARY_1] [LIBRARY_2] [LIBRARY_N] [-j THREADS] [-cache CACHE_FILE] [-out OUTPUT] [-watch]\n\
 Calculate the dependency graph from [INPUT_PATH] directory, considering only\n\
-the LIBRARY_N libraries, and output the result to STDOUT.\n\n\
+the LIBRARY_N libraries, and output the result to STDOUT. With -j, files are\n\
+scanned on THREADS threads; the output stays the same. With -cache, files\n\
+unchanged since the last run are not read again. With -out, the result goes\n\
+to OUTPUT, which is only rewritten if it has changed. With -watch, scanned\n\
+files are kept in memory and the graph is built again whenever a file is\n\
+changed, added or removed, until interrupted.\n\n\
 Example: umdeps.exe scripts > deps.js\n");
 }
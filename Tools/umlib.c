@@ -0,0 +1,1055 @@
+/*=============================================================================
+
+  This file is part of the Umbrella project.
+  Copyright (C) The Juston.co Owners - All rights reserved.
+
+  For more details, visit http://juston.co/umbrella
+
+==============================================================================*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+typedef HANDLE um_thread;
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t um_thread;
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#include "umlib.h"
+
+#define UM_BLOCK_SIZE (64 * 1024)
+
+struct um_block
+{
+  struct um_block *next;
+};
+
+void *um_alloc(struct um_arena *arena, size_t len)
+{
+  struct um_block *block;
+  size_t size;
+  char *p;
+
+  if (len > arena->left)
+  {
+    size = len > UM_BLOCK_SIZE ? len : UM_BLOCK_SIZE;
+    if (!(block = (struct um_block *)malloc(sizeof(*block) + size))) return 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->ptr = (char *)(block + 1);
+    arena->left = size;
+  }
+
+  p = arena->ptr;
+  arena->ptr += len;
+  arena->left -= len;
+
+  return p;
+}
+
+char *um_strdup(struct um_arena *arena, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *p;
+
+  if (p = (char *)um_alloc(arena, len)) memcpy(p, s, len);
+  return p;
+}
+
+void um_arena_free(struct um_arena *arena)
+{
+  struct um_block *block, *next;
+
+  for (block = arena->blocks; block; block = next)
+  {
+    next = block->next;
+    free(block);
+  }
+  arena->blocks = 0;
+  arena->ptr = 0;
+  arena->left = 0;
+}
+
+void *um_grow(void *array, int *cap, int len, size_t elsize)
+{
+  int size = *cap;
+
+  if (len < size) return array;
+  size = size ? 2 * size : 64;
+  if (!(array = realloc(array, size * elsize))) return 0;
+  *cap = size;
+
+  return array;
+}
+
+static unsigned int um_hash(const char *s)
+{
+  unsigned int hash = 2166136261u;
+  while (*s) hash = (hash ^ (unsigned char)*s++) * 16777619u;
+  return hash;
+}
+
+/* Slot of key, or the empty slot where it would go */
+static struct um_entry *um_slot(const struct um_set *set, const char *key,
+                                unsigned int hash)
+{
+  unsigned int i = hash & (set->size - 1);
+  struct um_entry *e;
+
+  while ((e = &set->entries[i])->key &&
+         (e->hash != hash || strcmp(e->key, key)))
+  {
+    i = (i + 1) & (set->size - 1);
+  }
+
+  return e;
+}
+
+struct um_entry *um_set_find(const struct um_set *set, const char *key)
+{
+  struct um_entry *e;
+
+  if (!set->size) return 0;
+  e = um_slot(set, key, um_hash(key));
+  return e->key ? e : 0;
+}
+
+static int um_set_grow(struct um_set *set)
+{
+  struct um_entry *old = set->entries, *e;
+  unsigned int i, size = set->size;
+
+  if (!(set->entries = (struct um_entry *)
+        calloc(size ? size * 2 : 64, sizeof(*set->entries))))
+  {
+    set->entries = old;
+    return 0;
+  }
+  set->size = size ? size * 2 : 64;
+
+  for (i = 0; i < size; i++)
+  {
+    if (old[i].key)
+    {
+      e = um_slot(set, old[i].key, old[i].hash);
+      *e = old[i];
+    }
+  }
+  free(old);
+
+  return 1;
+}
+
+struct um_entry *um_set_add(struct um_set *set, const char *key, int value,
+                            int *added)
+{
+  unsigned int hash = um_hash(key);
+  struct um_entry *e;
+
+  if (added) *added = 0;
+
+  /* Keep the load factor under 3/4 */
+  if ((set->len + 1) * 4 > set->size * 3 && !um_set_grow(set)) return 0;
+
+  e = um_slot(set, key, hash);
+  if (!e->key)
+  {
+    if (!(e->key = um_strdup(&set->arena, key))) return 0;
+    e->hash = hash;
+    e->value = value;
+    set->len++;
+    if (added) *added = 1;
+  }
+
+  return e;
+}
+
+void um_set_free(struct um_set *set)
+{
+  free(set->entries);
+  set->entries = 0;
+  set->size = set->len = 0;
+  um_arena_free(&set->arena);
+}
+
+int um_buf_add(struct um_buf *b, const char *s, size_t len)
+{
+  size_t size = b->size ? b->size : 256;
+  char *p;
+
+  if (b->len + len > b->size)
+  {
+    while (size < b->len + len) size *= 2;
+    if (!(p = (char *)realloc(b->buf, size))) return 0;
+    b->buf = p;
+    b->size = size;
+  }
+  memcpy(b->buf + b->len, s, len);
+  b->len += len;
+
+  return 1;
+}
+
+void um_buf_free(struct um_buf *b)
+{
+  free(b->buf);
+  b->buf = 0;
+  b->len = b->size = 0;
+}
+
+/* Read with a single fread(). Text mode is kept, so line endings are
+   converted on Windows as with fgetc(). */
+char *um_readfile(const char *fname, size_t *len)
+{
+  FILE *fp;
+  struct stat info;
+  char *data = 0;
+
+  if (fp = fopen(fname, "r"))
+  {
+    if (!fstat(fileno(fp), &info) &&
+        (data = (char *)malloc((size_t)info.st_size + 1)))
+    {
+      *len = fread(data, 1, (size_t)info.st_size, fp);
+      data[*len] = '\0';
+    }
+    else fprintf(stderr, "Memory not allocated");
+    fclose(fp);
+  }
+  else fprintf(stderr, "Error opening: %s\n", fname);
+
+  return data;
+}
+
+unsigned long long um_hash64(const void *data, size_t len,
+                             unsigned long long h)
+{
+  const unsigned char *p = (const unsigned char *)data;
+
+  if (!h) h = 14695981039346656037ull;
+  while (len--) h = (h ^ *p++) * 1099511628211ull;
+
+  return h;
+}
+
+int um_scan_includes(const char *data, size_t len, struct um_buf *out)
+{
+  char *include = "include ( |";
+  size_t pos = 0, start = 0;
+  int i = 0, n = 0, ininc = 0, incomm = 0, incomn = 0;
+  char bch, ch = 1;
+
+  while ((bch = ch) && pos < len && (ch = data[pos++]) != -1)
+  {
+    if (!incomm && bch == '/' && ch == '*') { incomm = 1; continue; }
+    if (incomm && bch == '*' && ch == '/') { incomm = 0; continue; }
+    if (!incomn && bch == '/' && ch == '/') { incomn = 1; continue; }
+    if (incomn && ch == '\n') { incomn = 0; continue; }
+
+    if (!incomm && !incomn)
+    {
+      if (!ininc)
+      {
+        if (include[i] == ' ')
+        {
+          if (isspace((unsigned char)ch)) continue;
+          i++;
+        }
+        if (include[i] == ch) i++;
+        else
+        {
+          if (include[i] == '|' && (ch == '\'' || ch == '"'))
+          {
+            ininc = 1;
+            start = out->len;
+          }
+          i = 0;
+        }
+      }
+      else if (ch == '\'' || ch == '"')
+      {
+        um_buf_add(out, "", 1);
+        ininc = 0;
+        n++;
+      }
+      else um_buf_add(out, &ch, 1);
+    }
+  }
+
+  /* Drop an include left open at the end */
+  if (ininc) out->len = start;
+
+  return n;
+}
+
+static int um_isident(int c)
+{
+  return isalnum(c) || c == '_' || c == '$' || c == '\\' || c >= 0x80;
+}
+
+static int um_isin(int c, const char *set)
+{
+  return c && strchr(set, c);
+}
+
+/* End of the string, regular expression or kept comment that starts at p,
+   not past a line end where it cannot go on. Substitutions in templates are
+   skipped whole, along with the strings, templates and comments in them. */
+static const char *um_skip_literal(const char *p, const char *end)
+{
+  int quote = *p++, inclass = 0, depth;
+
+  if (quote == '/' && p < end && *p == '*')
+  {
+    for (p++; p + 1 < end && (p[0] != '*' || p[1] != '/'); p++) ;
+    return p + 1 < end ? p + 2 : end;
+  }
+
+  for (; p < end; p++)
+  {
+    if (*p == '\\' && p + 1 < end) p++;
+    else if (*p == '\n' && quote != '`') break;
+    else if (quote == '`' && *p == '$' && p + 1 < end && p[1] == '{')
+    {
+      for (p += 2, depth = 1; p < end && (*p != '}' || --depth); )
+      {
+        if (um_isin(*p, "'\"`") || (*p == '/' && p + 1 < end && p[1] == '*'))
+        {
+          p = um_skip_literal(p, end);
+        }
+        else if (*p == '/' && p + 1 < end && p[1] == '/')
+        {
+          while (p < end && *p != '\n') p++;
+        }
+        else if (*p++ == '{') depth++;
+      }
+      if (p == end) break;
+    }
+    else if (quote == '/' && *p == '[') inclass = 1;
+    else if (quote == '/' && *p == ']') inclass = 0;
+    else if (*p == quote && !inclass)
+    {
+      p++;
+      break;
+    }
+  }
+
+  return p;
+}
+
+/* Copy the string, regular expression or kept comment that starts at p */
+static const char *um_copy_literal(const char *p, const char *end,
+                                   struct um_buf *out)
+{
+  const char *q = um_skip_literal(p, end);
+
+  um_buf_add(out, p, q - p);
+  return q;
+}
+
+/* Whether a / after what was written starts a regular expression */
+static int um_regex_ok(const struct um_buf *out, size_t word, size_t len,
+                       int last)
+{
+  static const char *keywords[] = { "return", "typeof", "case", "do", "else",
+    "in", "new", "delete", "void", "throw", "instanceof", 0 };
+  int i;
+
+  if (!last || um_isin(last, "(,=:[!&|?{};+-*%<>~^")) return 1;
+  if (!um_isident(last)) return 0;
+  for (i = 0; keywords[i]; i++)
+  {
+    if (strlen(keywords[i]) == len && !memcmp(out->buf + word, keywords[i], len))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Drop a comment from out: at level 1, when it stands alone on its line,
+   the line goes as well. Return where to go on in the input. */
+static const char *um_drop_comment(const char *p, const char *end,
+                                   struct um_buf *out, size_t line)
+{
+  while (out->len > line &&
+         (out->buf[out->len - 1] == ' ' || out->buf[out->len - 1] == '\t'))
+  {
+    out->len--;
+  }
+  if (out->len == line)
+  {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p == '\r') p++;
+    if (p < end && *p == '\n') p++;
+  }
+
+  return p;
+}
+
+static void um_mark(struct um_buf *marks, size_t out, size_t in)
+{
+  size_t mark[2];
+
+  mark[0] = out;
+  mark[1] = in;
+  um_buf_add(marks, (const char *)mark, sizeof(mark));
+}
+
+void um_minify_js(const char *data, size_t len, int level,
+                  struct um_buf *out, struct um_buf *marks)
+{
+  const char *p = data, *end = data + len, *q;
+  size_t word = 0, wordlen = 0, line = out->len, base = out->len;
+  int last = 0, space = 0, mark = 1, c;
+
+  while (p < end)
+  {
+    c = (unsigned char)*p;
+
+    /* Comments count as whitespace, a newline if they span lines */
+    if (c == '/' && p + 1 < end && (p[1] == '/' || p[1] == '*') &&
+        !(p[1] == '*' && p + 2 < end && p[2] == '!'))
+    {
+      if (p[1] == '/')
+      {
+        if (!(q = (const char *)memchr(p, '\n', end - p))) q = end;
+      }
+      else
+      {
+        for (q = p + 2; q + 1 < end && (q[0] != '*' || q[1] != '/'); q++) ;
+        q = q + 1 < end ? q + 2 : end;
+        if (memchr(p, '\n', q - p)) space = 2;
+      }
+      if (!space) space = 1;
+      p = q;
+      mark = 1;
+
+      if (level < 2)
+      {
+        p = um_drop_comment(p, end, out, line);
+        if (out->len != line && space == 2)
+        {
+          /* Code on both sides of a comment that spanned lines stays on
+             two lines, since a semicolon may be inserted in between */
+          for (q = p; q < end && um_isin(*q, " \t\r"); q++) ;
+          if (q < end && *q != '\n')
+          {
+            um_buf_add(out, "\n", 1);
+            line = out->len;
+          }
+          space = 0;
+        }
+        else if (out->len == line || (p < end && isspace((unsigned char)*p)))
+        {
+          space = 0;
+        }
+      }
+      continue;
+    }
+
+    if (isspace(c))
+    {
+      if (level < 2)
+      {
+        um_buf_add(out, p, 1);
+        if (c == '\n') line = out->len;
+        space = 0;
+      }
+      else if (c == '\n' || c == '\r') space = 2;
+      else if (!space) space = 1;
+      p++;
+      mark = 1;
+      continue;
+    }
+
+    /* Whitespace is only kept between tokens that would run together, and
+       line ends where a semicolon could be inserted, or between files */
+    if (space)
+    {
+      if (!last)
+      {
+        if (space == 2) um_buf_add(out, "\n", 1);
+      }
+      else if (space == 2 &&
+               (um_isident(last) || um_isin(last, ")]}'\"`+-")) &&
+               (um_isident(c) || um_isin(c, "([{'\"`+-/!~")))
+      {
+        um_buf_add(out, "\n", 1);
+      }
+      else if ((um_isident(last) && um_isident(c)) ||
+               (last == c && um_isin(c, "+-/")) ||
+               (last == '/' && c == '*') ||
+               (isdigit(last) && c == '.'))
+      {
+        um_buf_add(out, " ", 1);
+      }
+      space = 0;
+    }
+    if (mark && marks) um_mark(marks, out->len - base, p - data);
+    mark = 0;
+
+    /* Kept comments are copied like literals */
+    if (um_isin(c, "'\"`") ||
+        (c == '/' && ((p + 1 < end && p[1] == '*') ||
+                      um_regex_ok(out, word, wordlen, last))))
+    {
+      p = um_copy_literal(p, end, out);
+      last = (unsigned char)out->buf[out->len - 1];
+      wordlen = 0;
+      continue;
+    }
+
+    if (!um_isident(c)) wordlen = 0;
+    else if (!wordlen || word + wordlen != out->len)
+    {
+      word = out->len;
+      wordlen = 1;
+    }
+    else wordlen++;
+    um_buf_add(out, p++, 1);
+    last = c;
+  }
+
+  if (space == 2 && level >= 2) um_buf_add(out, "\n", 1);
+}
+
+void um_minify_css(const char *data, size_t len, int level,
+                   struct um_buf *out, struct um_buf *marks)
+{
+  const char *p = data, *end = data + len, *q;
+  size_t line = out->len, base = out->len;
+  int last = 0, space = 0, mark = 1, c;
+
+  while (p < end)
+  {
+    c = (unsigned char)*p;
+
+    if (c == '/' && p + 1 < end && p[1] == '*' &&
+        !(p + 2 < end && p[2] == '!'))
+    {
+      for (q = p + 2; q + 1 < end && (q[0] != '*' || q[1] != '/'); q++) ;
+      p = q + 1 < end ? q + 2 : end;
+      if (!space) space = 1;
+      mark = 1;
+
+      if (level < 2)
+      {
+        p = um_drop_comment(p, end, out, line);
+        if (out->len == line || (p < end && isspace((unsigned char)*p)))
+        {
+          space = 0;
+        }
+      }
+      continue;
+    }
+
+    if (isspace(c))
+    {
+      if (level < 2)
+      {
+        um_buf_add(out, p, 1);
+        if (c == '\n') line = out->len;
+        space = 0;
+      }
+      else space = 1;
+      p++;
+      mark = 1;
+      continue;
+    }
+
+    /* No space is needed around braces, semicolons, commas and child
+       combinators, nor after colons */
+    if (space && last && !um_isin(last, "{};,>:") && !um_isin(c, "{};,>"))
+    {
+      um_buf_add(out, " ", 1);
+    }
+    space = 0;
+
+    if (c == '}' && last == ';' && level >= 2) out->len--;
+    if (mark && marks) um_mark(marks, out->len - base, p - data);
+    mark = 0;
+
+    if (c == '\'' || c == '"' || (c == '/' && p + 1 < end && p[1] == '*'))
+    {
+      p = um_copy_literal(p, end, out);
+      last = (unsigned char)out->buf[out->len - 1];
+      continue;
+    }
+
+    um_buf_add(out, p++, 1);
+    last = c;
+  }
+}
+
+static void um_vlq(struct um_buf *out, int value)
+{
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  unsigned int v = value < 0 ? ((unsigned int)-value << 1) | 1 : value << 1;
+  int digit;
+
+  do
+  {
+    digit = v & 31;
+    v >>= 5;
+    if (v) digit |= 32;
+    um_buf_add(out, &digits[digit], 1);
+  }
+  while (v);
+}
+
+int um_srcmap_source(struct um_srcmap *map, const char *path)
+{
+  const char *p;
+
+  /* Sources are URLs, with forward slashes */
+  if (map->num_sources) um_buf_add(&map->sources, ",", 1);
+  um_buf_add(&map->sources, "\"", 1);
+  for (p = path; *p; p++)
+  {
+    if (*p == '"') um_buf_add(&map->sources, "\\", 1);
+    um_buf_add(&map->sources, *p == '\\' ? "/" : p, 1);
+  }
+  um_buf_add(&map->sources, "\"", 1);
+
+  return map->num_sources++;
+}
+
+void um_srcmap_text(struct um_srcmap *map, const char *text, size_t len)
+{
+  const char *p, *end = text + len;
+
+  for (p = text; p < end; p++)
+  {
+    if (*p == '\n')
+    {
+      um_buf_add(&map->mappings, ";", 1);
+      map->line++;
+      map->col = map->seg_col = map->line_segs = 0;
+    }
+    else if ((*p & 0xc0) != 0x80) map->col++;   /* UTF-8 lead bytes only */
+  }
+}
+
+void um_srcmap_mark(struct um_srcmap *map, int src, int line, int col)
+{
+  if (map->line_segs++) um_buf_add(&map->mappings, ",", 1);
+  um_vlq(&map->mappings, map->col - map->seg_col);
+  um_vlq(&map->mappings, src - map->seg_src);
+  um_vlq(&map->mappings, line - map->seg_line);
+  um_vlq(&map->mappings, col - map->seg_srccol);
+  map->seg_col = map->col;
+  map->seg_src = src;
+  map->seg_line = line;
+  map->seg_srccol = col;
+}
+
+int um_srcmap_write(const struct um_srcmap *map, const char *fname,
+                    const char *file)
+{
+  FILE *fp;
+  int ok;
+
+  if (!(fp = fopen(fname, "w"))) return 0;
+  fprintf(fp, "{\"version\":3,\"file\":\"%s\",\"sources\":[", file);
+  fwrite(map->sources.buf, 1, map->sources.len, fp);
+  fprintf(fp, "],\"names\":[],\"mappings\":\"");
+  fwrite(map->mappings.buf, 1, map->mappings.len, fp);
+  fprintf(fp, "\"}\n");
+  ok = !ferror(fp);
+
+  return !fclose(fp) && ok;
+}
+
+void um_srcmap_free(struct um_srcmap *map)
+{
+  um_buf_free(&map->sources);
+  um_buf_free(&map->mappings);
+  memset(map, 0, sizeof(*map));
+}
+
+long long um_mtime(const struct stat *st)
+{
+#ifdef __linux__
+  return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+  return st->st_mtime * 1000000000LL;
+#endif
+}
+
+/* Cache file is text. Each entry is a line with mtime, size, hash, parsed
+   flag, number of includes and path, tab-separated, then one line per
+   include. The first line is the magic, with the format and the output
+   version, and a cache with any other is ignored. */
+#define UM_CACHE_MAGIC "umcache 1 " UM_OUTPUT_VERSION
+
+static struct um_cache_entry *um_cache_add(struct um_cache *cache,
+                                           const char *path,
+                                           long long mtime, long long size,
+                                           unsigned long long hash,
+                                           const char *incs, size_t incs_len,
+                                           int num_incs)
+{
+  struct um_cache_entry *e;
+  struct um_entry *ie;
+  char *copy = 0;
+  int added = 0;
+
+  if (incs && incs_len && (copy = (char *)um_alloc(&cache->arena, incs_len)))
+  {
+    memcpy(copy, incs, incs_len);
+  }
+  if ((incs && incs_len && !copy) ||
+      !(e = (struct um_cache_entry *)
+        um_grow(cache->entries, &cache->size, cache->len, sizeof *e)))
+  {
+    return 0;
+  }
+  cache->entries = e;
+  if (!(ie = um_set_add(&cache->index, path, cache->len, &added))) return 0;
+
+  e = &cache->entries[ie->value];
+  if (added)
+  {
+    e->path = ie->key;
+    cache->len++;
+  }
+  e->mtime = mtime;
+  e->size = size;
+  e->hash = hash;
+  e->parsed = incs != 0;
+  e->num_incs = incs ? num_incs : 0;
+  e->incs = copy ? copy : "";
+  cache->dirty = 1;
+
+  return e;
+}
+
+void um_cache_load(struct um_cache *cache, const char *fname)
+{
+  char line[8192], inc[8192], *path;
+  struct um_buf incs;
+  long long mtime, size;
+  unsigned long long hash;
+  int parsed, n, i, ofs;
+  FILE *fp;
+
+  memset(cache, 0, sizeof(*cache));
+  memset(&incs, 0, sizeof(incs));
+  if (!fname || !(cache->fname = (char *)malloc(strlen(fname) + 1))) return;
+  strcpy(cache->fname, fname);
+
+  if (!(fp = fopen(fname, "r"))) return;
+  if (fgets(line, sizeof(line), fp) &&
+      !strcmp(line, UM_CACHE_MAGIC "\n"))
+  {
+    while (fgets(line, sizeof(line), fp))
+    {
+      if (sscanf(line, "%lld\t%lld\t%llx\t%d\t%d\t%n", &mtime, &size, &hash,
+                 &parsed, &n, &ofs) != 5 || n < 0) break;
+      path = line + ofs;
+      path[strcspn(path, "\r\n")] = '\0';
+
+      incs.len = 0;
+      for (i = 0; i < n && fgets(inc, sizeof(inc), fp); i++)
+      {
+        inc[strcspn(inc, "\r\n")] = '\0';
+        um_buf_add(&incs, inc, strlen(inc) + 1);
+      }
+      if (i < n) break;
+
+      um_cache_add(cache, path, mtime, size, hash,
+                   parsed ? (incs.buf ? incs.buf : "") : 0, incs.len, n);
+    }
+  }
+
+  fclose(fp);
+  um_buf_free(&incs);
+  cache->dirty = 0;
+}
+
+/* Written to a temporary file first, so that readers never see half of it.
+   When several runs share the cache, the last one to finish wins. */
+int um_cache_save(struct um_cache *cache)
+{
+  struct um_cache_entry *e;
+  const char *inc;
+  char *tmp;
+  FILE *fp;
+  int i, j, ok;
+
+  if (!cache->fname || !*cache->fname || !cache->dirty) return 1;
+  if (!(tmp = (char *)malloc(strlen(cache->fname) + 32))) return 0;
+  sprintf(tmp, "%s.%d.tmp", cache->fname, (int)getpid());
+
+  if (!(fp = fopen(tmp, "w")))
+  {
+    free(tmp);
+    return 0;
+  }
+
+  fprintf(fp, "%s\n", UM_CACHE_MAGIC);
+  for (i = 0; i < cache->len; i++)
+  {
+    e = &cache->entries[i];
+    fprintf(fp, "%lld\t%lld\t%llx\t%d\t%d\t%s\n", e->mtime, e->size, e->hash,
+            e->parsed, e->num_incs, e->path);
+    for (j = 0, inc = e->incs; j < e->num_incs; j++, inc += strlen(inc) + 1)
+    {
+      fprintf(fp, "%s\n", inc);
+    }
+  }
+
+  ok = !ferror(fp);
+  ok = !fclose(fp) && ok;
+#ifdef _WIN32
+  if (ok) remove(cache->fname);
+#endif
+  if (!ok || rename(tmp, cache->fname))
+  {
+    remove(tmp);
+    ok = 0;
+  }
+  free(tmp);
+  if (ok) cache->dirty = 0;
+
+  return ok;
+}
+
+void um_cache_free(struct um_cache *cache)
+{
+  free(cache->fname);
+  free(cache->entries);
+  um_set_free(&cache->index);
+  um_arena_free(&cache->arena);
+  memset(cache, 0, sizeof(*cache));
+}
+
+struct um_cache_entry *um_cache_find(const struct um_cache *cache,
+                                     const char *path, const struct stat *st)
+{
+  struct um_cache_entry *e;
+  struct um_entry *ie;
+
+  if (!cache->fname || !(ie = um_set_find(&cache->index, path))) return 0;
+  e = &cache->entries[ie->value];
+
+  return e->mtime == um_mtime(st) &&
+    e->size == (long long)st->st_size ? e : 0;
+}
+
+void um_cache_put(struct um_cache *cache, const char *path,
+                  const struct stat *st, unsigned long long hash,
+                  const char *incs, size_t incs_len, int num_incs)
+{
+  if (cache->fname)
+  {
+    um_cache_add(cache, path, um_mtime(st), (long long)st->st_size,
+                 hash, incs, incs_len, num_incs);
+  }
+}
+
+#define UM_WATCH_SETTLE 20  /* Milliseconds without events */
+
+int um_watch_init(struct um_watch *watch)
+{
+  memset(watch, 0, sizeof(*watch));
+#ifdef __linux__
+  watch->fd = inotify_init1(IN_CLOEXEC);
+#else
+  watch->fd = -1;
+#endif
+
+  return watch->fd >= 0;
+}
+
+void um_watch_dir(struct um_watch *watch, const char *dir)
+{
+#ifdef __linux__
+  struct um_entry *e;
+  char **p;
+  int wd, added = 0;
+
+  if (watch->fd < 0 ||
+      ((e = um_set_find(&watch->dirs, dir)) && e->value >= 0)) return;
+  if ((wd = inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_CREATE |
+                              IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                              IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)) < 0)
+  {
+    return;
+  }
+  if (!(e = um_set_add(&watch->dirs, dir, wd, &added))) return;
+  e->value = wd;
+
+  while (watch->pathssize <= wd)
+  {
+    if (!(p = (char **)um_grow(watch->paths, &watch->pathslen,
+                               watch->pathssize, sizeof *p))) return;
+    watch->paths = p;
+    watch->paths[watch->pathssize++] = 0;
+  }
+  watch->paths[wd] = (char *)e->key;
+#endif
+}
+
+int um_watch_wait(struct um_watch *watch, struct um_buf *changed)
+{
+#ifdef __linux__
+  long buf[8192 / sizeof(long)];     /* Aligned for the events */
+  const struct inotify_event *ev;
+  struct um_entry *e;
+  struct pollfd pfd;
+  const char *dir;
+  ssize_t len;
+  char *p;
+  int n = 0, r;
+
+  if (watch->fd < 0) return -1;
+  pfd.fd = watch->fd;
+  pfd.events = POLLIN;
+
+  for (;;)
+  {
+    if ((r = poll(&pfd, 1, n ? UM_WATCH_SETTLE : -1)) < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (r <= 0) break;
+    if ((len = read(watch->fd, buf, sizeof(buf))) <= 0)
+    {
+      if (len < 0 && errno == EINTR) continue;
+      break;
+    }
+
+    for (p = (char *)buf; p < (char *)buf + len; p += sizeof(*ev) + ev->len)
+    {
+      ev = (const struct inotify_event *)p;
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+        um_buf_add(changed, "", 1);
+        n++;
+        continue;
+      }
+      if (ev->wd < 0 || ev->wd >= watch->pathssize ||
+          !(dir = watch->paths[ev->wd])) continue;
+
+      um_buf_add(changed, dir, strlen(dir));
+      if (ev->len)
+      {
+        um_buf_add(changed, "/", 1);
+        um_buf_add(changed, ev->name, strlen(ev->name));
+      }
+      um_buf_add(changed, "", 1);
+      n++;
+
+      /* Directory is gone, it is watched again if it comes back */
+      if (ev->mask & IN_IGNORED)
+      {
+        if (e = um_set_find(&watch->dirs, dir)) e->value = -1;
+        watch->paths[ev->wd] = 0;
+      }
+    }
+  }
+
+  return n ? n : -1;
+#else
+  return -1;
+#endif
+}
+
+void um_watch_free(struct um_watch *watch)
+{
+#ifdef __linux__
+  if (watch->fd >= 0) close(watch->fd);
+#endif
+  free(watch->paths);
+  um_set_free(&watch->dirs);
+  memset(watch, 0, sizeof(*watch));
+  watch->fd = -1;
+}
+
+struct um_job
+{
+  void (*fn)(void *, int);
+  void *param;
+  int n;
+  volatile long next;
+};
+
+static int um_next(struct um_job *job)
+{
+#ifdef _WIN32
+  return (int)InterlockedIncrement(&job->next) - 1;
+#else
+  return (int)__sync_fetch_and_add(&job->next, 1);
+#endif
+}
+
+#ifdef _WIN32
+static unsigned __stdcall um_worker(void *p)
+#else
+static void *um_worker(void *p)
+#endif
+{
+  struct um_job *job = (struct um_job *)p;
+  int i;
+
+  while ((i = um_next(job)) < job->n) job->fn(job->param, i);
+
+  return 0;
+}
+
+void um_parallel(int n, int num_threads, void (*fn)(void *, int),
+                 void *param)
+{
+  struct um_job job;
+  um_thread *threads = 0;
+  int i, started = 0;
+
+  job.fn = fn;
+  job.param = param;
+  job.n = n;
+  job.next = 0;
+
+  if (num_threads > n) num_threads = n;
+  if (num_threads > 1 &&
+      (threads = (um_thread *)malloc((num_threads - 1) * sizeof(*threads))))
+  {
+    for (i = 0; i < num_threads - 1; i++, started++)
+    {
+#ifdef _WIN32
+      if (!(threads[i] = (HANDLE)_beginthreadex(0, 0, um_worker, &job, 0, 0)))
+        break;
+#else
+      if (pthread_create(&threads[i], 0, um_worker, &job)) break;
+#endif
+    }
+  }
+
+  /* This thread works too, and does everything if no thread started */
+  um_worker(&job);
+
+  for (i = 0; i < started; i++)
+  {
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], 0);
+#endif
+  }
+  free(threads);
+}
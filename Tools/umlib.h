@@ -0,0 +1,176 @@
+/*=============================================================================
+
+  This file is part of the Umbrella project.
+  Copyright (C) The Juston.co Owners - All rights reserved.
+
+  For more details, visit http://juston.co/umbrella
+
+==============================================================================*/
+
+#ifndef UMLIB_H
+#define UMLIB_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+/* Strings are copied into large blocks and freed all at once. */
+struct um_block;
+struct um_arena
+{
+  struct um_block *blocks;
+  char *ptr;
+  size_t left;
+};
+
+void *um_alloc(struct um_arena *arena, size_t size);
+char *um_strdup(struct um_arena *arena, const char *s);
+void um_arena_free(struct um_arena *arena);
+
+/* Make room for one more element after len, doubling the capacity. Return
+   the new array, or 0 if out of memory and the old one is kept. */
+void *um_grow(void *array, int *cap, int len, size_t elsize);
+
+/* Open-addressing hash set of strings, each with an int value. Keys are
+   copied into the set's arena. Entries move when the set grows, so
+   pointers returned are only valid until the next um_set_add(). */
+struct um_entry
+{
+  const char *key;
+  unsigned int hash;
+  int value;
+};
+
+struct um_set
+{
+  struct um_entry *entries;
+  unsigned int size, len;   /* Size is a power of 2 */
+  struct um_arena arena;
+};
+
+struct um_entry *um_set_find(const struct um_set *set, const char *key);
+struct um_entry *um_set_add(struct um_set *set, const char *key, int value,
+                            int *added);
+void um_set_free(struct um_set *set);
+
+/* Growing output buffer */
+struct um_buf
+{
+  char *buf;
+  size_t len, size;
+};
+
+int um_buf_add(struct um_buf *b, const char *s, size_t len);
+void um_buf_free(struct um_buf *b);
+
+/* Read the whole file, NUL-terminated, in text mode. Return 0 on error. */
+char *um_readfile(const char *fname, size_t *len);
+
+/* 64-bit FNV-1a, start with h = 0 */
+unsigned long long um_hash64(const void *data, size_t len,
+                             unsigned long long h);
+
+/* Append include('...') targets found in data to out, each NUL-terminated,
+   skipping comments. Return their number. */
+int um_scan_includes(const char *data, size_t len, struct um_buf *out);
+
+/* Append data minified to out. Level 1 removes comments, along with the
+   lines they stood alone on; level 2 also removes whitespace wherever the
+   meaning stays the same. Strings, regular expressions and comments
+   opened with a bang, which are usually licenses, are left as they are.
+   If marks is given, the offset in what was appended and in data of each
+   token after whitespace or a comment is added to it, as two size_t. */
+void um_minify_js(const char *data, size_t len, int level,
+                  struct um_buf *out, struct um_buf *marks);
+void um_minify_css(const char *data, size_t len, int level,
+                   struct um_buf *out, struct um_buf *marks);
+
+/* Version of what the tools write for given inputs. Change it along with
+   the minifier, or the bundles, preamble and source maps umcomp writes: it
+   goes into the cache magic and into the signature of each umcomp output,
+   so that outputs of an older build are never taken as up to date. */
+#define UM_OUTPUT_VERSION "2"
+
+/* Source map, version 3. The generated position moves over the text given
+   to um_srcmap_text(), and um_srcmap_mark() maps it to a line and column,
+   counted from 0, of a source added with um_srcmap_source(). */
+struct um_srcmap
+{
+  struct um_buf sources;    /* JSON strings, comma-separated */
+  struct um_buf mappings;
+  int num_sources;
+  int line, col;            /* Generated position */
+  int seg_col, seg_src, seg_line, seg_srccol;   /* Last segment */
+  int line_segs;            /* Segments on the generated line */
+};
+
+int um_srcmap_source(struct um_srcmap *map, const char *path);
+void um_srcmap_text(struct um_srcmap *map, const char *text, size_t len);
+void um_srcmap_mark(struct um_srcmap *map, int src, int line, int col);
+int um_srcmap_write(const struct um_srcmap *map, const char *fname,
+                    const char *file);
+void um_srcmap_free(struct um_srcmap *map);
+
+/* Modification time in nanoseconds, where the system keeps them, so that
+   two saves in the same second are told apart */
+long long um_mtime(const struct stat *st);
+
+/* Persistent cache of file scans, keyed by path and valid while mtime and
+   size stay the same. Tools keep entries they do not use, so several of
+   them can share one file. */
+struct um_cache_entry
+{
+  const char *path;
+  long long mtime, size;
+  unsigned long long hash;  /* Of contents, or of inputs for outputs */
+  int parsed;               /* incs are known */
+  int num_incs;
+  const char *incs;         /* NUL-terminated include targets */
+};
+
+struct um_cache
+{
+  char *fname;              /* 0 disables the cache, "" keeps it in memory */
+  struct um_set index;
+  struct um_cache_entry *entries;
+  int len, size;
+  struct um_arena arena;
+  int dirty;
+};
+
+void um_cache_load(struct um_cache *cache, const char *fname);
+int um_cache_save(struct um_cache *cache);
+void um_cache_free(struct um_cache *cache);
+struct um_cache_entry *um_cache_find(const struct um_cache *cache,
+                                     const char *path, const struct stat *st);
+void um_cache_put(struct um_cache *cache, const char *path,
+                  const struct stat *st, unsigned long long hash,
+                  const char *incs, size_t incs_len, int num_incs);
+
+/* Directories watched for changes, with inotify. Elsewhere um_watch_init()
+   returns 0 and nothing is watched. */
+struct um_watch
+{
+  int fd;
+  struct um_set dirs;       /* Value is the watch descriptor, -1 once gone */
+  char **paths;             /* Directory of each watch descriptor */
+  int pathslen, pathssize;
+};
+
+int um_watch_init(struct um_watch *watch);
+void um_watch_dir(struct um_watch *watch, const char *dir);
+
+/* Wait for changes, then until none came for a moment, since editors save
+   in several steps. Append the changed paths to changed, NUL-terminated.
+   An empty path means events were lost and anything may have changed.
+   Return their number, or -1 on error. */
+int um_watch_wait(struct um_watch *watch, struct um_buf *changed);
+void um_watch_free(struct um_watch *watch);
+
+/* Call fn(param, i) for every i below n, on num_threads threads. Each
+   thread takes the next index from a shared counter, so a few big items
+   do not hold the others up. */
+void um_parallel(int n, int num_threads, void (*fn)(void *, int),
+                 void *param);
+
+#endif
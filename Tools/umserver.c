@@ -363,6 +363,14 @@ static void start_umserver(int argc, char *argv[]) {
   if (argc >= 4) {
     set_option(options, "cgi_interpreter", argv[3]);
   }
+  // Anything after the positional arguments is "-option value" pairs,
+  // e.g. -reverse_proxy /api=http://127.0.0.1:9000
+  for (i = 4; i < argc; i += 2) {
+    if (argv[i][0] != '-' || i + 1 >= argc) {
+      die("Invalid command line option: [%s]", argv[i]);
+    }
+    set_option(options, &argv[i][1], argv[i + 1]);
+  }
   // end of improvisation
 
   // Update config based on command line arguments
@@ -0,0 +1,83 @@
+/*=============================================================================
+
+  This file is part of the Umbrella project.
+  Copyright (C) The Juston.co Owners - All rights reserved.
+
+  For more details, visit http://juston.co/umbrella
+
+==============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include "umlib.h"
+
+#define SIZEOF(a) (sizeof(a) / sizeof((a)[0]))
+
+struct minify_case
+{
+  int css;
+  int level;
+  const char *in;
+  const char *out;
+};
+
+struct minify_case cases[] =
+{
+  { 0, 1, "var a = 1; // one\nvar b = 2;\n", "var a = 1;\nvar b = 2;\n" },
+  { 0, 2, "var a = 1; // one\nvar b = 2;\n", "var a=1;var b=2;\n" },
+  { 0, 2, "a = b / c / d; r = /[/]\\//g;\n", "a=b/c/d;r=/[/]\\//g;\n" },
+  { 0, 2, "x = a + +b - -c;\n", "x=a+ +b- -c;\n" },
+  { 0, 2, "/*! License */\nf();\n", "/*! License */f();\n" },
+
+  /* Templates go on past their substitutions, whatever those hold */
+  { 0, 1, "var s = `x${`a // b`}y`; // c\nf();\n",
+    "var s = `x${`a // b`}y`;\nf();\n" },
+  { 0, 2, "var s = `x${`a // b`}y`; // c\nf();\n",
+    "var s=`x${`a // b`}y`;f();\n" },
+  { 0, 2, "t = `${ {a: '}'}.a } /* no */ ${ /* } */ 1 }`;\n",
+    "t=`${ {a: '}'}.a } /* no */ ${ /* } */ 1 }`;\n" },
+  { 0, 2, "x = `a\n${b ? `c${d}` : \"}\"}`\nz()\n",
+    "x=`a\n${b ? `c${d}` : \"}\"}`\nz()\n" },
+
+  /* A comment spanning lines stands for a line end */
+  { 0, 1, "var a = 1 /* x\n */ b = 2\n", "var a = 1\n b = 2\n" },
+  { 0, 2, "var a = 1 /* x\n */ b = 2\n", "var a=1\nb=2\n" },
+  { 0, 1, "a = 1 /* x\n */\nb = 2\n", "a = 1\nb = 2\n" },
+
+  { 1, 1, "a { color: red; } /* x */\nb { }\n", "a { color: red; }\nb { }\n" },
+  { 1, 2, "a > b , c :hover { color: red ; }\n", "a>b,c :hover{color:red}" }
+};
+
+int main()
+{
+  struct um_buf out;
+  int i, failed = 0;
+
+  memset(&out, 0, sizeof(out));
+  for (i = 0; i < (int)SIZEOF(cases); i++)
+  {
+    out.len = 0;
+    if (cases[i].css)
+    {
+      um_minify_css(cases[i].in, strlen(cases[i].in), cases[i].level, &out, 0);
+    }
+    else
+    {
+      um_minify_js(cases[i].in, strlen(cases[i].in), cases[i].level, &out, 0);
+    }
+
+    if (out.len != strlen(cases[i].out) ||
+        memcmp(out.buf, cases[i].out, out.len))
+    {
+      printf("FAILED: level %d\n%s\ngave:\n%.*s\nexpected:\n%s\n",
+             cases[i].level, cases[i].in, (int)out.len, out.buf,
+             cases[i].out);
+      failed++;
+    }
+  }
+  um_buf_free(&out);
+
+  printf("%d of %d minify cases passed\n", (int)SIZEOF(cases) - failed,
+         (int)SIZEOF(cases));
+  return failed != 0;
+}
@@ -11,15 +11,23 @@ if "%1" == "" (
 if "%2" == "" (
   set lang=multi
 ) else (
-  set lang=%2
+  set lang=%~2
+)
+if "%3" == "" (
+  set level=0
+) else (
+  set level=%3
 )
 set main_path=work\%app:.=/%\Main.js
 if "%lang%" == "multi" (
   set out_js=Results\%app%.js
+) else if not "%lang%" == "%lang:,=%" (
+  set out_js=Results\%app%.js
 ) else (
   set out_js=Results\%app%.%lang%.js
 )
 set out_css=Results\%app%.css
+set cache=Results\.umcache
 for /f "delims=." %%a in ("%app%") do (
   set res_path=Global/%%a/
   goto :break
@@ -31,7 +39,7 @@ if not exist %main_path% (
   goto :eof
 )
 
-%compiler% %main_path% %lang% %res_path% -out_js %out_js% -out_css %out_css%
+%compiler% %main_path% %lang% %res_path% -out_js %out_js% -out_css %out_css% -level %level% -cache %cache%
 
 echo OK: Results written to '%out_js%' and '%out_css%'.
 
@@ -4,12 +4,15 @@ compiler=tools/umcomp
 app=${1:-Demos.Hello}
 main_path=Work/${app//.//}/Main.js
 lang=${2:-multi}
-if [ "$lang" == "multi" ]; then
+level=${3:-0}
+# Several languages, e.g. en,pt, give one results/${app}.${lang}.js each.
+if [ "$lang" == "multi" ] || [[ "$lang" == *,* ]]; then
   out_js=results/${app}.js
 else
   out_js=results/${app}.${lang}.js
 fi
 out_css=results/${app}.css
+cache=results/.umcache
 
 #res_path=assets/`echo $app | cut -d'.' -f1`/
 res_path=Global/`echo $app | cut -d'.' -f1`/
@@ -19,6 +22,6 @@ if [ ! -s "$main_path" ]; then
   exit 1
 fi
 
-$compiler $main_path $lang $res_path -out_js $out_js -out_css $out_css
+$compiler $main_path $lang $res_path -out_js $out_js -out_css $out_css -level $level -cache $cache
 
 echo "OK: Results written to '$out_js' and '$out_css'."
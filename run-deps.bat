@@ -8,6 +8,7 @@ set app_dir=Work\%1
 set res_dir=Global/
 set base_dir_from_app_dir=..
 set final=Global\Deps.js
+set cache=..\..\Results\.umcache
 
 if "%2" == "" (
   set lang=multi
@@ -32,7 +33,7 @@ if "%1" == "Demos" (
 )
 
 pushd %app_dir%
-%deps% %base_dir_from_app_dir% %res_dir% %lang% %required_libs% > %final%
+%deps% %base_dir_from_app_dir% %res_dir% %lang% %required_libs% -cache %cache% > %final%
 popd
 
 echo deps = %deps%
@@ -6,6 +6,7 @@ app_dir=Work/$1
 res_dir=Global
 base_dir_from_app_dir=..
 final=Global/Deps.js
+cache=../../results/.umcache
 lang=${2:-multi}
 
 if [ ! -d "$app_dir" ]; then
@@ -24,7 +25,7 @@ case "$1" in
 esac
 
 pushd $app_dir
-$deps $base_dir_from_app_dir $res_dir $lang $required_libs > $final
+$deps $base_dir_from_app_dir $res_dir $lang $required_libs -cache $cache > $final
 popd
 
 echo "OK: Dependency graph written to '$app_dir/$final'."